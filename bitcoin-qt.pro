@@ -101,6 +101,28 @@ contains(BITCOIN_NEED_QT_PLUGINS, 1) {
     DEFINES += HAVE_BUILD_INFO
 }
 
+# x86 SIMD SHA-256 transforms, picked at runtime by CPUID; only these
+# files are compiled with the instruction set flags
+contains(QMAKE_HOST.arch, x86)|contains(QMAKE_HOST.arch, x86_64)|contains(QMAKE_HOST.arch, i686) {
+    DEFINES += USE_SHA256_X86
+    SHA256_SSE41_SOURCES = src/sha256_sse41.cpp
+    sha256_sse41.input = SHA256_SSE41_SOURCES
+    sha256_sse41.output = ${QMAKE_FILE_BASE}.o
+    sha256_sse41.commands = $(CXX) -c $(CXXFLAGS) $(INCPATH) -msse4.1 ${QMAKE_FILE_NAME} -o ${QMAKE_FILE_OUT}
+    sha256_sse41.variable_out = OBJECTS
+    SHA256_AVX2_SOURCES = src/sha256_avx2.cpp
+    sha256_avx2.input = SHA256_AVX2_SOURCES
+    sha256_avx2.output = ${QMAKE_FILE_BASE}.o
+    sha256_avx2.commands = $(CXX) -c $(CXXFLAGS) $(INCPATH) -mavx2 ${QMAKE_FILE_NAME} -o ${QMAKE_FILE_OUT}
+    sha256_avx2.variable_out = OBJECTS
+    SHA256_SHANI_SOURCES = src/sha256_shani.cpp
+    sha256_shani.input = SHA256_SHANI_SOURCES
+    sha256_shani.output = ${QMAKE_FILE_BASE}.o
+    sha256_shani.commands = $(CXX) -c $(CXXFLAGS) $(INCPATH) -msse4.1 -msha ${QMAKE_FILE_NAME} -o ${QMAKE_FILE_OUT}
+    sha256_shani.variable_out = OBJECTS
+    QMAKE_EXTRA_COMPILERS += sha256_sse41 sha256_avx2 sha256_shani
+}
+
 QMAKE_CXXFLAGS_WARN_ON = -fdiagnostics-show-option -Wall -Wextra -Wformat -Wformat-security -Wno-unused-parameter -Wstack-protector
 
 # Input
@@ -120,6 +142,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/base58.h \
     src/bignum.h \
     src/checkpoints.h \
+    src/blockencodings.h \
+    src/bloom.h \
     src/compat.h \
     src/sync.h \
     src/util.h \
@@ -129,12 +153,15 @@ HEADERS += src/qt/bitcoingui.h \
     src/main.h \
     src/net.h \
     src/key.h \
+    src/secp256k1.h \
+    src/sha256.h \
     src/db.h \
     src/walletdb.h \
     src/script.h \
     src/init.h \
     src/irc.h \
     src/mruset.h \
+    src/memusage.h \
     src/json/json_spirit_writer_template.h \
     src/json/json_spirit_writer.h \
     src/json/json_spirit_value.h \
@@ -196,12 +223,16 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/util.cpp \
     src/netbase.cpp \
     src/key.cpp \
+    src/secp256k1.cpp \
+    src/sha256.cpp \
     src/script.cpp \
     src/main.cpp \
     src/init.cpp \
     src/net.cpp \
     src/irc.cpp \
     src/checkpoints.cpp \
+    src/blockencodings.cpp \
+    src/bloom.cpp \
     src/addrman.cpp \
     src/db.cpp \
     src/walletdb.cpp \
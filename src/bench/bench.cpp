@@ -0,0 +1,80 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <map>
+
+#include "bench.h"
+#include "main.h"
+#include "ui_interface.h"
+#include "wallet.h"
+
+using namespace std;
+
+// Globals the linked-in node code expects, as in test_bitcoin
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+void StartShutdown()
+{
+    exit(0);
+}
+
+static map<string, BenchFunction>& Benchmarks()
+{
+    static map<string, BenchFunction> mapBenchmarks;
+    return mapBenchmarks;
+}
+
+CBenchRegister::CBenchRegister(const char* pszName, BenchFunction fn)
+{
+    Benchmarks()[pszName] = fn;
+}
+
+double BenchTime(BenchStep step, void* pArg, double dMinSeconds)
+{
+    // One untimed call to warm caches and lazily built tables
+    step(pArg);
+
+    int64 nCalls = 0;
+    int64 nStart = GetTimeMicros();
+    int64 nElapsed = 0;
+    for (int64 nBatch = 1; nElapsed < dMinSeconds * 1000000; nBatch *= 2)
+    {
+        for (int64 i = 0; i < nBatch; i++)
+            step(pArg);
+        nCalls += nBatch;
+        nElapsed = GetTimeMicros() - nStart;
+    }
+    return nElapsed / 1000000.0 / nCalls;
+}
+
+void BenchReport(const string& strName, double dSecondsPerCall, double dItems, const char* pszUnit)
+{
+    if (dItems > 0)
+        printf("%-40s %12.3f us/call %14.1f %s/s\n", strName.c_str(), dSecondsPerCall * 1000000, dItems / dSecondsPerCall, pszUnit);
+    else
+        printf("%-40s %12.3f us/call\n", strName.c_str(), dSecondsPerCall * 1000000);
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    fPrintToConsole = true; // printf goes to debug.log otherwise
+    printf("SHA-256: %s\n", SHA256AutoDetect().c_str());
+
+    string strFilter = argc > 1 ? argv[1] : "";
+    for (map<string, BenchFunction>::iterator it = Benchmarks().begin(); it != Benchmarks().end(); ++it)
+    {
+        if (it->first.find(strFilter) == string::npos)
+            continue;
+        printf("# %s\n", it->first.c_str());
+        it->second();
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BENCH_H
+#define BITCOIN_BENCH_H
+
+#include <string>
+
+/** Minimal benchmark harness for bench_bitcoin.
+ *
+ * Each benchmark is a plain function registered with BENCHMARK(); it times
+ * whatever it wants with BenchTime() and prints a line per measurement with
+ * BenchReport().  Run "bench_bitcoin [filter]" to run every benchmark whose
+ * name contains filter.
+ */
+
+typedef void (*BenchFunction)();
+typedef void (*BenchStep)(void* pArg);
+
+class CBenchRegister
+{
+public:
+    CBenchRegister(const char* pszName, BenchFunction fn);
+};
+
+#define BENCHMARK(fn) static CBenchRegister benchreg_##fn(#fn, fn)
+
+// Seconds per call of step(pArg), repeating it for at least dMinSeconds
+double BenchTime(BenchStep step, void* pArg, double dMinSeconds = 0.5);
+
+// Print one result line: time per call, and per-second throughput of
+// dItems units (e.g. "tx", "MB") processed by each call
+void BenchReport(const std::string& strName, double dSecondsPerCall, double dItems = 0, const char* pszUnit = "");
+
+#endif
@@ -0,0 +1,66 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "bloom.h"
+#include "main.h"
+#include "memusage.h"
+#include "mruset.h"
+#include "net.h"
+
+using namespace std;
+
+// What a peer's known inventory costs per new inv: look it up, then remember it
+static uint256 hashNext = 1;
+
+static void StepBloomInv(void* pArg)
+{
+    CRollingBloomFilter* pfilter = (CRollingBloomFilter*)pArg;
+    hashNext += 1;
+    if (!pfilter->contains(hashNext))
+        pfilter->insert(hashNext);
+}
+
+static void StepMrusetInv(void* pArg)
+{
+    mruset<CInv>* pset = (mruset<CInv>*)pArg;
+    hashNext += 1;
+    CInv inv(MSG_TX, hashNext);
+    if (!pset->count(inv))
+        pset->insert(inv);
+}
+
+// std::set node plus the std::deque copy, per element
+static size_t MrusetUsage(const mruset<CInv>& set)
+{
+    return set.size() * (memusage::TreeNodeUsage<CInv>() + sizeof(CInv));
+}
+
+// Rolling Bloom filter against the mruset it replaced, which held
+// SendBufferSize()/1000 invs, and against an mruset of the filter's size
+static void BloomInventoryKnown()
+{
+    CRollingBloomFilter filter(INVENTORY_KNOWN_ELEMENTS, INVENTORY_KNOWN_FP_RATE);
+    mruset<CInv> setInventoryKnown(SendBufferSize() / 1000);
+    mruset<CInv> setInventoryKnownLarge(INVENTORY_KNOWN_ELEMENTS);
+    for (unsigned int i = 0; i < INVENTORY_KNOWN_ELEMENTS; i++)
+    {
+        StepBloomInv(&filter);
+        StepMrusetInv(&setInventoryKnown);
+        StepMrusetInv(&setInventoryKnownLarge);
+    }
+
+    string strBloom = strprintf("rolling bloom, %u invs", INVENTORY_KNOWN_ELEMENTS);
+    string strMruset = strprintf("mruset, %u invs", (unsigned int)setInventoryKnown.max_size());
+    string strMrusetLarge = strprintf("mruset, %u invs", INVENTORY_KNOWN_ELEMENTS);
+    BenchReport(strBloom, BenchTime(StepBloomInv, &filter), 1, "inv");
+    BenchReport(strMruset, BenchTime(StepMrusetInv, &setInventoryKnown), 1, "inv");
+    BenchReport(strMrusetLarge, BenchTime(StepMrusetInv, &setInventoryKnownLarge), 1, "inv");
+
+    printf("%-40s %12u bytes\n", strBloom.c_str(), (unsigned int)filter.DynamicMemoryUsage());
+    printf("%-40s %12u bytes\n", strMruset.c_str(), (unsigned int)MrusetUsage(setInventoryKnown));
+    printf("%-40s %12u bytes\n", strMrusetLarge.c_str(), (unsigned int)MrusetUsage(setInventoryKnownLarge));
+}
+
+BENCHMARK(BloomInventoryKnown);
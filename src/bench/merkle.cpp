@@ -0,0 +1,105 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "main.h"
+#include "sha256.h"
+
+using namespace std;
+
+// Block of nTx small, distinct transactions
+static CBlock MakeBlock(int nTx)
+{
+    CBlock block;
+    for (int i = 0; i < nTx; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].prevout.n = 0;
+        tx.vin[0].scriptSig << vector<unsigned char>(72, 0x30) << vector<unsigned char>(33, 0x02);
+        tx.vout.resize(2);
+        tx.vout[0].nValue = i;
+        tx.vout[0].scriptPubKey << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 0x14) << OP_EQUALVERIFY << OP_CHECKSIG;
+        tx.vout[1] = tx.vout[0];
+        block.vtx.push_back(tx);
+    }
+    return block;
+}
+
+struct CMerkleBench
+{
+    CBlock block;
+    vector<uint256> vTxHash;
+};
+
+// Levels above the transaction hashes, one Hash() per node as before batch hashing
+static uint256 MerkleRootSerial(const vector<uint256>& vTxHash)
+{
+    vector<uint256> vTree(vTxHash);
+    int j = 0;
+    for (int nSize = vTxHash.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    {
+        for (int i = 0; i < nSize; i += 2)
+        {
+            int i2 = std::min(i+1, nSize-1);
+            vTree.push_back(Hash(BEGIN(vTree[j+i]), END(vTree[j+i]), BEGIN(vTree[j+i2]), END(vTree[j+i2])));
+        }
+        j += nSize;
+    }
+    return vTree.back();
+}
+
+static void StepBlockSerial(void* pArg)
+{
+    CMerkleBench* p = (CMerkleBench*)pArg;
+    vector<uint256> vTxHash;
+    BOOST_FOREACH(const CTransaction& tx, p->block.vtx)
+        vTxHash.push_back(tx.GetHash());
+    MerkleRootSerial(vTxHash);
+}
+
+static void StepBlockBatch(void* pArg)
+{
+    ((CMerkleBench*)pArg)->block.BuildMerkleTree();
+}
+
+static void StepTreeSerial(void* pArg)
+{
+    MerkleRootSerial(((CMerkleBench*)pArg)->vTxHash);
+}
+
+static void StepTreeBatch(void* pArg)
+{
+    CMerkleBench* p = (CMerkleBench*)pArg;
+    p->block.BuildMerkleTree(p->vTxHash);
+}
+
+// Merkle root of a block: txids plus tree, and the tree alone from known txids,
+// each one Hash() at a time and with every batch implementation
+static void MerkleRoot()
+{
+    static const int sizes[] = { 1000, 2500, 5000, 10000 };
+    static const char* implementations[] = { "generic", "sse41", "avx2", "shani" };
+    const char* pszDefault = SHA256BatchImplementation();
+    for (int s = 0; s < 4; s++)
+    {
+        CMerkleBench bench;
+        bench.block = MakeBlock(sizes[s]);
+        bench.vTxHash = bench.block.GetTxHashes();
+        int n = sizes[s];
+
+        BenchReport(strprintf("block %d tx, serial", n), BenchTime(StepBlockSerial, &bench), n, "tx");
+        for (int i = 0; i < 4; i++)
+            if (SHA256BatchSelect(implementations[i]))
+                BenchReport(strprintf("block %d tx, batch %s", n, implementations[i]), BenchTime(StepBlockBatch, &bench), n, "tx");
+        BenchReport(strprintf("tree %d tx, serial", n), BenchTime(StepTreeSerial, &bench), n, "tx");
+        for (int i = 0; i < 4; i++)
+            if (SHA256BatchSelect(implementations[i]))
+                BenchReport(strprintf("tree %d tx, batch %s", n, implementations[i]), BenchTime(StepTreeBatch, &bench), n, "tx");
+        SHA256BatchSelect(pszDefault);
+    }
+}
+
+BENCHMARK(MerkleRoot);
@@ -0,0 +1,90 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <boost/thread.hpp>
+
+#include "bench.h"
+#include "main.h"
+#include "sha256.h"
+
+using namespace std;
+
+static const unsigned int BENCH_NONCES = 0x10000;
+
+struct CMinerBench
+{
+    unsigned char pheader[80];
+    unsigned int nNonce;
+};
+
+// Nonces the way the miner scanned them before: two whole transforms each
+static void StepTransform(void* pArg)
+{
+    CMinerBench* p = (CMinerBench*)pArg;
+    unsigned int midstate[8];
+    CSHA256 hasher;
+    for (unsigned int i = 0; i < BENCH_NONCES; i++)
+    {
+        unsigned int nNonce = p->nNonce++;
+        memcpy(p->pheader + 76, &nNonce, 4);
+        unsigned char hash[32];
+        hasher.Reset().Write(p->pheader, 80).Finalize(hash);
+        hasher.Reset().Write(hash, 32).Finalize(hash);
+        memcpy(midstate, hash, 4);
+    }
+}
+
+static void StepScan(void* pArg)
+{
+    CMinerBench* p = (CMinerBench*)pArg;
+    unsigned int nHashesDone;
+    // A target no hash reaches, so every call scans the whole range
+    SHA256ScanNonces(p->pheader, 0, p->nNonce, BENCH_NONCES, nHashesDone);
+}
+
+static void ScanThread(CMinerBench* p, double* pdSeconds)
+{
+    *pdSeconds = BenchTime(StepScan, p, 1.0);
+}
+
+// Miner hash rate in hashes per second, the unit gethashespersec reports:
+// one thread per kernel, then every core scanning its own extranonce's header
+static void MinerScan()
+{
+    static const char* implementations[] = { "generic", "sse41", "avx2", "shani" };
+    const char* pszDefault = SHA256BatchImplementation();
+
+    CMinerBench bench;
+    for (int i = 0; i < 80; i++)
+        bench.pheader[i] = GetRand(256);
+    bench.nNonce = 0;
+    BenchReport("1 thread, transform", BenchTime(StepTransform, &bench), BENCH_NONCES, "hash");
+
+    int nThreads = boost::thread::hardware_concurrency();
+    if (nThreads < 1)
+        nThreads = 1;
+    for (int i = 0; i < 4; i++)
+    {
+        if (!SHA256BatchSelect(implementations[i]))
+            continue;
+        BenchReport(strprintf("1 thread, scan %s", implementations[i]), BenchTime(StepScan, &bench), BENCH_NONCES, "hash");
+
+        vector<CMinerBench> vBench(nThreads, bench);
+        vector<double> vdSeconds(nThreads);
+        boost::thread_group threads;
+        for (int t = 0; t < nThreads; t++)
+        {
+            vBench[t].pheader[0] ^= t;
+            threads.create_thread(boost::bind(ScanThread, &vBench[t], &vdSeconds[t]));
+        }
+        threads.join_all();
+        double dHashesPerSec = 0;
+        for (int t = 0; t < nThreads; t++)
+            dHashesPerSec += BENCH_NONCES / vdSeconds[t];
+        BenchReport(strprintf("%d threads, scan %s", nThreads, implementations[i]), BENCH_NONCES / dHashesPerSec, BENCH_NONCES, "hash");
+    }
+    SHA256BatchSelect(pszDefault);
+}
+
+BENCHMARK(MinerScan);
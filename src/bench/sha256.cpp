@@ -0,0 +1,69 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <vector>
+
+#include <openssl/sha.h>
+
+#include "bench.h"
+#include "main.h"
+#include "sha256.h"
+
+using namespace std;
+
+static vector<unsigned char> vchBuffer(1000000, 0x5a);
+
+static void StepBufferOpenSSL(void* pArg)
+{
+    unsigned char hash[32];
+    SHA256(&vchBuffer[0], vchBuffer.size(), hash);
+}
+
+static void StepBuffer(void* pArg)
+{
+    unsigned char hash[32];
+    CSHA256().Write(&vchBuffer[0], vchBuffer.size()).Finalize(hash);
+}
+
+// Double-SHA256 of an 80 byte block header, as GetHash() and the network checksums do
+static void StepHeader(void* pArg)
+{
+    CBlock* pheader = (CBlock*)pArg;
+    pheader->nNonce++;
+    pheader->GetHash();
+}
+
+// One nonce of the miner: two block transforms from the midstate
+static void StepMinerNonce(void* pArg)
+{
+    unsigned int* state = (unsigned int*)pArg;
+    unsigned char block[64] = { 0 };
+    memcpy(block, state, 32);
+    SHA256Blocks(state, block, 1);
+    SHA256Blocks(state + 8, block, 1);
+}
+
+// Single stream hashing throughput with OpenSSL and every implementation
+static void SHA256Stream()
+{
+    static const char* implementations[] = { "generic", "shani" };
+    const char* pszDefault = SHA256Implementation();
+
+    BenchReport("1 MB, openssl", BenchTime(StepBufferOpenSSL, NULL), 1, "MB");
+    for (int i = 0; i < 2; i++)
+    {
+        if (!SHA256Select(implementations[i]))
+            continue;
+        BenchReport(strprintf("1 MB, %s", implementations[i]), BenchTime(StepBuffer, NULL), 1, "MB");
+
+        CBlock header;
+        BenchReport(strprintf("block header hash, %s", implementations[i]), BenchTime(StepHeader, &header), 1, "hash");
+
+        unsigned int state[16] = { 0 };
+        BenchReport(strprintf("miner nonce, %s", implementations[i]), BenchTime(StepMinerNonce, state), 1, "hash");
+    }
+    SHA256Select(pszDefault);
+}
+
+BENCHMARK(SHA256Stream);
@@ -0,0 +1,173 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include <openssl/rand.h>
+
+using namespace std;
+
+#define ROTL(x, b) (uint64)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; \
+    v0 = ROTL(v0, 32); \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; \
+    v2 = ROTL(v2, 32); \
+} while (0)
+
+uint64 SipHashUint256(uint64 k0, uint64 k1, const uint256& val)
+{
+    uint64 v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64 v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64 v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64 v3 = 0x7465646279746573ULL ^ k1;
+
+    for (int i = 0; i < 4; i++)
+    {
+        uint64 d = val.Get64(i);
+        v3 ^= d;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= d;
+    }
+
+    // Final block is just the length, 32 bytes
+    uint64 d = ((uint64)32) << 56;
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block)
+{
+    header.nVersion = block.nVersion;
+    header.hashPrevBlock = block.hashPrevBlock;
+    header.hashMerkleRoot = block.hashMerkleRoot;
+    header.nTime = block.nTime;
+    header.nBits = block.nBits;
+    header.nNonce = block.nNonce;
+    RAND_bytes((unsigned char*)&nNonce, sizeof(nNonce));
+
+    uint256 hashKey = GetShortIDKey();
+    vShortTxIDs.reserve(block.vtx.size() - 1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        vShortTxIDs.push_back(GetShortID(hashKey, block.vtx[i].GetHash()));
+
+    vPrefilled.resize(1);
+    vPrefilled[0].nIndex = 0;
+    vPrefilled[0].tx = block.vtx[0];
+}
+
+uint256 CBlockHeaderAndShortTxIDs::GetShortIDKey() const
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header.nVersion << header.hashPrevBlock << header.hashMerkleRoot
+       << header.nTime << header.nBits << header.nNonce << nNonce;
+    return Hash(ss.begin(), ss.end());
+}
+
+uint64 CBlockHeaderAndShortTxIDs::GetShortID(const uint256& hashKey, const uint256& hashTx)
+{
+    return SipHashUint256(hashKey.Get64(0), hashKey.Get64(1), hashTx) & 0xffffffffffffULL;
+}
+
+bool CPartialBlock::Init(const CBlockHeaderAndShortTxIDs& cmpct, CTxMemPool& pool)
+{
+    // Smallest possible transaction is 60 bytes
+    unsigned int nTx = cmpct.vShortTxIDs.size() + cmpct.vPrefilled.size();
+    if (nTx == 0 || nTx > MAX_BLOCK_SIZE / 60)
+        return error("CPartialBlock::Init() : bad transaction count %u", nTx);
+
+    block = cmpct.header;
+    block.vtx.assign(nTx, CTransaction());
+    vHave.assign(nTx, false);
+    nFromPool = 0;
+
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpct.vPrefilled)
+    {
+        if (prefilled.nIndex >= nTx || vHave[prefilled.nIndex])
+            return error("CPartialBlock::Init() : bad prefilled index %u", prefilled.nIndex);
+        block.vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
+
+    // Short IDs take the remaining positions in order. Any short ID that
+    // matches more than one transaction is left for getshorttxn to fill.
+    static const unsigned int AMBIGUOUS = (unsigned int)-1;
+    map<uint64, unsigned int> mapShortID;
+    unsigned int nIndex = 0;
+    BOOST_FOREACH(uint64 nShortID, cmpct.vShortTxIDs)
+    {
+        while (vHave[nIndex])
+            nIndex++;
+        if (!mapShortID.insert(make_pair(nShortID, nIndex)).second)
+            mapShortID[nShortID] = AMBIGUOUS;
+        nIndex++;
+    }
+
+    uint256 hashKey = cmpct.GetShortIDKey();
+    unsigned int nWanted = mapShortID.size();
+    {
+        LOCK(pool.cs);
+        for (map<uint256, CTxMemPoolEntry>::iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end() && nFromPool < nWanted; ++mi)
+        {
+            map<uint64, unsigned int>::iterator it = mapShortID.find(CBlockHeaderAndShortTxIDs::GetShortID(hashKey, (*mi).first));
+            if (it == mapShortID.end() || it->second == AMBIGUOUS)
+                continue;
+            if (vHave[it->second])
+            {
+                // Two of ours match; ask for it instead
+                block.vtx[it->second] = CTransaction();
+                vHave[it->second] = false;
+                it->second = AMBIGUOUS;
+                nFromPool--;
+                continue;
+            }
+            block.vtx[it->second] = (*mi).second.tx;
+            vHave[it->second] = true;
+            nFromPool++;
+        }
+    }
+    return true;
+}
+
+void CPartialBlock::GetMissing(vector<unsigned short>& vIndexes) const
+{
+    vIndexes.clear();
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vIndexes.push_back(i);
+}
+
+bool CPartialBlock::FillMissing(const vector<CTransaction>& vtx)
+{
+    unsigned int nNext = 0;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        if (nNext >= vtx.size())
+            return error("CPartialBlock::FillMissing() : too few transactions");
+        block.vtx[i] = vtx[nNext++];
+        vHave[i] = true;
+    }
+    if (nNext != vtx.size())
+        return error("CPartialBlock::FillMissing() : too many transactions");
+    return true;
+}
+
+bool CPartialBlock::IsComplete() const
+{
+    return !vHave.empty() && find(vHave.begin(), vHave.end(), false) == vHave.end();
+}
@@ -0,0 +1,143 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "main.h"
+
+/** Version sent in "sendshort". These messages are not BIP 152's: short IDs,
+ * indexes and the short ID key are encoded differently, so they go under
+ * command names of their own and a BIP 152 peer never sees them.
+ */
+static const uint64 SHORTBLOCK_VERSION = 1;
+
+/** SipHash-2-4 of a 256 bit value with the 128 bit key (k0, k1) */
+uint64 SipHashUint256(uint64 k0, uint64 k1, const uint256& val);
+
+/** A transaction sent whole inside a compact block */
+class CPrefilledTransaction
+{
+public:
+    unsigned short nIndex; // position in the block
+    CTransaction tx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nIndex);
+        READWRITE(tx);
+    )
+};
+
+/** A block announced as its header and a short ID per transaction ("shortblock").
+ * The receiver looks the short IDs up in its memory pool and asks for whatever
+ * it lacks with "getshorttxn". Short IDs are the low 6 bytes of SipHash-2-4 of
+ * the txid, keyed by the hash of the header and a random nonce, so a collision
+ * found for one announcement is no use against the next. The coinbase, which
+ * the receiver cannot have, is always sent whole.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+public:
+    static const unsigned int SHORTTXIDS_LENGTH = 6;
+
+    CBlock header; // vtx left empty
+    uint64 nNonce;
+    std::vector<uint64> vShortTxIDs; // the transactions not prefilled, in block order
+    std::vector<CPrefilledTransaction> vPrefilled;
+
+    CBlockHeaderAndShortTxIDs()
+    {
+        nNonce = 0;
+    }
+
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header.nVersion);
+        READWRITE(header.hashPrevBlock);
+        READWRITE(header.hashMerkleRoot);
+        READWRITE(header.nTime);
+        READWRITE(header.nBits);
+        READWRITE(header.nNonce);
+        READWRITE(nNonce);
+
+        // Short IDs go out packed, SHORTTXIDS_LENGTH bytes each
+        std::vector<unsigned char> vch;
+        if (!fRead)
+        {
+            vch.reserve(vShortTxIDs.size() * SHORTTXIDS_LENGTH);
+            BOOST_FOREACH(uint64 nShortID, vShortTxIDs)
+                for (unsigned int i = 0; i < SHORTTXIDS_LENGTH; i++)
+                    vch.push_back((unsigned char)(nShortID >> (8 * i)));
+        }
+        READWRITE(vch);
+        if (fRead)
+        {
+            if (vch.size() % SHORTTXIDS_LENGTH != 0)
+                throw std::ios_base::failure("CBlockHeaderAndShortTxIDs : short IDs truncated");
+            std::vector<uint64>& vIDs = const_cast<CBlockHeaderAndShortTxIDs*>(this)->vShortTxIDs;
+            vIDs.assign(vch.size() / SHORTTXIDS_LENGTH, 0);
+            for (unsigned int i = 0; i < vch.size(); i++)
+                vIDs[i / SHORTTXIDS_LENGTH] |= (uint64)vch[i] << (8 * (i % SHORTTXIDS_LENGTH));
+        }
+
+        READWRITE(vPrefilled);
+    )
+
+    // Key the short IDs are computed with
+    uint256 GetShortIDKey() const;
+    static uint64 GetShortID(const uint256& hashKey, const uint256& hashTx);
+};
+
+/** "getshorttxn": the transactions at these positions of a block */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 hashBlock;
+    std::vector<unsigned short> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vIndexes);
+    )
+};
+
+/** "shorttxn": the answer to getshorttxn, in the order asked */
+class CBlockTransactions
+{
+public:
+    uint256 hashBlock;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vtx);
+    )
+};
+
+/** A compact block being rebuilt from the memory pool and a shorttxn reply */
+class CPartialBlock
+{
+public:
+    CBlock block;
+    std::vector<bool> vHave;
+    unsigned int nFromPool;
+
+    CPartialBlock()
+    {
+        nFromPool = 0;
+    }
+
+    // Returns false if cmpct does not describe a possible block
+    bool Init(const CBlockHeaderAndShortTxIDs& cmpct, CTxMemPool& pool);
+    void GetMissing(std::vector<unsigned short>& vIndexes) const;
+    // vtx must be the transactions GetMissing asked for
+    bool FillMissing(const std::vector<CTransaction>& vtx);
+    bool IsComplete() const;
+};
+
+#endif
@@ -0,0 +1,160 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <math.h>
+#include <algorithm>
+#include <limits>
+
+#include "bloom.h"
+#include "memusage.h"
+#include "util.h"
+
+using namespace std;
+
+static inline unsigned int ROTL32(unsigned int x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pch, unsigned int nLen)
+{
+    // The following is MurmurHash3 (x86_32), see http://code.google.com/p/smhasher/source/browse/trunk/MurmurHash3.cpp
+    unsigned int h1 = nHashSeed;
+    const unsigned int c1 = 0xcc9e2d51;
+    const unsigned int c2 = 0x1b873593;
+
+    const int nblocks = nLen / 4;
+
+    //----------
+    // body
+    for (int i = 0; i < nblocks; i++)
+    {
+        unsigned int k1 = pch[4*i] | (pch[4*i+1] << 8) | (pch[4*i+2] << 16) | ((unsigned int)pch[4*i+3] << 24);
+
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+
+        h1 ^= k1;
+        h1 = ROTL32(h1, 13);
+        h1 = h1 * 5 + 0xe6546b64;
+    }
+
+    //----------
+    // tail
+    const unsigned char* tail = pch + nblocks * 4;
+
+    unsigned int k1 = 0;
+
+    switch (nLen & 3)
+    {
+        case 3: k1 ^= tail[2] << 16;
+                // fallthrough
+        case 2: k1 ^= tail[1] << 8;
+                // fallthrough
+        case 1: k1 ^= tail[0];
+                k1 *= c1;
+                k1 = ROTL32(k1, 15);
+                k1 *= c2;
+                h1 ^= k1;
+    };
+
+    //----------
+    // finalization
+    h1 ^= nLen;
+    h1 ^= h1 >> 16;
+    h1 *= 0x85ebca6b;
+    h1 ^= h1 >> 13;
+    h1 *= 0xc2b2ae35;
+    h1 ^= h1 >> 16;
+
+    return h1;
+}
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
+{
+    // Each key sets nHashFuncs positions; halving the false positive rate
+    // takes one more
+    double dLogFpRate = log(fpRate);
+    nHashFuncs = max(1, min((int)floor(dLogFpRate / log(0.5) + 0.5), 50));
+
+    // Enough positions that three generations' worth of keys, at most
+    // 1.5 * nElements, leave the false positive rate at fpRate
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    unsigned int nMaxElements = nEntriesPerGeneration * 3;
+    unsigned int nFilterBits = (unsigned int)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(dLogFpRate / nHashFuncs)));
+    data.resize(((nFilterBits + 63) / 64) << 1);
+    reset();
+}
+
+static inline unsigned int RollingBloomHash(int nHashNum, unsigned int nTweak, const unsigned char* pch, unsigned int nLen)
+{
+    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, pch, nLen);
+}
+
+// Maps a hash onto [0, n) with a multiply and shift instead of a modulo.
+// The low 6 bits of the hash pick the bit within the word pair.
+static inline unsigned int FastMod(unsigned int x, size_t n)
+{
+    return ((uint64)x * (uint64)n) >> 32;
+}
+
+void CRollingBloomFilter::insert(const unsigned char* pch, unsigned int nLen)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration)
+    {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+
+        // Wipe the positions whose generation is the one being reused
+        uint64 nGenerationMask1 = 0 - (uint64)(nGeneration & 1);
+        uint64 nGenerationMask2 = 0 - (uint64)(nGeneration >> 1);
+        for (unsigned int p = 0; p < data.size(); p += 2)
+        {
+            uint64 p1 = data[p], p2 = data[p + 1];
+            uint64 mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    for (int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int h = RollingBloomHash(n, nTweak, pch, nLen);
+        int bit = h & 0x3f;
+        unsigned int pos = FastMod(h, data.size());
+        data[pos & ~1] = (data[pos & ~1] & ~((uint64)1 << bit)) | ((uint64)(nGeneration & 1)) << bit;
+        data[pos | 1] = (data[pos | 1] & ~((uint64)1 << bit)) | ((uint64)(nGeneration >> 1)) << bit;
+    }
+}
+
+bool CRollingBloomFilter::contains(const unsigned char* pch, unsigned int nLen) const
+{
+    for (int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int h = RollingBloomHash(n, nTweak, pch, nLen);
+        int bit = h & 0x3f;
+        unsigned int pos = FastMod(h, data.size());
+        if (!(((data[pos & ~1] | data[pos | 1]) >> bit) & 1))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::reset()
+{
+    // A fresh tweak so keys that collide for one peer do not for the next
+    nTweak = GetRand(numeric_limits<unsigned int>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    fill(data.begin(), data.end(), 0);
+}
+
+size_t CRollingBloomFilter::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(data);
+}
@@ -0,0 +1,59 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOOM_H
+#define BITCOIN_BLOOM_H
+
+#include <vector>
+
+#include "uint256.h"
+
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pch, unsigned int nLen);
+
+/** Probabilistic set of the most recent nElements keys, in a fixed amount of
+ * memory chosen from nElements and the false positive rate fpRate.
+ *
+ * Keys are kept in three generations of nElements/2. Each filter position
+ * holds two bits: zero if unused, or the generation (1-3) that last set it.
+ * Starting a new generation wipes the positions the oldest one set, so at
+ * least the last nElements keys are always found, and up to 1.5 times that.
+ * Keys not inserted are reported present with probability about fpRate.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double fpRate);
+
+    void insert(const unsigned char* pch, unsigned int nLen);
+    void insert(const std::vector<unsigned char>& vKey)
+    {
+        insert(vKey.empty() ? NULL : &vKey[0], vKey.size());
+    }
+    void insert(const uint256& hash)
+    {
+        insert((const unsigned char*)&hash, sizeof(hash));
+    }
+
+    bool contains(const unsigned char* pch, unsigned int nLen) const;
+    bool contains(const std::vector<unsigned char>& vKey) const
+    {
+        return contains(vKey.empty() ? NULL : &vKey[0], vKey.size());
+    }
+    bool contains(const uint256& hash) const
+    {
+        return contains((const unsigned char*)&hash, sizeof(hash));
+    }
+
+    void reset();
+    size_t DynamicMemoryUsage() const;
+
+private:
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    std::vector<uint64> data; // pairs of words: low and high bit of each position's generation
+    unsigned int nTweak;
+    int nHashFuncs;
+};
+
+#endif
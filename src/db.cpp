@@ -597,7 +597,7 @@ bool CTxDB::LoadBlockIndex()
     if (fRequestShutdown)
         return true;
 
-    // Calculate bnChainWork
+    // Calculate bnChainWork and the skip pointers
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
@@ -610,6 +610,7 @@ bool CTxDB::LoadBlockIndex()
     {
         CBlockIndex* pindex = item.second;
         pindex->bnChainWork = (pindex->pprev ? pindex->pprev->bnChainWork : 0) + pindex->GetBlockWork();
+        pindex->BuildSkip();
     }
 
     // Load hashBestChain pointer to end of best chain
@@ -622,6 +623,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    SetMainChainTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     bnBestChainWork = pindexBest->bnChainWork;
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d  date=%s\n",
@@ -806,6 +808,7 @@ bool CTxDB::LoadBlockIndexGuts()
             pindexNew->nTime          = diskindex.nTime;
             pindexNew->nBits          = diskindex.nBits;
             pindexNew->nNonce         = diskindex.nNonce;
+            mapBlockPos[make_pair(pindexNew->nFile, pindexNew->nBlockPos)] = pindexNew;
 
             // Watch for genesis block
             if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
@@ -931,3 +934,111 @@ bool CAddrDB::Read(CAddrMan& addr)
     return true;
 }
 
+
+
+//
+// CMempoolDB
+//
+
+static const int MEMPOOL_DUMP_VERSION = 1;
+
+CMempoolDB::CMempoolDB()
+{
+    pathMempool = GetDataDir() / "mempool.dat";
+}
+
+bool CMempoolDB::Write(const std::vector<std::pair<CTransaction, int64> >& vtx)
+{
+    // Generate random temporary filename
+    unsigned short randv = 0;
+    RAND_bytes((unsigned char *)&randv, sizeof(randv));
+    std::string tmpfn = strprintf("mempool.dat.%04x", randv);
+
+    // serialize transactions, checksum data up to that point, then append csum
+    CDataStream ssMempool(SER_DISK, CLIENT_VERSION);
+    ssMempool << FLATDATA(pchMessageStart);
+    ssMempool << MEMPOOL_DUMP_VERSION;
+    ssMempool << vtx;
+    uint256 hash = Hash(ssMempool.begin(), ssMempool.end());
+    ssMempool << hash;
+
+    // open temp output file, and associate with CAutoFile
+    boost::filesystem::path pathTmp = pathMempool.parent_path() / tmpfn;
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CMempoolDB::Write() : open failed");
+
+    // Write and commit header, data
+    try {
+        fileout << ssMempool;
+    }
+    catch (std::exception &e) {
+        return error("CMempoolDB::Write() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    // replace existing mempool.dat, if any, with new mempool.dat.XXXX
+    if (!RenameOver(pathTmp, pathMempool))
+        return error("CMempoolDB::Write() : Rename-into-place failed");
+
+    return true;
+}
+
+bool CMempoolDB::Read(std::vector<std::pair<CTransaction, int64> >& vtx)
+{
+    // open input file, and associate with CAutoFile
+    FILE *file = fopen(pathMempool.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+
+    // use file size to size memory buffer
+    int fileSize = GetFilesize(filein);
+    int dataSize = fileSize - sizeof(uint256);
+    if (dataSize < 0)
+        return error("CMempoolDB::Read() : file too short");
+    vector<unsigned char> vchData;
+    vchData.resize(dataSize);
+    uint256 hashIn;
+
+    // read data and checksum from file
+    try {
+        filein.read((char *)&vchData[0], dataSize);
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("CMempoolDB::Read() 2 : I/O error or stream data corrupted");
+    }
+    filein.fclose();
+
+    CDataStream ssMempool(vchData, SER_DISK, CLIENT_VERSION);
+
+    // verify stored checksum matches input data
+    uint256 hashTmp = Hash(ssMempool.begin(), ssMempool.end());
+    if (hashIn != hashTmp)
+        return error("CMempoolDB::Read() : checksum mismatch; data corrupted");
+
+    unsigned char pchMsgTmp[4];
+    int nVersion;
+    try {
+        // de-serialize file header (pchMessageStart magic number) and
+        ssMempool >> FLATDATA(pchMsgTmp);
+
+        // verify the network matches ours
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            return error("CMempoolDB::Read() : invalid network magic number");
+
+        ssMempool >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("CMempoolDB::Read() : unknown version %d", nVersion);
+
+        ssMempool >> vtx;
+    }
+    catch (std::exception &e) {
+        return error("CMempoolDB::Read() : I/O error or stream data corrupted");
+    }
+
+    return true;
+}
@@ -359,4 +359,17 @@ public:
     bool Read(CAddrMan& addr);
 };
 
+/** Access to the memory pool file (mempool.dat): pool transactions with
+ * the time each one entered the pool */
+class CMempoolDB
+{
+private:
+    boost::filesystem::path pathMempool;
+public:
+    CMempoolDB();
+    CMempoolDB(const boost::filesystem::path& pathIn) : pathMempool(pathIn) { }
+    bool Write(const std::vector<std::pair<CTransaction, int64> >& vtx);
+    bool Read(std::vector<std::pair<CTransaction, int64> >& vtx);
+};
+
 #endif // BITCOIN_DB_H
@@ -74,6 +74,14 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         bitdb.Flush(false);
         StopNode();
+        if (GetBoolArg("-persistmempool", true))
+        {
+            // StopNode gives up on slow threads; a periodic dump still
+            // running would write mempool.dat at the same time as this one
+            while (vnThreadsRunning[THREAD_MEMPOOL] > 0)
+                Sleep(20);
+            DumpMempool();
+        }
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -225,6 +233,10 @@ std::string HelpMessage()
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
+        "  -maxmempool=<n>        " + _("Keep the transaction memory pool below <n> megabytes (default: 300)") + "\n" +
+        "  -persistmempool        " + _("Save the transaction memory pool to mempool.dat at shutdown and reload it at startup (default: 1)") + "\n" +
+        "  -mempoolexpiry=<n>     " + _("Do not reload transactions that entered the memory pool more than <n> hours ago (default: 336)") + "\n" +
+        "  -txverifythreads=<n>   " + _("Check transactions from peers on <n> threads before taking the main lock, 0 to check them inline (default: cores - 1, at most 4)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -282,12 +294,15 @@ std::string HelpMessage()
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
+        "  -ecverify=<engine>     " + _("Signature verification engine, openssl or secp256k1 (default: openssl)") + "\n" +
+        "  -maxpubkeycachesize=<n> " + _("Keep at most <n> decoded public keys in memory (default: 20000)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
         "  -blockmaxsize=<n>      "   + _("Set maximum block size in bytes (default: 250000)") + "\n" +
         "  -blockprioritysize=<n> "   + _("Set maximum size of high-priority/low-fee transactions in bytes (default: 27000)") + "\n" +
+        "  -checkblocktemplate    "   + _("Re-verify every new block template with ConnectBlock (default: 1)") + "\n" +
 
         "\n" + _("SSL options: (see the Bitcoin Wiki for SSL setup instructions)") + "\n" +
         "  -rpcssl                                  " + _("Use OpenSSL (https) for JSON-RPC connections") + "\n" +
@@ -438,6 +453,17 @@ bool AppInit2()
             InitWarning(_("Warning: -paytxfee is set very high! This is the transaction fee you will pay if you send a transaction."));
     }
 
+    if (mapArgs.count("-ecverify"))
+    {
+        std::string strEngine = mapArgs["-ecverify"];
+        if (strEngine == "openssl")
+            SetECVerifyEngine(ECVERIFY_OPENSSL);
+        else if (strEngine == "secp256k1")
+            SetECVerifyEngine(ECVERIFY_SECP256K1);
+        else
+            return InitError(strprintf(_("Unknown signature verification engine -ecverify: '%s'"), strEngine.c_str()));
+    }
+
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
     std::string strDataDir = GetDataDir().string();
@@ -477,6 +503,7 @@ bool AppInit2()
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("Bitcoin version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     printf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    printf("Using SHA-256 implementation %s\n", SHA256AutoDetect().c_str());
     if (!fLogTimestamps)
         printf("Startup time: %s\n", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
     printf("Default data directory %s\n", GetDefaultDataDir().string().c_str());
@@ -832,6 +859,13 @@ bool AppInit2()
     if (!NewThread(StartNode, NULL))
         InitError(_("Error: could not start node"));
 
+    if (GetBoolArg("-persistmempool", true))
+        NewThread(ThreadMempoolPersist, NULL);
+
+    // Leave a core for the message handler
+    int nTxVerifyThreads = GetArg("-txverifythreads", std::min(std::max((int)boost::thread::hardware_concurrency() - 1, 1), 4));
+    StartTxVerifyThreads(std::max(std::min(nTxVerifyThreads, 16), 0));
+
     if (fServer)
         NewThread(ThreadRPCServer, NULL);
 
@@ -8,6 +8,19 @@
 #include <openssl/obj_mac.h>
 
 #include "key.h"
+#include "secp256k1.h"
+
+static ECVerifyEngine nECVerifyEngine = ECVERIFY_OPENSSL;
+
+void SetECVerifyEngine(ECVerifyEngine engine)
+{
+    nECVerifyEngine = engine;
+}
+
+ECVerifyEngine GetECVerifyEngine()
+{
+    return nECVerifyEngine;
+}
 
 // Generate a private key from just the secret parameter
 int EC_KEY_regenerate_key(EC_KEY *eckey, BIGNUM *priv_key)
@@ -372,6 +385,15 @@ bool CKey::SetCompactSignature(uint256 hash, const std::vector<unsigned char>& v
 
 bool CKey::Verify(uint256 hash, const std::vector<unsigned char>& vchSig)
 {
+    if (nECVerifyEngine == ECVERIFY_SECP256K1)
+    {
+        // Anything the in-tree verifier doesn't handle falls through to OpenSSL
+        Secp256k1::CPoint pubkey;
+        int nResult = Secp256k1::ParsePubKey(GetPubKey().Raw(), pubkey) ? Secp256k1::Verify(pubkey, hash, vchSig) : -1;
+        if (nResult >= 0)
+            return nResult == 1;
+    }
+
     // -1 = error, 0 = bad sig, 1 = good
     if (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) != 1)
         return false;
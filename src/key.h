@@ -44,6 +44,16 @@ public:
     explicit key_error(const std::string& str) : std::runtime_error(str) {}
 };
 
+/** Backend used to check ECDSA signatures */
+enum ECVerifyEngine
+{
+    ECVERIFY_OPENSSL,
+    ECVERIFY_SECP256K1,     // in-tree verifier, see secp256k1.h
+};
+
+void SetECVerifyEngine(ECVerifyEngine engine);
+ECVerifyEngine GetECVerifyEngine();
+
 /** A reference to a CKey: the Hash160 of its serialized public key */
 class CKeyID : public uint160
 {
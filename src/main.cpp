@@ -4,10 +4,13 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "alert.h"
+#include "blockencodings.h"
 #include "checkpoints.h"
 #include "db.h"
 #include "net.h"
 #include "init.h"
+#include "memusage.h"
+#include "sha256.h"
 #include "ui_interface.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
@@ -29,6 +32,7 @@ CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
 map<uint256, CBlockIndex*> mapBlockIndex;
+map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos; // same blocks, by (nFile, nBlockPos)
 uint256 hashGenesisBlock("0x000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f");
 static CBigNum bnProofOfWorkLimit(~uint256(0) >> 32);
 CBlockIndex* pindexGenesisBlock = NULL;
@@ -36,16 +40,27 @@ int nBestHeight = -1;
 CBigNum bnBestChainWork = 0;
 CBigNum bnBestInvalidWork = 0;
 uint256 hashBestChain = 0;
+CWaitableCriticalSection csBestBlock;
+boost::condition_variable cvBlockChange;
 CBlockIndex* pindexBest = NULL;
+CBlockIndex* pindexBestHeader = NULL;
+map<uint256, CBlockIndex*> mapHeaderIndex; // headers whose blocks are still to come
+int nDownloadHeight = 0; // first height on the best header chain that may lack its block
+static int nBlockDownloadGeneration = 0; // bumped whenever there may be new blocks to request
+vector<CBlockIndex*> vBlockIndexByHeight;
 int64 nTimeBestReceived = 0;
 
 CMedianFilter<int> cPeerBlockCounts(5, 0); // Amount of blocks that other nodes claim to have
 
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
+unsigned int nOrphanBlocksSize = 0; // serialized size of everything in mapOrphanBlocks
 
-map<uint256, CDataStream*> mapOrphanTransactions;
-map<uint256, map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
+map<uint256, COrphanTx> mapOrphanTransactions;
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev;
+map<int, COrphanPeer> mapOrphanTransactionsByPeer;
+unsigned int nOrphanTransactionsBytes = 0;
+deque<uint256> vOrphanWorkQueue;
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -162,72 +177,190 @@ void static ResendWalletTransactions()
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CDataStream& vMsg)
+bool AddOrphanTx(const CTransaction& tx, int nPeer)
 {
-    CTransaction tx;
-    CDataStream(vMsg) >> tx;
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
 
-    CDataStream* pvMsg = new CDataStream(vMsg);
-
     // Ignore big transactions, to avoid a
     // send-big-orphans memory exhaustion attack. If a peer has a legitimate
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
-    if (pvMsg->size() > 5000)
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    if (nSize > MAX_ORPHAN_TX_SIZE)
     {
-        printf("ignoring large orphan tx (size: %"PRIszu", hash: %s)\n", pvMsg->size(), hash.ToString().substr(0,10).c_str());
-        delete pvMsg;
+        printf("ignoring large orphan tx (size: %u, hash: %s)\n", nSize, hash.ToString().substr(0,10).c_str());
         return false;
     }
 
-    mapOrphanTransactions[hash] = pvMsg;
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.nPeer = nPeer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nTxSize = nSize;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(make_pair(hash, pvMsg));
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
 
-    printf("stored orphan tx %s (mapsz %"PRIszu")\n", hash.ToString().substr(0,10).c_str(),
-        mapOrphanTransactions.size());
+    COrphanPeer& peer = mapOrphanTransactionsByPeer[nPeer];
+    peer.nBytes += nSize;
+    peer.setHash.insert(hash);
+    nOrphanTransactionsBytes += nSize;
+
+    printf("stored orphan tx %s (mapsz %"PRIszu", %u bytes)\n", hash.ToString().substr(0,10).c_str(),
+        mapOrphanTransactions.size(), nOrphanTransactionsBytes);
     return true;
 }
 
 void static EraseOrphanTx(uint256 hash)
 {
-    if (!mapOrphanTransactions.count(hash))
+    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
+    if (it == mapOrphanTransactions.end())
         return;
-    const CDataStream* pvMsg = mapOrphanTransactions[hash];
-    CTransaction tx;
-    CDataStream(*pvMsg) >> tx;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    const COrphanTx& orphan = it->second;
+    BOOST_FOREACH(const CTxIn& txin, orphan.tx.vin)
+    {
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
+        if (itPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        itPrev->second.erase(hash);
+        if (itPrev->second.empty())
+            mapOrphanTransactionsByPrev.erase(itPrev);
+    }
+
+    map<int, COrphanPeer>::iterator itPeer = mapOrphanTransactionsByPeer.find(orphan.nPeer);
+    if (itPeer != mapOrphanTransactionsByPeer.end())
     {
-        mapOrphanTransactionsByPrev[txin.prevout.hash].erase(hash);
-        if (mapOrphanTransactionsByPrev[txin.prevout.hash].empty())
-            mapOrphanTransactionsByPrev.erase(txin.prevout.hash);
+        itPeer->second.nBytes -= orphan.nTxSize;
+        itPeer->second.setHash.erase(hash);
+        if (itPeer->second.setHash.empty())
+            mapOrphanTransactionsByPeer.erase(itPeer);
     }
-    delete pvMsg;
-    mapOrphanTransactions.erase(hash);
+    nOrphanTransactionsBytes -= orphan.nTxSize;
+    mapOrphanTransactions.erase(it);
 }
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, unsigned int nMaxBytes)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+
+    // Drop orphans whose parents never showed up
+    static int64 nNextSweep;
+    int64 nNow = GetTime();
+    if (nNextSweep <= nNow)
     {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, CDataStream*>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+        vector<uint256> vExpired;
+        for (map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it)
+            if (it->second.nTimeExpire <= nNow)
+                vExpired.push_back(it->first);
+        BOOST_FOREACH(const uint256& hash, vExpired)
+            EraseOrphanTx(hash);
+        nEvicted += vExpired.size();
+        nNextSweep = nNow + ORPHAN_TX_EXPIRE_TIME / 4;
+    }
+
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsBytes > nMaxBytes)
+    {
+        // Evict a random orphan of the peer holding the most orphan bytes
+        map<int, COrphanPeer>::iterator itPeer = mapOrphanTransactionsByPeer.begin();
+        for (map<int, COrphanPeer>::iterator mi = itPeer; mi != mapOrphanTransactionsByPeer.end(); ++mi)
+            if (mi->second.nBytes > itPeer->second.nBytes)
+                itPeer = mi;
+        set<uint256>& setHash = itPeer->second.setHash;
+        set<uint256>::iterator it = setHash.lower_bound(GetRandHash());
+        if (it == setHash.end())
+            it = setHash.begin();
+        EraseOrphanTx(*it);
         ++nEvicted;
     }
     return nEvicted;
 }
 
+// Queue the orphans waiting on outputs of a transaction that just got into the pool
+void static QueueOrphansFor(const CTransaction& tx)
+{
+    uint256 hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        map<COutPoint, set<uint256> >::iterator it = mapOrphanTransactionsByPrev.find(COutPoint(hash, i));
+        if (it == mapOrphanTransactionsByPrev.end())
+            continue;
+        BOOST_FOREACH(const uint256& hashOrphan, it->second)
+            vOrphanWorkQueue.push_back(hashOrphan);
+    }
+}
+
+// Retry up to nMaxWork queued orphans. Runs from the message handler after
+// each pass over the peers, so a transaction that frees a long chain of
+// orphans does not hold up the processing of the message that carried it.
+// Returns true if orphans are still waiting.
+bool ProcessOrphanWork(unsigned int nMaxWork)
+{
+    if (vOrphanWorkQueue.empty())
+        return false;
+
+    CTxDB txdb("r");
+    for (unsigned int nWork = 0; nWork < nMaxWork && !vOrphanWorkQueue.empty(); )
+    {
+        uint256 hash = vOrphanWorkQueue.front();
+        vOrphanWorkQueue.pop_front();
+        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
+        if (it == mapOrphanTransactions.end())
+            continue;
+        nWork++;
+
+        CTransaction tx = it->second.tx;
+        CInv inv(MSG_TX, hash);
+        bool fMissingInputs = false;
+        if (tx.AcceptToMemoryPool(txdb, true, &fMissingInputs))
+        {
+            printf("   accepted orphan tx %s\n", hash.ToString().substr(0,10).c_str());
+            SyncWithWallets(tx, NULL, true);
+            RelayMessage(inv, tx);
+            mapAlreadyAskedFor.erase(inv);
+            EraseOrphanTx(hash);
+            QueueOrphansFor(tx);
+        }
+        else if (!fMissingInputs)
+        {
+            // invalid orphan
+            EraseOrphanTx(hash);
+            printf("   removed invalid orphan tx %s\n", hash.ToString().substr(0,10).c_str());
+        }
+    }
+    return !vOrphanWorkQueue.empty();
+}
+
+// Final step of taking a transaction from a peer: into the pool and relayed,
+// or kept as an orphan until its parents show up.  pmapInputsVerified is as
+// for CTxMemPool::accept.
+void static AcceptPeerTransaction(CNode* pfrom, CTransaction& tx, const MapPrevTx* pmapInputsVerified = NULL)
+{
+    CTxDB txdb("r");
+    CInv inv(MSG_TX, tx.GetHash());
+
+    bool fMissingInputs = false;
+    if (mempool.accept(txdb, tx, true, &fMissingInputs, true, pmapInputsVerified))
+    {
+        SyncWithWallets(tx, NULL, true);
+        RelayMessage(inv, tx);
+        mapAlreadyAskedFor.erase(inv);
+        EraseOrphanTx(inv.hash);
+        QueueOrphansFor(tx);
+    }
+    else if (fMissingInputs)
+    {
+        AddOrphanTx(tx, pfrom->id);
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, MAX_ORPHAN_BYTES);
+        if (nEvicted > 0)
+            printf("mapOrphan overflow, removed %u tx\n", nEvicted);
+    }
+    if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
+}
+
 
 
 
@@ -526,13 +659,21 @@ int64 CTransaction::GetMinFee(unsigned int nBlockSize, bool fAllowFree,
 }
 
 
+// pmapInputsVerified, if given, are the inputs a ThreadTxVerify worker
+// fetched, checked for standardness and verified every input script against,
+// after it checked the transaction itself.  They are only good while the best
+// chain is still the one they were fetched from, which the caller makes sure
+// of; then only pool parents can have gone away since.
 bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
-                        bool* pfMissingInputs)
+                        bool* pfMissingInputs, bool fLimitFree, const MapPrevTx* pmapInputsVerified)
 {
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
-    if (!tx.CheckTransaction())
+    if (!fCheckInputs)
+        pmapInputsVerified = NULL;
+
+    if (!pmapInputsVerified && !tx.CheckTransaction())
         return error("CTxMemPool::accept() : CheckTransaction failed");
 
     // Coinbase is only valid in a block, not as a loose transaction
@@ -544,7 +685,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         return error("CTxMemPool::accept() : not accepting nLockTime beyond 2038 yet");
 
     // Rather not work on nonstandard transactions (unless -testnet)
-    if (!fTestNet && !tx.IsStandard())
+    if (!pmapInputsVerified && !fTestNet && !tx.IsStandard())
         return error("CTxMemPool::accept() : nonstandard transaction type");
 
     // Do we already have it?
@@ -554,7 +695,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         if (mapTx.count(hash))
             return false;
     }
-    if (fCheckInputs)
+    if (fCheckInputs && !pmapInputsVerified)
         if (txdb.ContainsTx(hash))
             return false;
 
@@ -586,10 +727,23 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         }
     }
 
-    if (fCheckInputs)
+    MapPrevTx mapInputs;
+    map<uint256, CTxIndex> mapUnused;
+    bool fScriptsVerified = false;
+    if (pmapInputsVerified)
+    {
+        // Verified inputs still hold if every pool parent is still here;
+        // outputs on disk cannot have moved without the chain moving
+        fScriptsVerified = true;
+        LOCK(cs);
+        for (MapPrevTx::const_iterator mi = pmapInputsVerified->begin(); mi != pmapInputsVerified->end(); ++mi)
+            if ((*mi).second.first.pos == CDiskTxPos(1,1,1) && !mapTx.count((*mi).first))
+                fScriptsVerified = false;
+        if (fScriptsVerified)
+            mapInputs = *pmapInputsVerified;
+    }
+    if (fCheckInputs && !fScriptsVerified)
     {
-        MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
         bool fInvalid = false;
         if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
         {
@@ -603,7 +757,9 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         // Check for non-standard pay-to-script-hash in inputs
         if (!tx.AreInputsStandard(mapInputs) && !fTestNet)
             return error("CTxMemPool::accept() : nonstandard transaction input");
-
+    }
+    if (fCheckInputs)
+    {
         // Note: if you modify this code to accept non-standard transactions, then
         // you should add code here to check that the transaction does a
         // reasonable number of ECDSA signature verifications.
@@ -621,7 +777,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make others' transactions take longer to confirm.
-        if (nFees < MIN_RELAY_TX_FEE)
+        if (fLimitFree && nFees < MIN_RELAY_TX_FEE)
         {
             static CCriticalSection cs;
             static double dFreeCount;
@@ -645,7 +801,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.ConnectInputs(mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false))
+        if (!tx.ConnectInputs(mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, true, !fScriptsVerified))
         {
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
         }
@@ -659,7 +815,18 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
             printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
             remove(*ptxOld);
         }
-        addUnchecked(hash, tx);
+        addUnchecked(hash, tx, fCheckInputs ? &mapInputs : NULL);
+
+        // Wallet and reorganization re-adds skip the checks, but still need
+        // their fee rate in the index or they are the first to be evicted
+        if (!fCheckInputs)
+            checkEntry(txdb, mapTx[hash]);
+
+        // Stay within -maxmempool; if that pushes this one straight back
+        // out it is cheaper than everything already waiting
+        TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+        if (!mapTx.count(hash))
+            return error("CTxMemPool::accept() : mempool full, %s not accepted", hash.ToString().substr(0,10).c_str());
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
@@ -678,42 +845,238 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
     return mempool.accept(txdb, *this, fCheckInputs, pfMissingInputs);
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+void CTxMemPoolEntry::SetInputs(const MapPrevTx& mapInputs)
+{
+    nSigOps = tx.GetLegacySigOpCount() + tx.GetP2SHSigOpCount(mapInputs);
+    vInValue.resize(tx.vin.size());
+    vInHeight.resize(tx.vin.size());
+    nCoinbaseHeight = -1;
+
+    nValueIn = 0;
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        const COutPoint& prevout = tx.vin[i].prevout;
+        MapPrevTx::const_iterator mi = mapInputs.find(prevout.hash);
+        if (mi == mapInputs.end())
+            throw std::runtime_error("CTxMemPoolEntry::SetInputs() : prevout.hash not found");
+        const CTxIndex& txindex = (*mi).second.first;
+        const CTransaction& txPrev = (*mi).second.second;
+
+        vInValue[i] = txPrev.vout[prevout.n].nValue;
+        nValueIn += vInValue[i];
+        if (txindex.pos.IsNull() || txindex.pos == CDiskTxPos(1,1,1))
+        {
+            // Still in the memory pool
+            vInHeight[i] = -1;
+            continue;
+        }
+        vInHeight[i] = nBestHeight + 1 - txindex.GetDepthInMainChain();
+        if (txPrev.IsCoinBase())
+            nCoinbaseHeight = std::max(nCoinbaseHeight, vInHeight[i]);
+    }
+    nFee = nValueIn - tx.GetValueOut();
+
+    // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+    // client code rounds up the size to the nearest 1K. That's good, because it gives an
+    // incentive to create smaller transactions.
+    dFeePerKb = double(nFee) / (double(nTxSize)/1000.0);
+
+    nHeight = nBestHeight;
+    dStartPriority = GetPriority(nHeight);
+}
+
+size_t CTxMemPoolEntry::DynamicMemoryUsage() const
+{
+    size_t nUsage = memusage::DynamicUsage(tx.vin) + memusage::DynamicUsage(tx.vout) +
+                    memusage::DynamicUsage(vInValue) + memusage::DynamicUsage(vInHeight);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += memusage::DynamicUsage(txin.scriptSig);
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += memusage::DynamicUsage(txout.scriptPubKey);
+
+    // Its node in mapTx, its slot in the fee index and a mapNextTx node per input
+    nUsage += memusage::TreeNodeUsage<std::pair<const uint256, CTxMemPoolEntry> >();
+    nUsage += memusage::TreeNodeUsage<CTxMemPoolEntry*>();
+    nUsage += tx.vin.size() * memusage::TreeNodeUsage<std::pair<const COutPoint, CInPoint> >();
+    return nUsage;
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx, const MapPrevTx* pmapInputs)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
     {
-        mapTx[hash] = tx;
+        map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hash);
+        if (mi != mapTx.end())
+        {
+            setByFee.erase(&(*mi).second);
+            nTotalUsage -= (*mi).second.nUsageSize;
+        }
+        CTxMemPoolEntry& entry = mapTx[hash];
+        entry = CTxMemPoolEntry(tx, hash);
+        nTotalUsage += entry.nUsageSize;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+            mapNextTx[tx.vin[i].prevout] = CInPoint(&entry.tx, i);
+
+        // Without its inputs the transaction is checked when the next block
+        // template is built, and until then sorts as free in the fee index
+        if (pmapInputs)
+        {
+            entry.SetInputs(*pmapInputs);
+            entry.fChecked = true;
+        }
+        setByFee.insert(&entry);
+
+        // Transactions re-added after a reorganization may already have
+        // children in the pool, which now have to wait for them again
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it == mapNextTx.end())
+                continue;
+            map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(it->second.ptx->GetHash());
+            if (mi != mapTx.end() && (*mi).second.fChecked)
+                (*mi).second.vInHeight[it->second.n] = -1;
+        }
         nTransactionsUpdated++;
     }
     return true;
 }
 
 
-bool CTxMemPool::remove(CTransaction &tx)
+bool CTxMemPool::remove(const CTransaction &tx)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
         uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
+        map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hash);
+        if (mi != mapTx.end())
         {
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
+            setByFee.erase(&(*mi).second);
+            nTotalUsage -= (*mi).second.nUsageSize;
+            mapTx.erase(mi);
             nTransactionsUpdated++;
         }
     }
     return true;
 }
 
+void CTxMemPool::removeRecursive(const CTransaction &tx)
+{
+    // Remove transaction and everything in the pool that spends it
+    LOCK(cs);
+    vector<uint256> vRemove(1, tx.GetHash());
+    for (unsigned int i = 0; i < vRemove.size(); i++)
+    {
+        map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(vRemove[i]);
+        if (mi == mapTx.end())
+            continue;
+        const CTransaction& txRemove = (*mi).second.tx;
+        for (unsigned int n = 0; n < txRemove.vout.size(); n++)
+        {
+            map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(vRemove[i], n));
+            if (it != mapNextTx.end())
+                vRemove.push_back(it->second.ptx->GetHash());
+        }
+        remove(txRemove);
+    }
+}
+
+void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, int nHeight)
+{
+    // Called as a block connects at nHeight: its transactions leave the pool,
+    // pool transactions spending them now have confirmed inputs, and pool
+    // transactions that spend the same outputs can never confirm
+    LOCK(cs);
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        uint256 hash = tx.GetHash();
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it == mapNextTx.end())
+                continue;
+            map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(it->second.ptx->GetHash());
+            if (mi == mapTx.end() || !(*mi).second.fChecked)
+                continue;
+            CTxMemPoolEntry& entry = (*mi).second;
+            entry.vInHeight[it->second.n] = nHeight;
+            if (tx.IsCoinBase())
+                entry.nCoinbaseHeight = std::max(entry.nCoinbaseHeight, nHeight);
+        }
+
+        if (!mapTx.count(hash))
+        {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            {
+                map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
+                if (it != mapNextTx.end())
+                {
+                    CTransaction txConflict = *it->second.ptx;
+                    removeRecursive(txConflict);
+                }
+            }
+        }
+        remove(tx);
+    }
+}
+
+void CTxMemPool::uncheckAll()
+{
+    // Confirmation heights are no longer trustworthy after a reorganization;
+    // the next block template re-reads every input once.  Input values and
+    // so fee rates cannot change, so the fee index stays as it is.
+    LOCK(cs);
+    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        (*mi).second.fChecked = false;
+}
+
+bool CTxMemPool::checkEntry(CTxDB& txdb, CTxMemPoolEntry& entry)
+{
+    LOCK(cs);
+    CTransaction& tx = entry.tx;
+    if (tx.IsCoinBase())
+        return false;
+
+    MapPrevTx mapInputs;
+    map<uint256, CTxIndex> mapUnused;
+    bool fInvalid = false;
+    if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+        return false;
+    if (!tx.ConnectInputs(mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false))
+        return false;
+
+    // The fee rate is the index key, so it may only change outside the index
+    setByFee.erase(&entry);
+    entry.SetInputs(mapInputs);
+    entry.fChecked = true;
+    setByFee.insert(&entry);
+    return true;
+}
+
+void CTxMemPool::TrimToSize(size_t nSizeLimit)
+{
+    // Evict the lowest fee rate transactions, each together with everything
+    // in the pool that spends it, until the pool fits in nSizeLimit bytes
+    LOCK(cs);
+    size_t nSizeBefore = mapTx.size();
+    while (nTotalUsage > nSizeLimit && !setByFee.empty())
+        removeRecursive((*setByFee.rbegin())->tx);
+    if (mapTx.size() < nSizeBefore)
+        printf("CTxMemPool::TrimToSize() : evicted %"PRIszu" transactions, %"PRIszu" bytes in use (poolsz %"PRIszu")\n",
+               nSizeBefore - mapTx.size(), nTotalUsage, mapTx.size());
+}
+
 void CTxMemPool::clear()
 {
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    setByFee.clear();
+    nTotalUsage = 0;
     ++nTransactionsUpdated;
 }
 
@@ -723,11 +1086,140 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
 
+// Set once mempool.dat has been read back, so a shutdown during the
+// reload doesn't overwrite it with a partial pool
+static bool fMempoolLoaded = false;
+
+bool DumpMempool()
+{
+    if (!fMempoolLoaded)
+        return false;
+    CMempoolDB mdb;
+    return DumpMempool(mdb);
+}
+
+bool DumpMempool(CMempoolDB& mdb)
+{
+    int64 nStart = GetTimeMillis();
+    vector<pair<CTransaction, int64> > vtx;
+    {
+        LOCK(mempool.cs);
+        vtx.reserve(mempool.mapTx.size());
+        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            vtx.push_back(make_pair((*mi).second.tx, (*mi).second.nTime));
+    }
+
+    if (!mdb.Write(vtx))
+        return false;
+
+    printf("Flushed %"PRIszu" transactions to mempool.dat  %"PRI64d"ms\n",
+           vtx.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+unsigned int LoadMempool(CMempoolDB& mdb)
+{
+    int64 nStart = GetTimeMillis();
+    vector<pair<CTransaction, int64> > vtxRead, vtx;
+    if (!mdb.Read(vtxRead))
+        return 0;
+    size_t nTotal = vtxRead.size();
+
+    // Whatever sat in the pool for too long before the restart is dropped
+    int64 nExpireBefore = GetTime() - GetArg("-mempoolexpiry", 336) * 60 * 60;
+    vtx.reserve(vtxRead.size());
+    for (unsigned int i = 0; i < vtxRead.size(); i++)
+        if (vtxRead[i].second >= nExpireBefore)
+            vtx.push_back(vtxRead[i]);
+    size_t nExpired = nTotal - vtx.size();
+
+    // The file is in txid order, so children can come before their parents;
+    // anything missing inputs gets another pass until nothing more connects.
+    // cs_main is only held for one batch at a time.
+    unsigned int nAccepted = 0;
+    while (!vtx.empty() && !fShutdown)
+    {
+        vector<pair<CTransaction, int64> > vRetry;
+        for (unsigned int i = 0; i < vtx.size() && !fShutdown; i += 100)
+        {
+            LOCK(cs_main);
+            CTxDB txdb("r");
+            for (unsigned int j = i; j < vtx.size() && j < i + 100; j++)
+            {
+                CTransaction& tx = vtx[j].first;
+                bool fMissingInputs = false;
+                if (mempool.accept(txdb, tx, true, &fMissingInputs, false))
+                {
+                    // Keep the original time of entry
+                    LOCK(mempool.cs);
+                    map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.find(tx.GetHash());
+                    if (mi != mempool.mapTx.end())
+                        (*mi).second.nTime = vtx[j].second;
+                    nAccepted++;
+                }
+                else if (fMissingInputs)
+                    vRetry.push_back(vtx[j]);
+            }
+        }
+        if (vRetry.size() == vtx.size())
+            break;
+        vtx.swap(vRetry);
+    }
+
+    printf("Loaded %u of %"PRIszu" transactions from mempool.dat, %"PRIszu" expired  %"PRI64d"ms\n",
+           nAccepted, nTotal, nExpired, GetTimeMillis() - nStart);
+    return nAccepted;
+}
+
+void static ThreadMempoolPersist2(void* parg)
+{
+    vnThreadsRunning[THREAD_MEMPOOL]++;
+    CMempoolDB mdb;
+    LoadMempool(mdb);
+    if (!fShutdown)
+        fMempoolLoaded = true;
+
+    // Flush every 15 minutes so a crash loses little
+    int64 nLastDump = GetTime();
+    while (!fShutdown)
+    {
+        vnThreadsRunning[THREAD_MEMPOOL]--;
+        Sleep(1000);
+        vnThreadsRunning[THREAD_MEMPOOL]++;
+        if (!fShutdown && GetTime() - nLastDump >= 15 * 60)
+        {
+            DumpMempool();
+            nLastDump = GetTime();
+        }
+    }
+    vnThreadsRunning[THREAD_MEMPOOL]--;
+}
+
+void ThreadMempoolPersist(void* parg)
+{
+    // Make this thread recognisable as the mempool persistence thread
+    RenameThread("bitcoin-mempool");
+
+    try
+    {
+        ThreadMempoolPersist2(parg);
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_MEMPOOL]--;
+        PrintException(&e, "ThreadMempoolPersist()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_MEMPOOL]--;
+        PrintException(NULL, "ThreadMempoolPersist()");
+    }
+    printf("ThreadMempoolPersist exited\n");
+}
+
+
 
 
 int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
@@ -814,15 +1306,22 @@ bool CWalletTx::AcceptWalletTransaction()
 
 int CTxIndex::GetDepthInMainChain() const
 {
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
-        return 0;
-    // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
-    if (mi == mapBlockIndex.end())
-        return 0;
-    CBlockIndex* pindex = (*mi).second;
+    // Find the block in the index by its position, without touching the disk
+    CBlockIndex* pindex = NULL;
+    map<pair<unsigned int, unsigned int>, CBlockIndex*>::iterator mipos = mapBlockPos.find(make_pair(pos.nFile, pos.nBlockPos));
+    if (mipos != mapBlockPos.end())
+        pindex = (*mipos).second;
+    else
+    {
+        // Read block header
+        CBlock block;
+        if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
+            return 0;
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+        if (mi == mapBlockIndex.end())
+            return 0;
+        pindex = (*mi).second;
+    }
     if (!pindex || !pindex->IsInMainChain())
         return 0;
     return 1 + nBestHeight - pindex->nHeight;
@@ -866,22 +1365,54 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    if (nHeight < 0 || nHeight >= (int)vBlockIndexByHeight.size())
+        return NULL;
+    return vBlockIndexByHeight[nHeight];
+}
+
+// Make vBlockIndexByHeight the chain ending at pindexTip. Only the entries
+// above the point where it joins the current one are rewritten.
+void SetMainChainTip(CBlockIndex* pindexTip)
+{
+    if (pindexTip == NULL)
+    {
+        vBlockIndexByHeight.clear();
+        return;
+    }
+    vBlockIndexByHeight.resize(pindexTip->nHeight + 1);
+    for (CBlockIndex* pindex = pindexTip; pindex && vBlockIndexByHeight[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vBlockIndexByHeight[pindex->nHeight] = pindex;
+
+    // Once the blocks have caught up with the headers, the header-only
+    // entries have served their purpose
+    if (pindexBestHeader == NULL || pindexTip->bnChainWork >= pindexBestHeader->bnChainWork)
+    {
+        pindexBestHeader = pindexTip;
+        BOOST_FOREACH(PAIRTYPE(const uint256, CBlockIndex*)& item, mapHeaderIndex)
+            delete item.second;
+        mapHeaderIndex.clear();
+        nDownloadHeight = pindexTip->nHeight + 1;
+        nBlockDownloadGeneration++;
+    }
+}
+
+// Switch to a new best header. A block is only ever stored once its parent
+// is, so the blocks we have along any chain are a prefix of it; if the new
+// header is on another branch, move the download window back to the end of
+// that prefix.
+void static SetBestHeader(CBlockIndex* pindexNew)
+{
+    if (pindexNew->pprev != pindexBestHeader)
+    {
+        CBlockIndex* pindex = pindexNew;
+        while (pindex->pprev && !mapBlockIndex.count(pindex->pprev->GetBlockHash()))
+            pindex = pindex->pprev;
+        nDownloadHeight = min(nDownloadHeight, pindex->nHeight);
+    }
+    pindexBestHeader = pindexNew;
+    nBlockDownloadGeneration++;
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -898,14 +1429,6 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
     return true;
 }
 
-uint256 static GetOrphanRoot(const CBlock* pblock)
-{
-    // Work back to the first block in the orphan chain
-    while (mapOrphanBlocks.count(pblock->hashPrevBlock))
-        pblock = mapOrphanBlocks[pblock->hashPrevBlock];
-    return pblock->GetHash();
-}
-
 int64 static GetBlockValue(int nHeight, int64 nFees)
 {
     int64 nSubsidy = 50 * COIN;
@@ -977,9 +1500,7 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
     }
 
     // Go back by what we want to be 14 days worth of blocks
-    const CBlockIndex* pindexFirst = pindexLast;
-    for (int i = 0; pindexFirst && i < nInterval-1; i++)
-        pindexFirst = pindexFirst->pprev;
+    const CBlockIndex* pindexFirst = pindexLast->GetAncestor(pindexLast->nHeight - (nInterval-1));
     assert(pindexFirst);
 
     // Limit adjustment step
@@ -1238,7 +1759,8 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
 
 bool CTransaction::ConnectInputs(MapPrevTx inputs,
                                  map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash)
+                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash,
+                                 bool fScriptChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1289,7 +1811,7 @@ bool CTransaction::ConnectInputs(MapPrevTx inputs,
             // Skip ECDSA signature verification when connecting blocks (fBlock=true)
             // before the last blockchain checkpoint. This is safe because block merkle hashes are
             // still computed and checked, and any change will be caught at the next checkpoint.
-            if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
+            if (fScriptChecks && !(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
                 // Verify signature
                 if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0))
@@ -1520,13 +2042,14 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     // Find the fork
     CBlockIndex* pfork = pindexBest;
     CBlockIndex* plonger = pindexNew;
+    if (plonger->nHeight > pfork->nHeight)
+        plonger = plonger->GetAncestor(pfork->nHeight);
+    else
+        pfork = pfork->GetAncestor(plonger->nHeight);
     while (pfork != plonger)
     {
-        while (plonger->nHeight > pfork->nHeight)
-            if (!(plonger = plonger->pprev))
-                return error("Reorganize() : plonger->pprev is null");
-        if (pfork == plonger)
-            break;
+        if (!(plonger = plonger->pprev))
+            return error("Reorganize() : plonger->pprev is null");
         if (!(pfork = pfork->pprev))
             return error("Reorganize() : pfork->pprev is null");
     }
@@ -1562,7 +2085,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     }
 
     // Connect longer branch
-    vector<CTransaction> vDelete;
+    vector<vector<CTransaction> > vDelete(vConnect.size());
     for (unsigned int i = 0; i < vConnect.size(); i++)
     {
         CBlockIndex* pindex = vConnect[i];
@@ -1576,8 +2099,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         }
 
         // Queue memory transactions to delete
-        BOOST_FOREACH(const CTransaction& tx, block.vtx)
-            vDelete.push_back(tx);
+        vDelete[i].swap(block.vtx);
     }
     if (!txdb.WriteHashBestChain(pindexNew->GetBlockHash()))
         return error("Reorganize() : WriteHashBestChain failed");
@@ -1595,14 +2117,18 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+    SetMainChainTip(pindexNew);
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
         tx.AcceptToMemoryPool(txdb, false);
 
     // Delete redundant memory transactions that are in the connected branch
-    BOOST_FOREACH(CTransaction& tx, vDelete)
-        mempool.remove(tx);
+    for (unsigned int i = 0; i < vConnect.size(); i++)
+        mempool.removeForBlock(vDelete[i], vConnect[i]->nHeight);
+
+    // Inputs confirmed in the disconnected branch moved or went away
+    mempool.uncheckAll();
 
     printf("REORGANIZE: done\n");
 
@@ -1627,10 +2153,10 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    SetMainChainTip(pindexNew);
 
     // Delete redundant memory transactions
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        mempool.remove(tx);
+    mempool.removeForBlock(vtx, pindexNew->nHeight);
 
     return true;
 }
@@ -1648,6 +2174,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
         pindexGenesisBlock = pindexNew;
+        SetMainChainTip(pindexNew);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -1711,11 +2238,15 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
     bnBestChainWork = pindexNew->bnChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+    {
+        // Wake getblocktemplate long polls
+        boost::unique_lock<CWaitableCriticalSection> lock(csBestBlock);
+        cvBlockChange.notify_all();
+    }
     printf("SetBestChain: new best=%s  height=%d  work=%s  date=%s\n",
       hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainWork.ToString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
@@ -1763,11 +2294,13 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return error("AddToBlockIndex() : new CBlockIndex failed");
     map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
+    mapBlockPos[make_pair(nFile, nBlockPos)] = pindexNew;
     map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        pindexNew->BuildSkip();
     }
     pindexNew->bnChainWork = (pindexNew->pprev ? pindexNew->pprev->bnChainWork : 0) + pindexNew->GetBlockWork();
 
@@ -1800,6 +2333,72 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
 
 
 
+vector<uint256> CBlock::GetTxHashes() const
+{
+    vector<uint256> vTxHash(vtx.size());
+    if (vtx.empty())
+        return vTxHash;
+
+    // With a single lane, building the buffer costs more than it saves
+    if (SHA256BatchLanes() == 1)
+    {
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            vTxHash[i] = vtx[i].GetHash();
+        return vTxHash;
+    }
+
+    // Serialize everything into one buffer, then hash all of it side by side
+    CDataStream ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss.reserve(::GetSerializeSize(vtx, SER_GETHASH, PROTOCOL_VERSION));
+    vector<size_t> vnOffset;
+    vnOffset.reserve(vtx.size() + 1);
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        vnOffset.push_back(ss.size());
+        ss << tx;
+    }
+    vnOffset.push_back(ss.size());
+
+    vector<const unsigned char*> vpin(vtx.size());
+    vector<size_t> vnLen(vtx.size());
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        vpin[i] = (const unsigned char*)&ss.begin()[0] + vnOffset[i];
+        vnLen[i] = vnOffset[i+1] - vnOffset[i];
+    }
+    SHA256DBatch((unsigned char*)&vTxHash[0], &vpin[0], &vnLen[0], vtx.size());
+    return vTxHash;
+}
+
+uint256 CBlock::BuildMerkleTree() const
+{
+    return BuildMerkleTree(GetTxHashes());
+}
+
+uint256 CBlock::BuildMerkleTree(const vector<uint256>& vTxHash) const
+{
+    vMerkleTree = vTxHash;
+
+    // Every level is one batch of 64-byte node pairs
+    vector<unsigned char> vPairs;
+    int j = 0;
+    for (int nSize = vTxHash.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    {
+        int nPairs = (nSize + 1) / 2;
+        vPairs.resize(nPairs * 64);
+        for (int i = 0; i < nSize; i += 2)
+        {
+            int i2 = std::min(i+1, nSize-1);
+            memcpy(&vPairs[i * 32], BEGIN(vMerkleTree[j+i]), 32);
+            memcpy(&vPairs[i * 32 + 32], BEGIN(vMerkleTree[j+i2]), 32);
+        }
+        vMerkleTree.resize(j + nSize + nPairs);
+        SHA256D64((unsigned char*)&vMerkleTree[j + nSize], &vPairs[0], nPairs);
+        j += nSize;
+    }
+    return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
+}
+
 bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot) const
 {
     // These are checks that are independent of context
@@ -1831,11 +2430,8 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot) const
 
     // Check for duplicate txids. This is caught by ConnectInputs(),
     // but catching it earlier avoids a potential DoS attack:
-    set<uint256> uniqueTx;
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-    {
-        uniqueTx.insert(tx.GetHash());
-    }
+    vector<uint256> vTxHash = GetTxHashes();
+    set<uint256> uniqueTx(vTxHash.begin(), vTxHash.end());
     if (uniqueTx.size() != vtx.size())
         return DoS(100, error("CheckBlock() : duplicate transaction"));
 
@@ -1848,7 +2444,7 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot) const
         return DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
 
     // Check merkle root
-    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
+    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree(vTxHash))
         return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
     return true;
@@ -1921,13 +2517,90 @@ bool CBlock::AcceptBlock()
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (hashBestChain == hash)
     {
+        // Peers that asked for compact blocks get one right away, the
+        // same message for all of them
+        CInv inv(MSG_BLOCK, hash);
+        CSendMsg pmsgCmpct;
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
-            if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
-    }
-
-    return true;
+        {
+            if (nBestHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                continue;
+            if (!pnode->fSendCompact)
+            {
+                pnode->PushInventory(inv);
+                continue;
+            }
+            bool fKnown;
+            {
+                LOCK(pnode->cs_inventory);
+                fKnown = pnode->filterInventoryKnown.contains(inv.hash);
+                pnode->filterInventoryKnown.insert(inv.hash);
+            }
+            if (fKnown)
+                continue;
+            if (!pmsgCmpct)
+                pmsgCmpct = MakeSendMsg("shortblock", CBlockHeaderAndShortTxIDs(*this));
+            pnode->PushSendMsg(pmsgCmpct);
+        }
+    }
+
+    return true;
+}
+
+// Turn the lowest set bit off
+static inline int InvertLowestOne(int n) { return n & (n - 1); }
+
+// Height the skip pointer of a block at nHeight points to. Any height below
+// would do; this choice reaches any ancestor in O(log n) hops.
+static inline int GetSkipHeight(int nHeight)
+{
+    if (nHeight < 2)
+        return 0;
+
+    // Odd heights skip a little less far back so that runs of hops
+    // alternate between long and short jumps
+    return (nHeight & 1) ? InvertLowestOne(InvertLowestOne(nHeight - 1)) + 1 : InvertLowestOne(nHeight);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int nAncestorHeight)
+{
+    if (nAncestorHeight > nHeight || nAncestorHeight < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int nHeightWalk = nHeight;
+    while (nHeightWalk > nAncestorHeight)
+    {
+        int nHeightSkip = GetSkipHeight(nHeightWalk);
+        int nHeightSkipPrev = GetSkipHeight(nHeightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (nHeightSkip == nAncestorHeight ||
+             (nHeightSkip > nAncestorHeight && !(nHeightSkipPrev < nHeightSkip - 2 &&
+                                                 nHeightSkipPrev >= nAncestorHeight))))
+        {
+            // Only follow pskip if pprev->pskip isn't better
+            pindexWalk = pindexWalk->pskip;
+            nHeightWalk = nHeightSkip;
+        }
+        else
+        {
+            pindexWalk = pindexWalk->pprev;
+            nHeightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int nAncestorHeight) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(nAncestorHeight);
 }
 
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
@@ -1942,6 +2615,61 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
+bool CBlock::AcceptHeader(CBlockIndex*& pindexRet)
+{
+    // Known already, as a block or as a header
+    uint256 hash = GetHash();
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+    {
+        pindexRet = (*mi).second;
+        return true;
+    }
+    mi = mapHeaderIndex.find(hash);
+    if (mi != mapHeaderIndex.end())
+    {
+        pindexRet = (*mi).second;
+        return true;
+    }
+
+    // The checks of CheckBlock and AcceptBlock that need no transactions
+    if (!CheckProofOfWork(hash, nBits))
+        return DoS(50, error("AcceptHeader() : proof of work failed"));
+    if (GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return error("AcceptHeader() : block timestamp too far in the future");
+
+    mi = mapBlockIndex.find(hashPrevBlock);
+    if (mi == mapBlockIndex.end())
+    {
+        mi = mapHeaderIndex.find(hashPrevBlock);
+        if (mi == mapHeaderIndex.end())
+            return error("AcceptHeader() : prev block not found");
+    }
+    CBlockIndex* pindexPrev = (*mi).second;
+    int nHeight = pindexPrev->nHeight+1;
+
+    if (nBits != GetNextWorkRequired(pindexPrev, this))
+        return DoS(100, error("AcceptHeader() : incorrect proof of work"));
+    if (GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return error("AcceptHeader() : block's timestamp is too early");
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+        return DoS(100, error("AcceptHeader() : rejected by checkpoint lock-in at %d", nHeight));
+
+    CBlockIndex* pindexNew = new CBlockIndex(0, 0, *this);
+    mi = mapHeaderIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+    pindexNew->pprev = pindexPrev;
+    pindexNew->nHeight = nHeight;
+    pindexNew->bnChainWork = pindexPrev->bnChainWork + pindexNew->GetBlockWork();
+    pindexNew->BuildSkip();
+
+    if (pindexNew->bnChainWork > pindexBestHeader->bnChainWork)
+        SetBestHeader(pindexNew);
+
+    pindexRet = pindexNew;
+    return true;
+}
+
 bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 {
     // Check for duplicate
@@ -1989,9 +2717,12 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             CBlock* pblock2 = new CBlock(*pblock);
             mapOrphanBlocks.insert(make_pair(hash, pblock2));
             mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
+            nOrphanBlocksSize += ::GetSerializeSize(*pblock2, SER_NETWORK, PROTOCOL_VERSION);
 
-            // Ask this guy to fill in what we're missing
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+            // Ask this guy to fill in what we're missing, unless the
+            // block is one we asked for on the strength of its header
+            if (!mapHeaderIndex.count(hash))
+                pfrom->PushGetHeaders(pindexBestHeader);
         }
         return true;
     }
@@ -2014,6 +2745,7 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             if (pblockOrphan->AcceptBlock())
                 vWorkQueue.push_back(pblockOrphan->GetHash());
             mapOrphanBlocks.erase(pblockOrphan->GetHash());
+            nOrphanBlocksSize -= ::GetSerializeSize(*pblockOrphan, SER_NETWORK, PROTOCOL_VERSION);
             delete pblockOrphan;
         }
         mapOrphanBlocksByPrev.erase(hashPrev);
@@ -2411,6 +3143,379 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 // a large 4-byte int at any alignment.
 unsigned char pchMessageStart[4] = { 0xf9, 0xbe, 0xb4, 0xd9 };
 
+// The last few blocks served, framed, so a new block requested by every
+// peer is read once and the same buffer queued to all of them. cs_blockmsg
+// also covers the message checksums kept in CBlockIndex.
+static CCriticalSection cs_blockmsg;
+static map<uint256, CSendMsg> mapBlockMsgCache;
+static deque<uint256> vBlockMsgCacheOrder;
+
+// Build the "block" message for pindex from the block file, where blocks are
+// stored in network format behind the message start and their size. The
+// bytes are never deserialized; only the header is hashed to check it is the
+// block we want, and the checksum is computed the first time. Block file
+// positions never change, so this runs without cs_main.
+CSendMsg static ReadBlockMsg(CBlockIndex* pindex)
+{
+    if (pindex->nBlockPos < 8)
+        return CSendMsg();
+    CAutoFile filein = CAutoFile(OpenBlockFile(pindex->nFile, pindex->nBlockPos - 8, "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+    {
+        error("ReadBlockMsg() : OpenBlockFile failed");
+        return CSendMsg();
+    }
+
+    boost::shared_ptr<CSerializeData> pmsg;
+    try {
+        char pchMessageStartDisk[4];
+        unsigned int nSize;
+        filein >> FLATDATA(pchMessageStartDisk) >> nSize;
+        if (memcmp(pchMessageStartDisk, pchMessageStart, sizeof(pchMessageStart)) != 0 ||
+            nSize < 80 || nSize > MAX_BLOCK_SIZE)
+        {
+            error("ReadBlockMsg() : bad block file entry for %s", pindex->GetBlockHash().ToString().substr(0,20).c_str());
+            return CSendMsg();
+        }
+        pmsg.reset(new CSerializeData(CMessageHeader::HEADER_SIZE + nSize));
+        filein.read(&(*pmsg)[CMessageHeader::HEADER_SIZE], nSize);
+    }
+    catch (std::exception &e) {
+        error("%s() : I/O error", __PRETTY_FUNCTION__);
+        return CSendMsg();
+    }
+
+    const char* pchBlock = &(*pmsg)[CMessageHeader::HEADER_SIZE];
+    unsigned int nSize = pmsg->size() - CMessageHeader::HEADER_SIZE;
+    if (Hash(pchBlock, pchBlock + 80) != pindex->GetBlockHash())
+    {
+        error("ReadBlockMsg() : block file entry is not %s", pindex->GetBlockHash().ToString().substr(0,20).c_str());
+        return CSendMsg();
+    }
+
+    CMessageHeader hdr("block", nSize);
+    {
+        LOCK(cs_blockmsg);
+        if (pindex->nMsgSize != nSize)
+        {
+            uint256 hash = Hash(pchBlock, pchBlock + nSize);
+            memcpy(&pindex->nMsgChecksum, &hash, sizeof(pindex->nMsgChecksum));
+            pindex->nMsgSize = nSize;
+        }
+        hdr.nChecksum = pindex->nMsgChecksum;
+    }
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << hdr;
+    memcpy(&(*pmsg)[0], &ssHeader[0], CMessageHeader::HEADER_SIZE);
+    return pmsg;
+}
+
+CSendMsg static GetBlockMsg(CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    {
+        LOCK(cs_blockmsg);
+        map<uint256, CSendMsg>::iterator mi = mapBlockMsgCache.find(hash);
+        if (mi != mapBlockMsgCache.end())
+            return mi->second;
+    }
+
+    CSendMsg pmsg = ReadBlockMsg(pindex);
+    if (!pmsg)
+        return pmsg;
+
+    LOCK(cs_blockmsg);
+    if (mapBlockMsgCache.insert(make_pair(hash, pmsg)).second)
+    {
+        vBlockMsgCacheOrder.push_back(hash);
+        if (vBlockMsgCacheOrder.size() > BLOCK_MSG_CACHE_SIZE)
+        {
+            mapBlockMsgCache.erase(vBlockMsgCacheOrder.front());
+            vBlockMsgCacheOrder.pop_front();
+        }
+    }
+    return pmsg;
+}
+
+// Send the blocks getdata asked for, as far as the send buffer allows.
+// Returns true once none are left waiting.
+bool static SendGetDataBlocks(CNode* pfrom)
+{
+    while (!pfrom->vGetDataBlocks.empty() && pfrom->nSendSize < SendBufferSize() && !pfrom->fDisconnect)
+    {
+        CBlockIndex* pindex = pfrom->vGetDataBlocks.front();
+        pfrom->vGetDataBlocks.pop_front();
+        CSendMsg pmsg = GetBlockMsg(pindex);
+        if (pmsg)
+            pfrom->PushSendMsg(pmsg);
+
+        // Trigger them to send a getblocks request for the next batch of inventory
+        if (pindex->GetBlockHash() == pfrom->hashContinue)
+        {
+            // Bypass PushInventory, this must send even if redundant,
+            // and we want it right after the last block so they don't
+            // wait for other stuff first.
+            vector<CInv> vInv;
+            {
+                LOCK(cs_main);
+                vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+            }
+            pfrom->PushMessage("inv", vInv);
+            pfrom->hashContinue = 0;
+        }
+    }
+
+    // Transactions picked out of recent blocks, parsed from the same bytes
+    while (pfrom->vGetDataBlocks.empty() && !pfrom->vGetBlockTxn.empty() &&
+           pfrom->nSendSize < SendBufferSize() && !pfrom->fDisconnect)
+    {
+        CBlockIndex* pindex = pfrom->vGetBlockTxn.front().first;
+        vector<unsigned short> vIndexes;
+        vIndexes.swap(pfrom->vGetBlockTxn.front().second);
+        pfrom->vGetBlockTxn.pop_front();
+        CSendMsg pmsg = GetBlockMsg(pindex);
+        if (!pmsg)
+            continue;
+
+        CBlock block;
+        try {
+            CDataStream ssBlock(&(*pmsg)[CMessageHeader::HEADER_SIZE], &(*pmsg)[0] + pmsg->size(), SER_NETWORK, PROTOCOL_VERSION);
+            ssBlock >> block;
+        }
+        catch (std::exception &e) {
+            error("SendGetDataBlocks() : deserialize of %s failed", pindex->GetBlockHash().ToString().substr(0,20).c_str());
+            continue;
+        }
+        CBlockTransactions resp;
+        resp.hashBlock = pindex->GetBlockHash();
+        resp.vtx.reserve(vIndexes.size());
+        BOOST_FOREACH(unsigned short nIndex, vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(100);
+                error("SendGetDataBlocks() : getshorttxn index %u out of range", nIndex);
+                break;
+            }
+            resp.vtx.push_back(block.vtx[nIndex]);
+        }
+        if (resp.vtx.size() == vIndexes.size())
+            pfrom->PushMessage("shorttxn", resp);
+    }
+    return pfrom->vGetDataBlocks.empty() && pfrom->vGetBlockTxn.empty();
+}
+
+
+// Headers-first block download. Headers come from one peer at a time and are
+// checked into header-only CBlockIndex entries (mapHeaderIndex). The blocks
+// along the best header chain are then requested from every peer that has
+// them: no further than BLOCK_DOWNLOAD_WINDOW past the first missing block,
+// at most MAX_BLOCKS_IN_TRANSIT_PER_PEER at a time from each, and a request
+// that is not answered within BLOCK_DOWNLOAD_TIMEOUT goes to another peer.
+// Blocks that arrive ahead of their parents wait in mapOrphanBlocks and are
+// connected in order by ProcessBlock. Once MAX_ORPHAN_BLOCKS_SIZE bytes are
+// waiting only the first missing block is asked for, and if that one takes
+// longer than BLOCK_STALL_TIMEOUT while others wait on it, it is asked of
+// another peer. A peer is only asked for blocks up to the best one it has
+// shown us it has. Protected by cs_main.
+map<int, CBlockDownloadPeer> mapBlockDownloadPeer;
+map<uint256, pair<int, int64> > mapBlocksInFlight; // block -> (peer id, time asked)
+static int nHeaderSyncPeer = -1;
+static int64 nHeaderSyncTime = 0;
+uint256 hashBlockStalled = 0; // first missing block taken away from nBlockStalledPeer
+int nBlockStalledPeer = -1;
+static map<int, CPartialBlock> mapPartialBlocks; // compact block waiting for shorttxn, by peer
+
+bool static IsBlockSource(CNode* pnode)
+{
+    return !pnode->fClient && !pnode->fOneShot && !pnode->fDisconnect &&
+           (pnode->nVersion < NOBLKS_VERSION_START || pnode->nVersion >= NOBLKS_VERSION_END);
+}
+
+void static MarkBlockReceived(const uint256& hash)
+{
+    map<uint256, pair<int, int64> >::iterator it = mapBlocksInFlight.find(hash);
+    if (it == mapBlocksInFlight.end())
+        return;
+    map<int, CBlockDownloadPeer>::iterator mi = mapBlockDownloadPeer.find(it->second.first);
+    if (mi != mapBlockDownloadPeer.end())
+        mi->second.nBlocksInFlight--;
+    mapBlocksInFlight.erase(it);
+    nBlockDownloadGeneration++;
+}
+
+void static MarkBlockInFlight(const uint256& hash, int nPeer)
+{
+    MarkBlockReceived(hash);
+    mapBlocksInFlight[hash] = make_pair(nPeer, GetTime());
+    mapBlockDownloadPeer[nPeer].nBlocksInFlight++;
+}
+
+// A peer that has a block has all of the blocks before it, so it can be
+// asked for anything on the best header chain up to that height
+void UpdateBlockAvailability(CNode* pnode, const uint256& hash)
+{
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    if (mi == mapBlockIndex.end())
+    {
+        mi = mapHeaderIndex.find(hash);
+        if (mi == mapHeaderIndex.end())
+            return;
+    }
+    CBlockDownloadPeer& peer = mapBlockDownloadPeer[pnode->id];
+    if ((*mi).second->nHeight > peer.nBestKnownHeight)
+    {
+        peer.nBestKnownHeight = (*mi).second->nHeight;
+        peer.nIdleGeneration = -1;
+    }
+}
+
+// Give up on requests to peers that are gone or too slow, at most once a second
+void ExpireBlockDownloads()
+{
+    static int64 nLastExpire;
+    int64 nNow = GetTime();
+    if (nNow == nLastExpire)
+        return;
+    nLastExpire = nNow;
+
+    set<int> setPeers;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (!pnode->fDisconnect)
+                setPeers.insert(pnode->id);
+    }
+
+    map<uint256, pair<int, int64> >::iterator it = mapBlocksInFlight.begin();
+    while (it != mapBlocksInFlight.end())
+    {
+        if (setPeers.count(it->second.first) && nNow - it->second.second <= BLOCK_DOWNLOAD_TIMEOUT)
+        {
+            it++;
+            continue;
+        }
+        uint256 hash = it->first;
+        if (fDebug)
+            printf("block %s from peer %d timed out\n", hash.ToString().substr(0,20).c_str(), it->second.first);
+        it++;
+        MarkBlockReceived(hash);
+    }
+
+    map<int, CBlockDownloadPeer>::iterator mi = mapBlockDownloadPeer.begin();
+    while (mi != mapBlockDownloadPeer.end())
+    {
+        if (setPeers.count(mi->first))
+            mi++;
+        else
+            mapBlockDownloadPeer.erase(mi++);
+    }
+
+    // Blocks past the first missing one are waiting on it; a peer that
+    // sits on it for too long loses it to whoever asks next
+    if (pindexBestHeader && nDownloadHeight <= pindexBestHeader->nHeight && !mapOrphanBlocks.empty() &&
+        mapBlockDownloadPeer.size() > 1)
+    {
+        uint256 hash = pindexBestHeader->GetAncestor(nDownloadHeight)->GetBlockHash();
+        map<uint256, pair<int, int64> >::iterator fi = mapBlocksInFlight.find(hash);
+        if (fi != mapBlocksInFlight.end() && nNow - fi->second.second > BLOCK_STALL_TIMEOUT)
+        {
+            printf("block %s from peer %d is holding up the download, asking another peer\n", hash.ToString().substr(0,20).c_str(), fi->second.first);
+            hashBlockStalled = hash;
+            nBlockStalledPeer = fi->second.first;
+            MarkBlockReceived(hash);
+        }
+    }
+
+    // Compact blocks whose missing transactions are no longer expected
+    map<int, CPartialBlock>::iterator pi = mapPartialBlocks.begin();
+    while (pi != mapPartialBlocks.end())
+    {
+        map<uint256, pair<int, int64> >::iterator fi = mapBlocksInFlight.find(pi->second.block.GetHash());
+        if (fi != mapBlocksInFlight.end() && fi->second.first == pi->first)
+            pi++;
+        else
+            mapPartialBlocks.erase(pi++);
+    }
+
+    if (nHeaderSyncPeer != -1 && (!setPeers.count(nHeaderSyncPeer) || nNow - nHeaderSyncTime > HEADERS_DOWNLOAD_TIMEOUT))
+    {
+        printf("header sync from peer %d stalled\n", nHeaderSyncPeer);
+        if (setPeers.count(nHeaderSyncPeer))
+            mapBlockDownloadPeer[nHeaderSyncPeer].fHeadersDone = true;
+        nHeaderSyncPeer = -1;
+    }
+}
+
+// Ask pto for blocks along the best header chain that nobody is sending yet
+void FindBlocksToDownload(CNode* pto, vector<CInv>& vGetData)
+{
+    CBlockDownloadPeer& peer = mapBlockDownloadPeer[pto->id];
+    if (peer.nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER || peer.nIdleGeneration == nBlockDownloadGeneration)
+        return;
+    if (mapHeaderIndex.empty())
+        return;
+
+    // Move the window up past the blocks we have
+    while (nDownloadHeight <= pindexBestHeader->nHeight &&
+           mapBlockIndex.count(pindexBestHeader->GetAncestor(nDownloadHeight)->GetBlockHash()))
+        nDownloadHeight++;
+
+    // Blocks waiting for their parents are held in memory; past the limit
+    // only the one everything is waiting on is worth asking for
+    int nMaxHeight = min(pindexBestHeader->nHeight, nDownloadHeight + BLOCK_DOWNLOAD_WINDOW - 1);
+    if (nOrphanBlocksSize >= MAX_ORPHAN_BLOCKS_SIZE)
+        nMaxHeight = nDownloadHeight;
+    nMaxHeight = min(nMaxHeight, peer.nBestKnownHeight);
+    vector<CBlockIndex*> vWindow;
+    if (nMaxHeight >= nDownloadHeight)
+        for (CBlockIndex* pindex = pindexBestHeader->GetAncestor(nMaxHeight); pindex && pindex->nHeight >= nDownloadHeight; pindex = pindex->pprev)
+            vWindow.push_back(pindex);
+
+    BOOST_REVERSE_FOREACH(CBlockIndex* pindex, vWindow)
+    {
+        if (peer.nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+            return;
+        uint256 hash = pindex->GetBlockHash();
+        if (mapBlocksInFlight.count(hash) || mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+            continue;
+        if (hash == hashBlockStalled && pto->id == nBlockStalledPeer)
+            continue;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+        MarkBlockInFlight(hash, pto->id);
+    }
+
+    // Nothing more for this peer until something changes
+    peer.nIdleGeneration = nBlockDownloadGeneration;
+}
+
+// A block has arrived whole, or been rebuilt from a compact block
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+    MarkBlockReceived(inv.hash);
+
+    if (ProcessBlock(pfrom, &block))
+        mapAlreadyAskedFor.erase(inv);
+    UpdateBlockAvailability(pfrom, inv.hash);
+    if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+}
+
+// A short ID collision fills in the wrong transaction, which the merkle root
+// gives away. The peer is not to blame; get the block whole instead.
+void static ProcessCompactBlock(CNode* pfrom, CBlock& block)
+{
+    uint256 hash = block.GetHash();
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+    {
+        printf("compact block %s does not match its merkle root, requesting it whole\n", hash.ToString().substr(0,20).c_str());
+        MarkBlockInFlight(hash, pfrom->id);
+        pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hash)));
+        return;
+    }
+    ProcessReceivedBlock(pfrom, block);
+}
 
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
@@ -2484,7 +3589,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         // Change version
         pfrom->PushMessage("verack");
-        pfrom->vSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->ssSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+        // Ask for new blocks as compact blocks; older nodes ignore this
+        pfrom->PushMessage("sendshort", true, SHORTBLOCK_VERSION);
 
         if (!pfrom->fInbound)
         {
@@ -2511,17 +3619,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             }
         }
 
-        // Ask the first connected node for block updates
-        static int nAskedForBlocks = 0;
-        if (!pfrom->fClient && !pfrom->fOneShot &&
-            (pfrom->nStartingHeight > (nBestHeight - 144)) &&
-            (pfrom->nVersion < NOBLKS_VERSION_START ||
-             pfrom->nVersion >= NOBLKS_VERSION_END) &&
-             (nAskedForBlocks < 1 || vNodes.size() <= 1))
-        {
-            nAskedForBlocks++;
-            pfrom->PushGetBlocks(pindexBest, uint256(0));
-        }
+        // Syncing headers and blocks from this node is up to SendMessages
 
         // Relay alerts
         {
@@ -2548,7 +3646,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "verack")
     {
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
     }
 
 
@@ -2584,7 +3682,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the filterAddrKnowns of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -2629,14 +3727,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             return error("message inv size() = %"PRIszu"", vInv.size());
         }
 
-        // find last block in inv vector
-        unsigned int nLastBlock = (unsigned int)(-1);
-        for (unsigned int nInv = 0; nInv < vInv.size(); nInv++) {
-            if (vInv[vInv.size() - 1 - nInv].type == MSG_BLOCK) {
-                nLastBlock = vInv.size() - 1 - nInv;
-                break;
-            }
-        }
         CTxDB txdb("r");
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
         {
@@ -2645,23 +3735,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (fShutdown)
                 return true;
             pfrom->AddInventoryKnown(inv);
+            if (inv.type == MSG_BLOCK)
+                UpdateBlockAvailability(pfrom, inv.hash);
 
             bool fAlreadyHave = AlreadyHave(txdb, inv);
             if (fDebug)
                 printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave)
-                pfrom->AskFor(inv);
-            else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
-                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
-            } else if (nInv == nLastBlock) {
-                // In case we are on a very long side-chain, it is possible that we already have
-                // the last block in an inv bundle sent in response to getblocks. Try to detect
-                // this situation and push another getblocks to continue.
-                pfrom->PushGetBlocks(mapBlockIndex[inv.hash], uint256(0));
-                if (fDebug)
-                    printf("force request: %s\n", inv.ToString().c_str());
+            {
+                if (!(inv.type == MSG_BLOCK && mapBlocksInFlight.count(inv.hash)))
+                    pfrom->AskFor(inv);
             }
+            else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash) && !mapHeaderIndex.count(inv.hash))
+                pfrom->PushGetHeaders(pindexBestHeader);
 
             // Track requests for our stuff
             Inventory(inv.hash);
@@ -2691,26 +3778,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
             if (inv.type == MSG_BLOCK)
             {
-                // Send block from disk
+                // Sent from disk by ProcessMessages once cs_main is released
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
-                {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
-
-                    // Trigger them to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
-                    {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
-                        pfrom->PushMessage("inv", vInv);
-                        pfrom->hashContinue = 0;
-                    }
-                }
+                    pfrom->vGetDataBlocks.push_back((*mi).second);
             }
             else if (inv.IsKnownType())
             {
@@ -2812,72 +3883,58 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
-    else if (strCommand == "tx")
+    else if (strCommand == "headers")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CDataStream vMsg(vRecv);
-        CTxDB txdb("r");
-        CTransaction tx;
-        vRecv >> tx;
-
-        CInv inv(MSG_TX, tx.GetHash());
-        pfrom->AddInventoryKnown(inv);
-
-        bool fMissingInputs = false;
-        if (tx.AcceptToMemoryPool(txdb, true, &fMissingInputs))
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
         {
-            SyncWithWallets(tx, NULL, true);
-            RelayMessage(inv, vMsg);
-            mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %"PRIszu"", vHeaders.size());
+        }
 
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        CBlockIndex* pindexLast = NULL;
+        BOOST_FOREACH(CBlock& header, vHeaders)
+        {
+            if (!header.vtx.empty() || (pindexLast && header.hashPrevBlock != pindexLast->GetBlockHash()))
             {
-                uint256 hashPrev = vWorkQueue[i];
-                for (map<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
-                {
-                    const CDataStream& vMsg = *((*mi).second);
-                    CTransaction tx;
-                    CDataStream(vMsg) >> tx;
-                    CInv inv(MSG_TX, tx.GetHash());
-                    bool fMissingInputs2 = false;
-
-                    if (tx.AcceptToMemoryPool(txdb, true, &fMissingInputs2))
-                    {
-                        printf("   accepted orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-                        SyncWithWallets(tx, NULL, true);
-                        RelayMessage(inv, vMsg);
-                        mapAlreadyAskedFor.erase(inv);
-                        vWorkQueue.push_back(inv.hash);
-                        vEraseQueue.push_back(inv.hash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // invalid orphan
-                        vEraseQueue.push_back(inv.hash);
-                        printf("   removed invalid orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-                    }
-                }
+                pfrom->Misbehaving(20);
+                return error("message headers : not a chain of headers");
+            }
+            if (!header.AcceptHeader(pindexLast))
+            {
+                if (header.nDoS) pfrom->Misbehaving(header.nDoS);
+                return error("message headers : AcceptHeader FAILED");
             }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
         }
-        else if (fMissingInputs)
+        if (pindexLast)
+            UpdateBlockAvailability(pfrom, pindexLast->GetBlockHash());
+        if (fDebug)
+            printf("received %"PRIszu" headers, best header %d\n", vHeaders.size(), pindexBestHeader->nHeight);
+
+        // A full batch means there are more
+        CBlockDownloadPeer& peer = mapBlockDownloadPeer[pfrom->id];
+        if (vHeaders.size() == MAX_HEADERS_RESULTS)
         {
-            AddOrphanTx(vMsg);
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
-            if (nEvicted > 0)
-                printf("mapOrphan overflow, removed %u tx\n", nEvicted);
+            pfrom->PushGetHeaders(pindexLast);
+            if (pfrom->id == nHeaderSyncPeer)
+                nHeaderSyncTime = GetTime();
+        }
+        else
+        {
+            peer.fHeadersDone = true;
+            if (pfrom->id == nHeaderSyncPeer)
+                nHeaderSyncPeer = -1;
         }
-        if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
+    }
+
+
+    else if (strCommand == "tx")
+    {
+        CTransaction tx;
+        vRecv >> tx;
+        pfrom->AddInventoryKnown(CInv(MSG_TX, tx.GetHash()));
+        AcceptPeerTransaction(pfrom, tx);
     }
 
 
@@ -2889,33 +3946,140 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         printf("received block %s\n", block.GetHash().ToString().substr(0,20).c_str());
         // block.print();
 
-        CInv inv(MSG_BLOCK, block.GetHash());
-        pfrom->AddInventoryKnown(inv);
-
-        if (ProcessBlock(pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
-        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+        ProcessReceivedBlock(pfrom, block);
     }
 
 
-    else if (strCommand == "getaddr")
+    else if (strCommand == "sendshort")
     {
-        pfrom->vAddrToSend.clear();
-        vector<CAddress> vAddr = addrman.GetAddr();
-        BOOST_FOREACH(const CAddress &addr, vAddr)
-            pfrom->PushAddress(addr);
+        bool fAnnounce = false;
+        uint64 nCmpctVersion = 0;
+        vRecv >> fAnnounce >> nCmpctVersion;
+        if (nCmpctVersion == SHORTBLOCK_VERSION)
+            pfrom->fSendCompact = fAnnounce;
     }
 
 
-    else if (strCommand == "mempool")
+    else if (strCommand == "shortblock")
     {
-        std::vector<uint256> vtxid;
-        mempool.queryHashes(vtxid);
-        vector<CInv> vInv;
-        for (unsigned int i = 0; i < vtxid.size(); i++) {
-            CInv inv(MSG_TX, vtxid[i]);
-            vInv.push_back(inv);
-            if (i == (MAX_INV_SZ - 1))
+        CBlockHeaderAndShortTxIDs cmpct;
+        vRecv >> cmpct;
+
+        uint256 hash = cmpct.header.GetHash();
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+        printf("received compact block %s (%"PRIszu" short IDs)\n", hash.ToString().substr(0,20).c_str(), cmpct.vShortTxIDs.size());
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+            return true;
+
+        // Not connected to anything we know; catch up on headers first
+        const uint256& hashPrev = cmpct.header.hashPrevBlock;
+        if (!mapBlockIndex.count(hashPrev) && !mapHeaderIndex.count(hashPrev))
+        {
+            pfrom->PushGetHeaders(pindexBestHeader);
+            return true;
+        }
+        CBlockIndex* pindex = NULL;
+        if (!cmpct.header.AcceptHeader(pindex))
+        {
+            if (cmpct.header.nDoS) pfrom->Misbehaving(cmpct.header.nDoS);
+            return error("message shortblock : AcceptHeader FAILED");
+        }
+        UpdateBlockAvailability(pfrom, hash);
+
+        // Rebuilding needs the parent to connect to; otherwise the block
+        // is downloaded whole along with the blocks before it
+        if (!mapBlockIndex.count(hashPrev))
+            return true;
+
+        CPartialBlock& partial = mapPartialBlocks[pfrom->id];
+        partial = CPartialBlock();
+        if (!partial.Init(cmpct, mempool))
+        {
+            // Not necessarily malice, a peer may encode these differently;
+            // get the block whole instead
+            mapPartialBlocks.erase(pfrom->id);
+            MarkBlockInFlight(hash, pfrom->id);
+            pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hash)));
+            return error("message shortblock : unusable compact block, requesting it whole");
+        }
+
+        CBlockTransactionsRequest req;
+        req.hashBlock = hash;
+        partial.GetMissing(req.vIndexes);
+        if (fDebug)
+            printf("compact block %s: %u transactions from the memory pool, %"PRIszu" to fetch\n", hash.ToString().substr(0,20).c_str(), partial.nFromPool, req.vIndexes.size());
+        if (req.vIndexes.empty())
+        {
+            CBlock block = partial.block;
+            mapPartialBlocks.erase(pfrom->id);
+            ProcessCompactBlock(pfrom, block);
+            return true;
+        }
+        MarkBlockInFlight(hash, pfrom->id);
+        pfrom->PushMessage("getshorttxn", req);
+    }
+
+
+    else if (strCommand == "getshorttxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.hashBlock);
+        if (mi == mapBlockIndex.end())
+            return true;
+
+        // Only recent blocks are worth picking apart, send older ones whole
+        CBlockIndex* pindex = (*mi).second;
+        if (pindex->nHeight < nBestHeight - MAX_BLOCKTXN_DEPTH)
+        {
+            pfrom->vGetDataBlocks.push_back(pindex);
+            return true;
+        }
+
+        // Answered from the block's message bytes once cs_main is released
+        pfrom->vGetBlockTxn.push_back(make_pair(pindex, req.vIndexes));
+    }
+
+
+    else if (strCommand == "shorttxn")
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        map<int, CPartialBlock>::iterator mi = mapPartialBlocks.find(pfrom->id);
+        if (mi == mapPartialBlocks.end() || (*mi).second.block.GetHash() != resp.hashBlock)
+            return true;
+        bool fFilled = (*mi).second.FillMissing(resp.vtx);
+        CBlock block = (*mi).second.block;
+        mapPartialBlocks.erase(mi);
+        if (!fFilled)
+        {
+            pfrom->Misbehaving(100);
+            return error("message shorttxn : does not answer getshorttxn");
+        }
+        ProcessCompactBlock(pfrom, block);
+    }
+
+
+    else if (strCommand == "getaddr")
+    {
+        pfrom->vAddrToSend.clear();
+        vector<CAddress> vAddr = addrman.GetAddr();
+        BOOST_FOREACH(const CAddress &addr, vAddr)
+            pfrom->PushAddress(addr);
+    }
+
+
+    else if (strCommand == "mempool")
+    {
+        std::vector<uint256> vtxid;
+        mempool.queryHashes(vtxid);
+        vector<CInv> vInv;
+        for (unsigned int i = 0; i < vtxid.size(); i++) {
+            CInv inv(MSG_TX, vtxid[i]);
+            vInv.push_back(inv);
+            if (i == (MAX_INV_SZ - 1))
                     break;
         }
         if (vInv.size() > 0)
@@ -2992,6 +4156,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "pong")
+    {
+        int64 nNow = GetTimeMicros();
+        uint64 nonce = 0;
+        if (vRecv.size() >= sizeof(nonce))
+            vRecv >> nonce;
+
+        // Only the answer to the ping still outstanding counts
+        if (nonce != 0 && nonce == pfrom->nPingNonceSent)
+        {
+            pfrom->nPingUsecTime = nNow - pfrom->nPingUsecStart;
+            pfrom->nPingNonceSent = 0;
+        }
+    }
+
+
     else if (strCommand == "alert")
     {
         CAlert alert;
@@ -3038,13 +4218,217 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
-bool ProcessMessages(CNode* pfrom)
+//////////////////////////////////////////////////////////////////////////////
+//
+// Transaction pre-validation
+//
+// Transactions from peers are checked in two stages. ThreadTxVerify workers
+// run the context-free checks and verify the input scripts, holding cs_main
+// only while they fetch a snapshot of the inputs. The message handler then
+// takes the snapshot as it is if the best chain has not moved since: under
+// cs_main it only checks that pool parents are still there, the conflict
+// and fee checks, and inserts. If the chain did move, the transaction goes
+// through the full AcceptToMemoryPool path, where the signature cache still
+// saves the ECDSA work.
+//
+
+struct CTxVerifyJob
+{
+    CNode* pfrom;
+    CTransaction tx;
+    bool fRejected;
+    bool fVerified;          // mapInputs holds every input, all scripts verified
+    MapPrevTx mapInputs;
+    uint256 hashInputsChain; // best chain when mapInputs was fetched
+};
+
+static CWaitableCriticalSection cs_txverify;
+static boost::condition_variable cvTxVerify;
+static deque<CTxVerifyJob> vTxVerifyQueue;
+static deque<CTxVerifyJob> vTxVerified;
+static int nTxVerifyThreads = 0;
+
+// Hand a tx message to the workers; false if it has to be processed inline
+bool static QueueTxVerify(CNode* pfrom, CDataStream& vRecv)
 {
-    CDataStream& vRecv = pfrom->vRecv;
-    if (vRecv.empty())
+    if (nTxVerifyThreads == 0 || pfrom->nVersion == 0)
+        return false;
+
+    CTxVerifyJob job;
+    vRecv >> job.tx;
+    job.fRejected = false;
+    job.fVerified = false;
+    pfrom->AddInventoryKnown(CInv(MSG_TX, job.tx.GetHash()));
+
+    bool fQueued = false;
+    {
+        boost::unique_lock<CWaitableCriticalSection> lock(cs_txverify);
+        if (vTxVerifyQueue.size() < MAX_TX_VERIFY_QUEUE)
+        {
+            {
+                LOCK(cs_vNodes);
+                job.pfrom = pfrom->AddRef();
+            }
+            vTxVerifyQueue.push_back(job);
+            fQueued = true;
+        }
+    }
+    if (!fQueued)
+    {
+        // Workers are behind, let the peer wait on the main lock instead
+        LOCK(cs_main);
+        AcceptPeerTransaction(pfrom, job.tx);
         return true;
+    }
+    cvTxVerify.notify_one();
+    return true;
+}
+
+void static PreValidateTransaction(CTxVerifyJob& job)
+{
+    CTransaction& tx = job.tx;
+    job.fRejected = true;
+    if (!tx.CheckTransaction())
+        return;
+    if (tx.IsCoinBase())
+    {
+        tx.DoS(100, error("PreValidateTransaction() : coinbase as individual tx"));
+        return;
+    }
+    if (!fTestNet && !tx.IsStandard())
+    {
+        error("PreValidateTransaction() : nonstandard transaction type");
+        return;
+    }
+    job.fRejected = false;
+
+    CTxDB txdb("r");
+    MapPrevTx& mapInputs = job.mapInputs;
+    {
+        LOCK(cs_main);
+        if (mempool.exists(tx.GetHash()))
+            return;
+        if (txdb.ContainsTx(tx.GetHash()))
+        {
+            job.fRejected = true;
+            return;
+        }
+        map<uint256, CTxIndex> mapUnused;
+        bool fInvalid = false;
+        if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+            return;
+        job.hashInputsChain = hashBestChain;
+    }
+    if (!fTestNet && !tx.AreInputsStandard(mapInputs))
+    {
+        job.fRejected = true;
+        error("PreValidateTransaction() : nonstandard transaction input");
+        return;
+    }
+
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        const CTransaction& txPrev = mapInputs[tx.vin[i].prevout.hash].second;
+        if (!VerifySignature(txPrev, tx, i, true, 0))
+        {
+            // Same scoring as ConnectInputs: bad P2SH alone is not punished
+            job.fRejected = true;
+            if (!VerifySignature(txPrev, tx, i, false, 0))
+                tx.DoS(100, error("PreValidateTransaction() : %s VerifySignature failed", tx.GetHash().ToString().substr(0,10).c_str()));
+            else
+                error("PreValidateTransaction() : %s P2SH VerifySignature failed", tx.GetHash().ToString().substr(0,10).c_str());
+            return;
+        }
+    }
+    job.fVerified = true;
+}
+
+void static ThreadTxVerify2(void* parg)
+{
+    printf("ThreadTxVerify started\n");
+    vnThreadsRunning[THREAD_TXVERIFY]++;
+    while (!fShutdown)
+    {
+        CTxVerifyJob job;
+        {
+            boost::unique_lock<CWaitableCriticalSection> lock(cs_txverify);
+            if (vTxVerifyQueue.empty())
+            {
+                cvTxVerify.timed_wait(lock, boost::posix_time::seconds(1));
+                continue;
+            }
+            job = vTxVerifyQueue.front();
+            vTxVerifyQueue.pop_front();
+        }
+
+        PreValidateTransaction(job);
+
+        {
+            boost::unique_lock<CWaitableCriticalSection> lock(cs_txverify);
+            vTxVerified.push_back(job);
+        }
+        WakeMessageHandler();
+    }
+    vnThreadsRunning[THREAD_TXVERIFY]--;
+}
+
+void ThreadTxVerify(void* parg)
+{
+    // Make this thread recognisable as a transaction verification thread
+    RenameThread("bitcoin-txverify");
+
+    try
+    {
+        ThreadTxVerify2(parg);
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_TXVERIFY]--;
+        PrintException(&e, "ThreadTxVerify()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_TXVERIFY]--;
+        PrintException(NULL, "ThreadTxVerify()");
+    }
+    printf("ThreadTxVerify exited\n");
+}
+
+void StartTxVerifyThreads(int nThreads)
+{
+    nTxVerifyThreads = nThreads;
+    for (int i = 0; i < nThreads; i++)
+        if (!NewThread(ThreadTxVerify, NULL))
+            printf("Error: NewThread(ThreadTxVerify) failed\n");
+}
+
+// Finish the transactions the workers are done with. Caller holds cs_main.
+void ProcessVerifiedTransactions()
+{
+    deque<CTxVerifyJob> vDone;
+    {
+        boost::unique_lock<CWaitableCriticalSection> lock(cs_txverify);
+        vDone.swap(vTxVerified);
+    }
+
+    BOOST_FOREACH(CTxVerifyJob& job, vDone)
+    {
+        if (job.fRejected)
+        {
+            if (job.tx.nDoS) job.pfrom->Misbehaving(job.tx.nDoS);
+        }
+        else if (job.fVerified && job.hashInputsChain == hashBestChain)
+            AcceptPeerTransaction(job.pfrom, job.tx, &job.mapInputs);
+        else
+            AcceptPeerTransaction(job.pfrom, job.tx);
+    }
+
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CTxVerifyJob& job, vDone)
+        job.pfrom->Release();
+}
+
+bool ProcessMessages(CNode* pfrom)
+{
     //if (fDebug)
-    //    printf("ProcessMessages(%u bytes)\n", vRecv.size());
+    //    printf("ProcessMessages(%"PRIszu" messages)\n", pfrom->vRecvMsg.size());
 
     //
     // Message format
@@ -3054,33 +4438,43 @@ bool ProcessMessages(CNode* pfrom)
     //  (4) checksum
     //  (x) data
     //
+    // The socket thread has already split the stream into messages; their
+    // payloads are handed to ProcessMessage where they lie.
+    //
+    // One message is handled per call so that the message handler goes
+    // round all the peers in turn rather than draining a busy one.
+    //
+    // Blocks requested by getdata go out first. Further messages wait until
+    // they have all been queued, so replies keep their order.
+    //
+    bool fOk = true;
+    bool fProcessed = false;
+    if (!SendGetDataBlocks(pfrom))
+        return fOk;
 
-    loop
+    std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
+    while (!fProcessed && !pfrom->fDisconnect && it != pfrom->vRecvMsg.end())
     {
         // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->vSend.size() >= SendBufferSize())
+        if (pfrom->nSendSize >= SendBufferSize())
             break;
 
-        // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
-        if (vRecv.end() - pstart < nHeaderSize)
+        // The back of the queue may still be arriving
+        CNetMessage& msg = *it;
+        if (!msg.complete())
+            break;
+        it++;
+
+        // Message start is fixed; a stream that is off cannot be realigned
+        if (memcmp(msg.hdr.pchMessageStart, pchMessageStart, sizeof(pchMessageStart)) != 0)
         {
-            if ((int)vRecv.size() > nHeaderSize)
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
-            }
+            printf("\n\nPROCESSMESSAGE: INVALID MESSAGESTART\n\n");
+            fOk = false;
             break;
         }
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %"PRIpdd" BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
 
         // Read header
-        vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
-        CMessageHeader hdr;
-        vRecv >> hdr;
+        CMessageHeader& hdr = msg.hdr;
         if (!hdr.IsValid())
         {
             printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
@@ -3090,20 +4484,10 @@ bool ProcessMessages(CNode* pfrom)
 
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > MAX_SIZE)
-        {
-            printf("ProcessMessages(%s, %u bytes) : nMessageSize > MAX_SIZE\n", strCommand.c_str(), nMessageSize);
-            continue;
-        }
-        if (nMessageSize > vRecv.size())
-        {
-            // Rewind and wait for rest of message
-            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
-            break;
-        }
 
         // Checksum
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
+        CDataStream& vMsg = msg.vRecv;
+        uint256 hash = Hash(vMsg.begin(), vMsg.begin() + nMessageSize);
         unsigned int nChecksum = 0;
         memcpy(&nChecksum, &hash, sizeof(nChecksum));
         if (nChecksum != hdr.nChecksum)
@@ -3113,18 +4497,22 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
-
         // Process message
         bool fRet = false;
+        fProcessed = true;
+        int64 nUsec = 0;
         try
         {
+            int64 nStart = GetTimeMicros();
+            if (strCommand == "tx" && QueueTxVerify(pfrom, vMsg))
+                fRet = true;
+            else
             {
                 LOCK(cs_main);
+                nStart = GetTimeMicros(); // not counting the wait for the lock
                 fRet = ProcessMessage(pfrom, strCommand, vMsg);
             }
+            nUsec = GetTimeMicros() - nStart;
             if (fShutdown)
                 return true;
         }
@@ -3153,10 +4541,16 @@ bool ProcessMessages(CNode* pfrom)
 
         if (!fRet)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
+        pfrom->RecordRecvMsg(strCommand, nMessageSize + CMessageHeader::HEADER_SIZE, nUsec);
+
+        SendGetDataBlocks(pfrom);
     }
 
-    vRecv.Compact();
-    return true;
+    // A disconnect may already have emptied the queue
+    if (!pfrom->fDisconnect)
+        pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+
+    return fOk;
 }
 
 
@@ -3168,14 +4562,41 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (pto->nVersion == 0)
             return true;
 
-        // Keep-alive ping. We send a nonce of zero because we don't use it anywhere
-        // right now.
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty()) {
-            uint64 nonce = 0;
-            if (pto->nVersion > BIP0031_VERSION)
+        // Ping every PING_INTERVAL to measure the round trip, which also
+        // keeps the connection alive. Peers too old to answer with a pong
+        // just get the keep-alive ping.
+        if (pto->nVersion > BIP0031_VERSION) {
+            if (GetTimeMicros() - pto->nPingUsecStart > PING_INTERVAL * 1000000) {
+                uint64 nonce = 0;
+                while (nonce == 0)
+                    RAND_bytes((unsigned char*)&nonce, sizeof(nonce));
+                pto->nPingNonceSent = nonce;
+                pto->nPingUsecStart = GetTimeMicros();
                 pto->PushMessage("ping", nonce);
-            else
-                pto->PushMessage("ping");
+            }
+        }
+        else if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSendMsg.empty())
+            pto->PushMessage("ping");
+
+        // Start syncing headers from this node if nobody else is
+        ExpireBlockDownloads();
+        CBlockDownloadPeer& peer = mapBlockDownloadPeer[pto->id];
+        if (nHeaderSyncPeer == -1 && IsBlockSource(pto) && pto->nStartingHeight > pindexBestHeader->nHeight &&
+            !peer.fHeadersDone)
+        {
+            printf("syncing headers from peer %d, height %d\n", pto->id, pto->nStartingHeight);
+            nHeaderSyncPeer = pto->id;
+            nHeaderSyncTime = GetTime();
+            peer.fHeadersAsked = true;
+            pto->PushGetHeaders(pindexBestHeader);
+        }
+        // Otherwise, once the headers are in, find out how far along them
+        // this node is. Asking from one header back gets our best header
+        // itself back if the node has it.
+        else if (nHeaderSyncPeer == -1 && IsBlockSource(pto) && !peer.fHeadersAsked && pindexBestHeader->pprev)
+        {
+            peer.fHeadersAsked = true;
+            pto->PushGetHeaders(pindexBestHeader->pprev);
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -3189,9 +4610,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 LOCK(cs_vNodes);
                 BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    // Periodically clear setAddrKnown to allow refresh broadcasts
+                    // Periodically clear filterAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
-                        pnode->setAddrKnown.clear();
+                        pnode->filterAddrKnown.reset();
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -3214,9 +4635,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                vector<unsigned char> vchKey = addr.GetKey();
+                if (!pto->filterAddrKnown.contains(vchKey))
                 {
+                    pto->filterAddrKnown.insert(vchKey);
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000)
@@ -3243,7 +4665,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -3273,9 +4695,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                if (!pto->filterInventoryKnown.contains(inv.hash))
                 {
+                    pto->filterInventoryKnown.insert(inv.hash);
                     vInv.push_back(inv);
                     if (vInv.size() >= 1000)
                     {
@@ -3313,6 +4735,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
+        if (IsBlockSource(pto))
+            FindBlocksToDownload(pto, vGetData);
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
@@ -3358,77 +4782,24 @@ static const unsigned int pSHA256InitState[8] =
 
 void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 {
-    SHA256_CTX ctx;
+    unsigned int state[8];
     unsigned char data[64];
 
-    SHA256_Init(&ctx);
-
     for (int i = 0; i < 16; i++)
         ((uint32_t*)data)[i] = ByteReverse(((uint32_t*)pinput)[i]);
 
-    for (int i = 0; i < 8; i++)
-        ctx.h[i] = ((uint32_t*)pinit)[i];
-
-    SHA256_Update(&ctx, data, sizeof(data));
-    for (int i = 0; i < 8; i++)
-        ((uint32_t*)pstate)[i] = ctx.h[i];
-}
-
-//
-// ScanHash scans nonces looking for a hash with at least some zero bits.
-// It operates on big endian data.  Caller does the byte reversing.
-// All input buffers are 16-byte aligned.  nNonce is usually preserved
-// between calls, but periodically or if nNonce is 0xffff0000 or above,
-// the block is rebuilt and nNonce starts over at zero.
-//
-unsigned int static ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone)
-{
-    unsigned int& nNonce = *(unsigned int*)(pdata + 12);
-    for (;;)
-    {
-        // Crypto++ SHA256
-        // Hash pdata using pmidstate as the starting state into
-        // pre-formatted buffer phash1, then hash phash1 into phash
-        nNonce++;
-        SHA256Transform(phash1, pdata, pmidstate);
-        SHA256Transform(phash, phash1, pSHA256InitState);
-
-        // Return the nonce if the hash has at least some zero bits,
-        // caller will check if it has enough to reach the target
-        if (((unsigned short*)phash)[14] == 0)
-            return nNonce;
-
-        // If nothing found after trying for a while, return -1
-        if ((nNonce & 0xffff) == 0)
-        {
-            nHashesDone = 0xffff+1;
-            return (unsigned int) -1;
-        }
-    }
+    memcpy(state, pinit, sizeof(state));
+    SHA256Blocks(state, data, 1);
+    memcpy(pstate, state, sizeof(state));
 }
 
-// Some explaining would be appreciated
-class COrphan
+// Where each memory pool transaction stands while CreateNewBlock runs
+enum
 {
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
-
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
-    }
-
-    void print() const
-    {
-        printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().substr(0,10).c_str(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().substr(0,10).c_str());
-    }
+    TEMPLATE_SKIP,      // not final, immature or failed its checks
+    TEMPLATE_WAITING,   // candidate once nPending pool parents are in the block
+    TEMPLATE_DEFERRED,  // passed over by the fee walk while still waiting
+    TEMPLATE_DONE,      // considered: added to the block or didn't fit
 };
 
 
@@ -3436,7 +4807,7 @@ uint64 nLastBlockTx = 0;
 uint64 nLastBlockSize = 0;
 
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, CTxMemPoolEntry*> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -3507,172 +4878,157 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
         CBlockIndex* pindexPrev = pindexBest;
         CTxDB txdb("r");
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-
-        // This vector will be sorted into a priority queue:
+        // Transactions added without their inputs (after a reorganization)
+        // are checked here once; everything else is already known
+        int nHeight = pindexPrev->nHeight;
+        bool fSortedByFee = (nBlockPrioritySize <= 0);
         vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        if (!fSortedByFee)
+            vecPriority.reserve(mempool.mapTx.size());
+        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || !tx.IsFinal())
+            CTxMemPoolEntry& entry = (*mi).second;
+            entry.nState = TEMPLATE_SKIP;
+            entry.nPending = 0;
+            if (!entry.fChecked && !mempool.checkEntry(txdb, entry))
+                continue;
+            if (!entry.tx.IsFinal())
+                continue;
+            if (entry.nCoinbaseHeight >= 0 && nHeight - entry.nCoinbaseHeight < COINBASE_MATURITY)
                 continue;
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64 nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                int64 nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
+            entry.nState = TEMPLATE_WAITING;
+            BOOST_FOREACH(int nInHeight, entry.vInHeight)
+                if (nInHeight < 0)
+                    entry.nPending++;
+            if (!fSortedByFee && entry.nPending == 0)
+                vecPriority.push_back(TxPriority(entry.GetPriority(nHeight), entry.dFeePerKb, &entry));
         }
 
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
+        // Collect transactions into block: highest priority first, then
+        // walk the pool's fee index, picking up children as their parents
+        // make it in
         uint64 nBlockSize = 1000;
         uint64 nBlockTx = 0;
         int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
 
-        TxPriorityCompare comparer(fSortedByFee);
+        TxPriorityCompare comparer(false);
         std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        TxPriorityCompare comparerFee(true);
+        vector<TxPriority> vecReleased;
+        set<CTxMemPoolEntry*, CTxMemPoolEntryFeeCompare>::iterator itFee = mempool.setByFee.begin();
 
-        while (!vecPriority.empty())
+        loop
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
+            CTxMemPoolEntry* pentry;
+            bool fFeePass = fSortedByFee;
+            if (!fSortedByFee)
+            {
+                if (vecPriority.empty())
+                {
+                    fSortedByFee = true;
+                    continue;
+                }
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+                // Take highest priority transaction off the priority queue:
+                double dPriority = vecPriority.front().get<0>();
+                pentry = vecPriority.front().get<2>();
+                std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                vecPriority.pop_back();
+
+                // Prioritize by fee once past the priority size or we run out of high-priority
+                // transactions:
+                if ((nBlockSize + pentry->nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250))
+                    fSortedByFee = true;
+            }
+            else
+            {
+                while (itFee != mempool.setByFee.end())
+                {
+                    CTxMemPoolEntry* p = *itFee;
+                    if (p->nState == TEMPLATE_WAITING && p->nPending > 0)
+                        p->nState = TEMPLATE_DEFERRED;
+                    if (p->nState == TEMPLATE_WAITING)
+                        break;
+                    ++itFee;
+                }
+                bool fIndexLeft = (itFee != mempool.setByFee.end());
+                if (!fIndexLeft && vecReleased.empty())
+                    break;
+                if (!vecReleased.empty() && (!fIndexLeft || vecReleased.front().get<1>() > (*itFee)->dFeePerKb))
+                {
+                    pentry = vecReleased.front().get<2>();
+                    std::pop_heap(vecReleased.begin(), vecReleased.end(), comparerFee);
+                    vecReleased.pop_back();
+                }
+                else
+                    pentry = *itFee++;
+            }
+            if (pentry->nState != TEMPLATE_WAITING)
+                continue;
+            pentry->nState = TEMPLATE_DONE;
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = pentry->nTxSize;
             if (nBlockSize + nTxSize >= nBlockMaxSize)
                 continue;
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            // Limits on sigOps:
+            if (nBlockSigOps + pentry->nSigOps >= MAX_BLOCK_SIGOPS)
                 continue;
 
             // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+            if (fFeePass && (pentry->dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
                 continue;
 
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
+            // The pool never holds two spends of one output, but anything
+            // put there with addUnchecked is taken at its word
+            const CTransaction& tx = pentry->tx;
+            bool fConflict = false;
+            for (unsigned int i = 0; i < tx.vin.size() && !fConflict; i++)
             {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                map<COutPoint, CInPoint>::const_iterator it = mempool.mapNextTx.find(tx.vin[i].prevout);
+                fConflict = (it == mempool.mapNextTx.end() || it->second.ptx != &pentry->tx);
             }
-
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-                continue;
-
-            int64 nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-
-            nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            if (fConflict)
                 continue;
 
-            if (!tx.ConnectInputs(mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true))
-                continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
-
             // Added
             pblock->vtx.push_back(tx);
             nBlockSize += nTxSize;
             ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+            nBlockSigOps += pentry->nSigOps;
+            nFees += pentry->nFee;
 
             if (fDebug && GetBoolArg("-printpriority"))
             {
                 printf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
+                       pentry->GetPriority(nHeight), pentry->dFeePerKb, pentry->hash.ToString().c_str());
             }
 
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
+            // Release transactions that depend on this one
+            for (unsigned int i = 0; i < tx.vout.size(); i++)
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+                map<COutPoint, CInPoint>::iterator it = mempool.mapNextTx.find(COutPoint(pentry->hash, i));
+                if (it == mempool.mapNextTx.end())
+                    continue;
+                map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.find(it->second.ptx->GetHash());
+                if (mi == mempool.mapTx.end())
+                    continue;
+                CTxMemPoolEntry& child = (*mi).second;
+                if ((child.nState != TEMPLATE_WAITING && child.nState != TEMPLATE_DEFERRED) ||
+                    child.nPending == 0 || --child.nPending > 0)
+                    continue;
+                if (!fSortedByFee)
                 {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
+                    vecPriority.push_back(TxPriority(child.GetPriority(nHeight), child.dFeePerKb, &child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                }
+                else if (child.nState == TEMPLATE_DEFERRED)
+                {
+                    child.nState = TEMPLATE_WAITING;
+                    vecReleased.push_back(TxPriority(child.GetPriority(nHeight), child.dFeePerKb, &child));
+                    std::push_heap(vecReleased.begin(), vecReleased.end(), comparerFee);
                 }
             }
         }
@@ -3690,11 +5046,16 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
     pblock->nNonce         = 0;
 
         pblock->vtx[0].vin[0].scriptSig = CScript() << OP_0 << OP_0;
-        CBlockIndex indexDummy(1, 1, *pblock);
-        indexDummy.pprev = pindexPrev;
-        indexDummy.nHeight = pindexPrev->nHeight + 1;
-        if (!pblock->ConnectBlock(txdb, &indexDummy, true))
-            throw std::runtime_error("CreateNewBlock() : ConnectBlock failed");
+        if (GetBoolArg("-checkblocktemplate", true))
+        {
+            // Cheap next to the work spent hashing the template, and it keeps
+            // a bad entry in the pool's cached template data from costing a block
+            CBlockIndex indexDummy(1, 1, *pblock);
+            indexDummy.pprev = pindexPrev;
+            indexDummy.nHeight = pindexPrev->nHeight + 1;
+            if (!pblock->ConnectBlock(txdb, &indexDummy, true))
+                throw std::runtime_error("CreateNewBlock() : ConnectBlock failed");
+        }
     }
 
     return pblock.release();
@@ -3808,6 +5169,64 @@ static bool fGenerateBitcoins = false;
 static bool fLimitProcessors = false;
 static int nLimitProcessors = -1;
 
+// Nonces per SHA256ScanNonces call, between checks for a new best block
+static const unsigned int MINER_SCAN_NONCES = 0x40000;
+
+// Block template shared by the miner threads.  Each thread takes the next
+// extranonce from it, so the threads search disjoint parts of one template
+// instead of each building its own block.
+struct CMinerTemplate
+{
+    boost::shared_ptr<CBlock> pblock;
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    int64 nTimeCreated;
+    vector<uint256> vCoinbaseBranch;
+    unsigned int nExtraNonce;
+    CReserveKey* preservekey;
+};
+static CCriticalSection cs_minerTemplate;
+static CMinerTemplate minerTemplate;
+
+// Rebuild the shared template if there is none or it is stale; call with cs_minerTemplate held
+static bool UpdateMinerTemplate(CWallet* pwallet)
+{
+    CMinerTemplate& t = minerTemplate;
+    if (t.pblock && t.pindexPrev == pindexBest &&
+        (t.nTransactionsUpdatedLast == nTransactionsUpdated || GetTime() - t.nTimeCreated <= 60))
+        return true;
+
+    if (!t.preservekey)
+        t.preservekey = new CReserveKey(pwallet);
+    unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
+    CBlockIndex* pindexPrev = pindexBest;
+    boost::shared_ptr<CBlock> pblock(CreateNewBlock(*t.preservekey));
+    if (!pblock)
+        return false;
+
+    if (t.pindexPrev != pindexPrev)
+        t.nExtraNonce = 0;
+    t.pblock = pblock;
+    t.pindexPrev = pindexPrev;
+    t.nTransactionsUpdatedLast = nTransactionsUpdatedLast;
+    t.nTimeCreated = GetTime();
+    t.vCoinbaseBranch = pblock->GetMerkleBranch(0);
+
+    printf("Running BitcoinMiner with %"PRIszu" transactions in block (%u bytes)\n", pblock->vtx.size(),
+           ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+    return true;
+}
+
+// Drop the template and return its key once the last miner thread is gone
+static void ClearMinerTemplate()
+{
+    LOCK(cs_minerTemplate);
+    minerTemplate.pblock.reset();
+    minerTemplate.pindexPrev = NULL;
+    delete minerTemplate.preservekey;
+    minerTemplate.preservekey = NULL;
+}
+
 void static BitcoinMiner(CWallet *pwallet)
 {
     printf("BitcoinMiner started\n");
@@ -3816,10 +5235,6 @@ void static BitcoinMiner(CWallet *pwallet)
     // Make this thread recognisable as the mining thread
     RenameThread("bitcoin-miner");
 
-    // Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
-    unsigned int nExtraNonce = 0;
-
     while (fGenerateBitcoins)
     {
         if (fShutdown)
@@ -3835,64 +5250,69 @@ void static BitcoinMiner(CWallet *pwallet)
 
 
         //
-        // Create new block
+        // Take the next extranonce of the shared template
         //
-        unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrev = pindexBest;
-
-        auto_ptr<CBlock> pblock(CreateNewBlock(reservekey));
-        if (!pblock.get())
-            return;
-        IncrementExtraNonce(pblock.get(), pindexPrev, nExtraNonce);
-
-        printf("Running BitcoinMiner with %"PRIszu" transactions in block (%u bytes)\n", pblock->vtx.size(),
-               ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
-
-
-        //
-        // Pre-build hash buffers
-        //
-        char pmidstatebuf[32+16]; char* pmidstate = alignup<16>(pmidstatebuf);
-        char pdatabuf[128+16];    char* pdata     = alignup<16>(pdatabuf);
-        char phash1buf[64+16];    char* phash1    = alignup<16>(phash1buf);
-
-        FormatHashBuffers(pblock.get(), pmidstate, pdata, phash1);
+        boost::shared_ptr<CBlock> ptemplate;
+        CBlockIndex* pindexPrev;
+        vector<uint256> vCoinbaseBranch;
+        unsigned int nExtraNonce;
+        {
+            LOCK(cs_minerTemplate);
+            if (!UpdateMinerTemplate(pwallet))
+                return;
+            ptemplate = minerTemplate.pblock;
+            pindexPrev = minerTemplate.pindexPrev;
+            vCoinbaseBranch = minerTemplate.vCoinbaseBranch;
+            nExtraNonce = ++minerTemplate.nExtraNonce;
+        }
 
-        unsigned int& nBlockTime = *(unsigned int*)(pdata + 64 + 4);
-        unsigned int& nBlockBits = *(unsigned int*)(pdata + 64 + 8);
-        unsigned int& nBlockNonce = *(unsigned int*)(pdata + 64 + 12);
+        // This thread's coinbase and header; the transactions stay in the template
+        CTransaction txCoinbase = ptemplate->vtx[0];
+        txCoinbase.vin[0].scriptSig = (CScript() << pindexPrev->nHeight+1 << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
+        assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+        CBlock block;
+        block.nVersion       = ptemplate->nVersion;
+        block.hashPrevBlock  = ptemplate->hashPrevBlock;
+        block.hashMerkleRoot = CBlock::CheckMerkleBranch(txCoinbase.GetHash(), vCoinbaseBranch, 0);
+        block.nTime          = ptemplate->nTime;
+        block.nBits          = ptemplate->nBits;
+        block.nNonce         = 0;
 
 
         //
         // Search
         //
-        int64 nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
-        uint256 hashbuf[2];
-        uint256& hash = *alignup<16>(hashbuf);
+        uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
+        unsigned int nNonce = 0;
         loop
         {
+            unsigned char pheader[80];
+            memcpy(pheader, BEGIN(block.nVersion), sizeof(pheader));
+            unsigned int nTargetHigh = (unsigned int)(hashTarget.Get64(3) >> 32);
             unsigned int nHashesDone = 0;
-            unsigned int nNonceFound;
+            bool fFound = SHA256ScanNonces(pheader, nTargetHigh, nNonce, std::min(MINER_SCAN_NONCES, 0xffff0000 - nNonce), nHashesDone);
 
-            // Crypto++ SHA256
-            nNonceFound = ScanHash_CryptoPP(pmidstate, pdata + 64, phash1,
-                                            (char*)&hash, nHashesDone);
-
-            // Check if something found
-            if (nNonceFound != (unsigned int) -1)
+            // The kernel only checked the top word of the hash
+            if (fFound)
             {
-                for (unsigned int i = 0; i < sizeof(hash)/4; i++)
-                    ((unsigned int*)&hash)[i] = ByteReverse(((unsigned int*)&hash)[i]);
-
-                if (hash <= hashTarget)
+                block.nNonce = nNonce++;
+                if (block.GetHash() <= hashTarget)
                 {
                     // Found a solution
-                    pblock->nNonce = ByteReverse(nNonceFound);
-                    assert(hash == pblock->GetHash());
+                    CBlock blockFound = *ptemplate;
+                    blockFound.vtx[0] = txCoinbase;
+                    blockFound.hashMerkleRoot = block.hashMerkleRoot;
+                    blockFound.nTime = block.nTime;
+                    blockFound.nBits = block.nBits;
+                    blockFound.nNonce = block.nNonce;
+                    assert(blockFound.BuildMerkleTree() == blockFound.hashMerkleRoot);
 
                     SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pblock.get(), *pwalletMain, reservekey);
+                    {
+                        LOCK(cs_minerTemplate);
+                        if (minerTemplate.preservekey)
+                            CheckWork(&blockFound, *pwalletMain, *minerTemplate.preservekey);
+                    }
                     SetThreadPriority(THREAD_PRIORITY_LOWEST);
                     break;
                 }
@@ -3927,7 +5347,7 @@ void static BitcoinMiner(CWallet *pwallet)
                 }
             }
 
-            // Check for stop or if block needs to be rebuilt
+            // Check for stop or if the template needs to be rebuilt
             if (fShutdown)
                 return;
             if (!fGenerateBitcoins)
@@ -3936,21 +5356,24 @@ void static BitcoinMiner(CWallet *pwallet)
                 return;
             if (vNodes.empty())
                 break;
-            if (nBlockNonce >= 0xffff0000)
-                break;
-            if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
+            if (nNonce >= 0xffff0000)
                 break;
             if (pindexPrev != pindexBest)
                 break;
+            {
+                LOCK(cs_minerTemplate);
+                if (minerTemplate.pblock != ptemplate)
+                    break;
+                if (nTransactionsUpdated != minerTemplate.nTransactionsUpdatedLast && GetTime() - minerTemplate.nTimeCreated > 60)
+                    break;
+            }
 
             // Update nTime every few seconds
-            pblock->UpdateTime(pindexPrev);
-            nBlockTime = ByteReverse(pblock->nTime);
+            block.UpdateTime(pindexPrev);
             if (fTestNet)
             {
-                // Changing pblock->nTime can change work required on testnet:
-                nBlockBits = ByteReverse(pblock->nBits);
-                hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+                // Changing block.nTime can change work required on testnet:
+                hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
             }
         }
     }
@@ -3974,7 +5397,10 @@ void static ThreadBitcoinMiner(void* parg)
     }
     nHPSTimerStart = 0;
     if (vnThreadsRunning[THREAD_MINER] == 0)
+    {
         dHashesPerSec = 0;
+        ClearMinerTemplate();
+    }
     printf("ThreadBitcoinMiner exiting, %d threads remaining\n", vnThreadsRunning[THREAD_MINER]);
 }
 
@@ -22,12 +22,29 @@ class CAddress;
 class CInv;
 class CRequestTracker;
 class CNode;
+class CMempoolDB;
 
 static const unsigned int MAX_BLOCK_SIZE = 1000000;
 static const unsigned int MAX_BLOCK_SIZE_GEN = MAX_BLOCK_SIZE/2;
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+static const unsigned int MAX_ORPHAN_BYTES = 5000000;
+static const int64 ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+static const unsigned int MAX_ORPHAN_WORK = 100; // orphans retried per message handler pass
+static const unsigned int MAX_HEADERS_RESULTS = 2000; // headers per "headers" message
+static const int BLOCK_DOWNLOAD_WINDOW = 128; // blocks past the first missing one that may be requested
+static const unsigned int MAX_ORPHAN_BLOCKS_SIZE = 32000000; // bytes of downloaded blocks waiting for their parents
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 2 * 60; // seconds before a requested block is asked of another peer
+static const int64 BLOCK_STALL_TIMEOUT = 10; // seconds the first missing block may hold up the window
+static const int64 HEADERS_DOWNLOAD_TIMEOUT = 2 * 60;
+static const int64 PING_INTERVAL = 2 * 60; // seconds between pings to measure the round trip
+static const unsigned int MAX_TX_VERIFY_QUEUE = 5000;
+static const unsigned int BLOCK_MSG_CACHE_SIZE = 4; // framed blocks kept for serving to several peers
+static const int MAX_BLOCKTXN_DEPTH = 10; // getshorttxn is answered for blocks this close to the tip
 static const unsigned int MAX_INV_SZ = 50000;
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300; // megabytes
 static const int64 MIN_TX_FEE = 50000;
 static const int64 MIN_RELAY_TX_FEE = 10000;
 static const int64 MAX_MONEY = 21000000 * COIN;
@@ -51,13 +68,18 @@ extern CScript COINBASE_FLAGS;
 
 extern CCriticalSection cs_main;
 extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern std::map<std::pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
 extern uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
 extern CBigNum bnBestChainWork;
 extern CBigNum bnBestInvalidWork;
 extern uint256 hashBestChain;
+extern CWaitableCriticalSection csBestBlock;
+extern boost::condition_variable cvBlockChange;
 extern CBlockIndex* pindexBest;
+extern CBlockIndex* pindexBestHeader;
+extern std::vector<CBlockIndex*> vBlockIndexByHeight;
 extern unsigned int nTransactionsUpdated;
 extern uint64 nLastBlockTx;
 extern uint64 nLastBlockSize;
@@ -90,8 +112,12 @@ FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
+void SetMainChainTip(CBlockIndex* pindexTip);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
+bool ProcessOrphanWork(unsigned int nMaxWork);
+void ProcessVerifiedTransactions();
+void StartTxVerifyThreads(int nThreads);
 bool LoadExternalBlockFile(FILE* fileIn);
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
 CBlock* CreateNewBlock(CReserveKey& reservekey);
@@ -104,6 +130,10 @@ int GetNumBlocksOfPeers();
 bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
+bool DumpMempool();
+bool DumpMempool(CMempoolDB& mdb);
+unsigned int LoadMempool(CMempoolDB& mdb);
+void ThreadMempoolPersist(void* parg);
 
 
 
@@ -633,11 +663,13 @@ public:
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
         @param[in] fStrictPayToScriptHash	true if fully validating p2sh transactions
+        @param[in] fScriptChecks	false if the input scripts were already verified against these inputs
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true,
+                       bool fScriptChecks=true);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -845,24 +877,11 @@ public:
     void UpdateTime(const CBlockIndex* pindexPrev);
 
 
-    uint256 BuildMerkleTree() const
-    {
-        vMerkleTree.clear();
-        BOOST_FOREACH(const CTransaction& tx, vtx)
-            vMerkleTree.push_back(tx.GetHash());
-        int j = 0;
-        for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
-        {
-            for (int i = 0; i < nSize; i += 2)
-            {
-                int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-            }
-            j += nSize;
-        }
-        return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
-    }
+    // Transaction hashes, computed together as one batch
+    std::vector<uint256> GetTxHashes() const;
+
+    uint256 BuildMerkleTree() const;
+    uint256 BuildMerkleTree(const std::vector<uint256>& vTxHash) const;
 
     std::vector<uint256> GetMerkleBranch(int nIndex) const
     {
@@ -978,6 +997,7 @@ public:
     bool AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos);
     bool CheckBlock(bool fCheckPOW=true, bool fCheckMerkleRoot=true) const;
     bool AcceptBlock();
+    bool AcceptHeader(CBlockIndex*& pindexRet);
 
 private:
     bool SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew);
@@ -1001,11 +1021,17 @@ public:
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
+    CBlockIndex* pskip; // some ancestor further back, see GetAncestor
     unsigned int nFile;
     unsigned int nBlockPos;
     int nHeight;
     CBigNum bnChainWork;
 
+    // size and checksum of the block as a "block" message, filled in the
+    // first time it is served (nMsgSize 0 until then)
+    unsigned int nMsgSize;
+    unsigned int nMsgChecksum;
+
     // block header
     int nVersion;
     uint256 hashMerkleRoot;
@@ -1019,10 +1045,13 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
         bnChainWork = 0;
+        nMsgSize = 0;
+        nMsgChecksum = 0;
 
         nVersion       = 0;
         hashMerkleRoot = 0;
@@ -1036,10 +1065,13 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
         bnChainWork = 0;
+        nMsgSize = 0;
+        nMsgChecksum = 0;
 
         nVersion       = block.nVersion;
         hashMerkleRoot = block.hashMerkleRoot;
@@ -1082,7 +1114,7 @@ public:
 
     bool IsInMainChain() const
     {
-        return (pnext || this == pindexBest);
+        return (nHeight < (int)vBlockIndexByHeight.size() && vBlockIndexByHeight[nHeight] == this);
     }
 
     bool CheckIndex() const
@@ -1118,6 +1150,13 @@ public:
         return pindex->GetMedianTimePast();
     }
 
+    /** Set pskip; needs pprev and nHeight, and pskip of the ancestors */
+    void BuildSkip();
+
+    /** Ancestor at nAncestorHeight, in O(log n) steps over the skip pointers */
+    CBlockIndex* GetAncestor(int nAncestorHeight);
+    const CBlockIndex* GetAncestor(int nAncestorHeight) const;
+
     /**
      * Returns true if there are nRequired or more blocks of minVersion or above
      * in the last nToCheck blocks, starting at pstart and going backwards.
@@ -1274,8 +1313,7 @@ public:
             vHave.push_back(pindex->GetBlockHash());
 
             // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            pindex = pindex->GetAncestor(pindex->nHeight - nStep);
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -1351,20 +1389,128 @@ public:
 
 
 
+/** A transaction in the memory pool, with what was learned about it while
+ * its inputs were loaded in CTxMemPool::accept: fee, size, input values and
+ * the height each input confirmed at.  Kept current as parents confirm, so
+ * nothing that looks at the pool has to go back to disk.
+ */
+class CTxMemPoolEntry
+{
+public:
+    CTransaction tx;
+    uint256 hash;
+    bool fChecked;              // inputs loaded and connected against the chain
+    int64 nTime;                // when it entered the pool
+    int nHeight;                // best height when its inputs were loaded
+    double dStartPriority;      // priority at nHeight
+    unsigned int nTxSize;
+    unsigned int nSigOps;       // legacy plus pay-to-script-hash
+    int64 nValueIn;
+    int64 nFee;
+    double dFeePerKb;
+    std::vector<int64> vInValue;
+    std::vector<int> vInHeight; // height each input was confirmed at, -1 while it is in the pool
+    int nCoinbaseHeight;        // highest block whose coinbase this spends, -1 if none
+
+    size_t nUsageSize;          // heap memory the pool spends on this entry
+
+    // Scratch space for CreateNewBlock, only touched with mempool.cs held
+    unsigned int nPending;
+    int nState;
+
+    CTxMemPoolEntry()
+    {
+        SetNull();
+    }
+
+    CTxMemPoolEntry(const CTransaction& txIn, const uint256& hashIn)
+    {
+        SetNull();
+        tx = txIn;
+        hash = hashIn;
+        nTime = GetTime();
+        nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        vInValue.resize(tx.vin.size());
+        vInHeight.resize(tx.vin.size());
+        nUsageSize = DynamicMemoryUsage();
+    }
+
+    void SetNull()
+    {
+        hash = 0;
+        fChecked = false;
+        nTime = 0;
+        nHeight = -1;
+        dStartPriority = 0;
+        nTxSize = nSigOps = 0;
+        nValueIn = nFee = 0;
+        dFeePerKb = 0;
+        vInValue.clear();
+        vInHeight.clear();
+        nCoinbaseHeight = -1;
+        nUsageSize = 0;
+        nPending = 0;
+        nState = 0;
+    }
+
+    void SetInputs(const MapPrevTx& mapInputs);
+    size_t DynamicMemoryUsage() const;
+
+    // Priority is sum(valuein * age) / txsize, counting only inputs
+    // already in the chain
+    double GetPriority(int nBestHeight) const
+    {
+        double dPriority = 0;
+        for (unsigned int i = 0; i < vInHeight.size(); i++)
+            if (vInHeight[i] >= 0 && vInHeight[i] <= nBestHeight)
+                dPriority += (double)vInValue[i] * (nBestHeight - vInHeight[i] + 1);
+        return dPriority / nTxSize;
+    }
+};
+
+struct CTxMemPoolEntryFeeCompare
+{
+    bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
+    {
+        if (a->dFeePerKb == b->dFeePerKb)
+            return a->hash < b->hash;
+        return a->dFeePerKb > b->dFeePerKb;
+    }
+};
+
 class CTxMemPool
 {
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    std::set<CTxMemPoolEntry*, CTxMemPoolEntryFeeCompare> setByFee; // every entry, highest fee first
+    size_t nTotalUsage;
+
+    CTxMemPool()
+    {
+        nTotalUsage = 0;
+    }
 
     bool accept(CTxDB& txdb, CTransaction &tx,
-                bool fCheckInputs, bool* pfMissingInputs);
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
-    bool remove(CTransaction &tx);
+                bool fCheckInputs, bool* pfMissingInputs, bool fLimitFree=true,
+                const MapPrevTx* pmapInputsVerified=NULL);
+    bool addUnchecked(const uint256& hash, CTransaction &tx, const MapPrevTx* pmapInputs = NULL);
+    bool remove(const CTransaction &tx);
+    void removeRecursive(const CTransaction &tx);
+    void removeForBlock(const std::vector<CTransaction>& vtx, int nHeight);
+    void uncheckAll();
+    bool checkEntry(CTxDB& txdb, CTxMemPoolEntry& entry);
+    void TrimToSize(size_t nSizeLimit);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
 
+    size_t DynamicMemoryUsage()
+    {
+        LOCK(cs);
+        return nTotalUsage;
+    }
+
     unsigned long size()
     {
         LOCK(cs);
@@ -1378,10 +1524,53 @@ public:
 
     CTransaction& lookup(uint256 hash)
     {
-        return mapTx[hash];
+        return mapTx[hash].tx;
+    }
+
+    const CTxMemPoolEntry* lookupEntry(uint256 hash) const
+    {
+        std::map<uint256, CTxMemPoolEntry>::const_iterator mi = mapTx.find(hash);
+        return (mi == mapTx.end() ? NULL : &(*mi).second);
     }
 };
 
 extern CTxMemPool mempool;
 
+
+
+
+/** A transaction whose inputs we have not seen yet, kept parsed so it is
+ * decoded only once while it waits for its parents.
+ */
+struct COrphanTx
+{
+    CTransaction tx;
+    int nPeer;
+    int64 nTimeExpire;
+    unsigned int nTxSize;
+};
+
+/** Bytes and hashes of the orphans one peer gave us, so the peer filling
+ * the orphan pool is the one whose orphans get evicted.
+ */
+struct COrphanPeer
+{
+    unsigned int nBytes;
+    std::set<uint256> setHash;
+
+    COrphanPeer() : nBytes(0) { }
+};
+
+/** Where block download stands with one peer. */
+struct CBlockDownloadPeer
+{
+    int nBlocksInFlight;
+    int nBestKnownHeight; // height of the best block on our header chain it has shown us
+    bool fHeadersAsked; // has been sent getheaders
+    bool fHeadersDone; // has had its say about headers
+    int nIdleGeneration; // found nothing more to request at this generation
+
+    CBlockDownloadPeer() : nBlocksInFlight(0), nBestKnownHeight(-1), fHeadersAsked(false), fHeadersDone(false), nIdleGeneration(-1) { }
+};
+
 #endif
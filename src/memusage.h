@@ -0,0 +1,42 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_MEMUSAGE_H
+#define BITCOIN_MEMUSAGE_H
+
+#include <stddef.h>
+#include <vector>
+
+/** Estimates of the heap memory the standard containers really use,
+ * including allocator rounding and per-node bookkeeping, so memory limits
+ * track what the process grows by rather than the serialized sizes.
+ */
+namespace memusage
+{
+
+/** Bytes malloc hands out for a request of nAlloc bytes (glibc rounding) */
+static inline size_t MallocUsage(size_t nAlloc)
+{
+    if (nAlloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((nAlloc + 31) >> 4) << 4;
+    return ((nAlloc + 15) >> 3) << 3;
+}
+
+/** Red-black tree node: colour, parent, left and right ahead of the value */
+template<typename T>
+static inline size_t TreeNodeUsage()
+{
+    return MallocUsage(sizeof(T) + 4 * sizeof(void*));
+}
+
+template<typename T>
+static inline size_t DynamicUsage(const std::vector<T>& v)
+{
+    return MallocUsage(v.capacity() * sizeof(T));
+}
+
+}
+
+#endif
@@ -86,15 +86,14 @@ unsigned short GetListenPort()
     return (unsigned short)(GetArg("-port", GetDefaultPort()));
 }
 
-void CNode::PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd)
+void CNode::PushGetHeaders(CBlockIndex* pindexBegin)
 {
     // Filter out duplicate requests
-    if (pindexBegin == pindexLastGetBlocksBegin && hashEnd == hashLastGetBlocksEnd)
+    if (pindexBegin->GetBlockHash() == hashLastGetHeadersBegin)
         return;
-    pindexLastGetBlocksBegin = pindexBegin;
-    hashLastGetBlocksEnd = hashEnd;
+    hashLastGetHeadersBegin = pindexBegin->GetBlockHash();
 
-    PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
+    PushMessage("getheaders", CBlockLocator(pindexBegin), uint256(0));
 }
 
 // find 'best' local address for a particular peer
@@ -488,9 +487,29 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, int64 nTimeout)
         pszDest ? pszDest : addrConnect.ToString().c_str(),
         pszDest ? 0 : (double)(GetAdjustedTime() - addrConnect.nTime)/3600.0);
 
-    // Connect
+    // Connect. Direct connections are only started here and finished by
+    // the socket thread, so that dead addresses do not hold up the others;
+    // names and proxies still need a blocking handshake.
     SOCKET hSocket;
-    if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, GetDefaultPort()) : ConnectSocket(addrConnect, hSocket))
+    bool fConnecting = false;
+    proxyType proxy;
+    bool fDirect = !pszDest;
+    CService addrNumeric;
+    if (pszDest && !HaveNameProxy() && LookupNumeric(pszDest, addrNumeric, GetDefaultPort()))
+    {
+        addrConnect = CAddress(addrNumeric);
+        fDirect = true;
+    }
+    if (fDirect && !GetProxy(addrConnect.GetNetwork(), proxy))
+    {
+        if (!StartConnectSocket(addrConnect, hSocket))
+        {
+            addrman.Attempt(addrConnect);
+            return NULL;
+        }
+        fConnecting = true;
+    }
+    else if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, GetDefaultPort()) : ConnectSocket(addrConnect, hSocket))
     {
         addrman.Attempt(addrConnect);
 
@@ -506,26 +525,64 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, int64 nTimeout)
         if (fcntl(hSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR)
             printf("ConnectSocket() : fcntl non-blocking setting failed, error %d\n", errno);
 #endif
-
-        // Add node
-        CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
-        if (nTimeout != 0)
-            pnode->AddRef(nTimeout);
-        else
-            pnode->AddRef();
-
-        {
-            LOCK(cs_vNodes);
-            vNodes.push_back(pnode);
-        }
-
-        pnode->nTimeConnected = GetTime();
-        return pnode;
     }
     else
     {
         return NULL;
     }
+
+    // Add node
+    CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
+    pnode->fConnecting = fConnecting;
+    if (fConnecting)
+    {
+        // Nothing is known about the socket until the poll reports it
+        pnode->fSocketReadable = false;
+        pnode->fSocketWritable = false;
+    }
+    if (nTimeout != 0)
+        pnode->AddRef(nTimeout);
+    else
+        pnode->AddRef();
+
+    {
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+    }
+    if (fConnecting)
+        WakeSocketHandler();
+
+    pnode->nTimeConnected = GetTime();
+    return pnode;
+}
+
+// Called by the socket thread once a started connection is ready or overdue
+static void FinishConnectNode(CNode* pnode, bool fTimedOut)
+{
+    pnode->fConnecting = false;
+    addrman.Attempt(pnode->addr);
+    if (fTimedOut || !FinishConnectSocket(pnode->hSocket))
+    {
+        if (fTimedOut)
+            printf("connection timeout %s\n", pnode->addr.ToString().c_str());
+        pnode->CloseSocketDisconnect();
+        return;
+    }
+    printf("connected %s\n", pnode->addr.ToString().c_str());
+    pnode->nTimeConnected = GetTime();
+}
+
+// Socket thread step for a node with a connection in progress at
+// nTimeMillis; returns true while it is still waiting on the handshake
+bool CheckConnectNode(CNode* pnode, int64 nTimeMillis)
+{
+    if (pnode->fSocketReadable || pnode->fSocketWritable)
+        FinishConnectNode(pnode, false);
+    else if (nTimeMillis - pnode->nTimeConnected * 1000 > nConnectTimeout)
+        FinishConnectNode(pnode, true);
+    else
+        return true;
+    return false;
 }
 
 void CNode::CloseSocketDisconnect()
@@ -536,7 +593,6 @@ void CNode::CloseSocketDisconnect()
         printf("disconnecting node %s\n", addrName.c_str());
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
-        vRecv.clear();
     }
 }
 
@@ -545,6 +601,172 @@ void CNode::Cleanup()
 }
 
 
+void SetMessageHeader(CDataStream& ss)
+{
+    assert(ss.size() >= CMessageHeader::HEADER_SIZE);
+
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy(&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    memcpy(&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
+// Write as much of the send queue as the socket takes, gathering several
+// queued messages into one call where the platform allows. Returns true if
+// the socket took everything offered and more is queued.
+static bool SocketSendData(CNode* pnode)
+{
+    static const int SEND_IOV_MAX = 64;
+    size_t nOffered = 0;
+#ifndef WIN32
+    struct iovec iov[SEND_IOV_MAX];
+    int nIov = 0;
+    size_t nOffset = pnode->nSendOffset;
+    for (deque<CSendMsg>::iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nIov < SEND_IOV_MAX; it++)
+    {
+        const CSerializeData& data = **it;
+        iov[nIov].iov_base = (void*)&data[nOffset];
+        iov[nIov].iov_len = data.size() - nOffset;
+        nOffered += iov[nIov].iov_len;
+        nOffset = 0;
+        nIov++;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = nIov;
+    int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+    const CSerializeData& data = *pnode->vSendMsg.front();
+    nOffered = data.size() - pnode->nSendOffset;
+    int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nOffered, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+    if (nBytes > 0)
+    {
+        pnode->nLastSend = GetTime();
+        pnode->RecordBytesSent(nBytes);
+        bool fWasFull = pnode->nSendSize >= SendBufferSize();
+        pnode->nSendSize -= nBytes;
+
+        // Drop the messages that went out completely; the buffers are
+        // freed once no other peer's queue holds them
+        size_t nLeft = nBytes;
+        while (nLeft > 0)
+        {
+            size_t nRemaining = pnode->vSendMsg.front()->size() - pnode->nSendOffset;
+            if (nLeft < nRemaining)
+            {
+                pnode->nSendOffset += nLeft;
+                break;
+            }
+            nLeft -= nRemaining;
+            pnode->vSendMsg.pop_front();
+            pnode->nSendOffset = 0;
+        }
+
+        // The handler skips peers it could not answer
+        if (fWasFull && pnode->nSendSize < SendBufferSize())
+            WakeMessageHandler();
+
+        // Short write: the kernel buffer is full until the next EPOLLOUT
+        if ((size_t)nBytes < nOffered)
+        {
+            pnode->fSocketWritable = false;
+            return false;
+        }
+        return !pnode->vSendMsg.empty();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr == WSAEWOULDBLOCK)
+            pnode->fSocketWritable = false;
+        else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            printf("socket send error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
+{
+    bool fComplete = false;
+    while (nBytes > 0)
+    {
+        // Continue the incomplete message at the back, or start a new one
+        if (vRecvMsg.empty() || vRecvMsg.back().complete())
+            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+
+        CNetMessage& msg = vRecvMsg.back();
+        int nHandled;
+        if (!msg.fInData)
+            nHandled = msg.readHeader(pch, nBytes);
+        else
+            nHandled = msg.readData(pch, nBytes);
+        if (nHandled < 0)
+            return false;
+
+        pch += nHandled;
+        nBytes -= nHandled;
+        if (msg.complete())
+            fComplete = true;
+    }
+    if (fComplete)
+        WakeMessageHandler();
+    return true;
+}
+
+int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
+{
+    // Copy what we have of the header
+    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nCopy = std::min(nRemaining, nBytes);
+    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    nHdrPos += nCopy;
+
+    // If the header is still incomplete we are done
+    if (nHdrPos < 24)
+        return nCopy;
+
+    // Parse it once
+    try
+    {
+        hdrbuf >> hdr;
+    }
+    catch (std::exception& e) {
+        return -1;
+    }
+
+    // Nothing bigger than the receive buffer could ever be delivered
+    if (hdr.nMessageSize > MAX_SIZE || hdr.nMessageSize > ReceiveBufferSize())
+    {
+        printf("CNetMessage::readHeader() : (%s, %u bytes) message too large\n", hdr.GetCommand().c_str(), hdr.nMessageSize);
+        return -1;
+    }
+
+    vRecv.resize(hdr.nMessageSize);
+    fInData = true;
+    return nCopy;
+}
+
+int CNetMessage::readData(const char* pch, unsigned int nBytes)
+{
+    unsigned int nRemaining = hdr.nMessageSize - nDataPos;
+    unsigned int nCopy = std::min(nRemaining, nBytes);
+    memcpy(&vRecv[nDataPos], pch, nCopy);
+    nDataPos += nCopy;
+    return nCopy;
+}
+
+
 void CNode::PushVersion()
 {
     /// when NTP implemented, change to just nTime = GetAdjustedTime()
@@ -563,6 +785,11 @@ void CNode::PushVersion()
 
 std::map<CNetAddr, int64> CNode::setBanned;
 CCriticalSection CNode::cs_setBanned;
+int CNode::nLastNodeId = 0;
+CCriticalSection CNode::cs_nLastNodeId;
+uint64 CNode::nTotalBytesRecv = 0;
+uint64 CNode::nTotalBytesSent = 0;
+CCriticalSection CNode::cs_totalBytes;
 
 void CNode::ClearBanned()
 {
@@ -610,6 +837,60 @@ bool CNode::Misbehaving(int howmuch)
     return false;
 }
 
+// Called with cs_vSend held, as the message is queued
+void CNode::RecordSendMsg(const CSendMsg& pmsg)
+{
+    const char* pchCommand = &(*pmsg)[CMessageHeader::MESSAGE_START_SIZE];
+    std::string strCommand(pchCommand, strnlen(pchCommand, CMessageHeader::COMMAND_SIZE));
+    if (!IsKnownMessageType(strCommand))
+        strCommand = "*other*";
+
+    LOCK(cs_stats);
+    mapSendBytesPerMsgCmd[strCommand] += pmsg->size();
+    nSendSizeMax = std::max(nSendSizeMax, (uint64)nSendSize);
+}
+
+void CNode::RecordRecvMsg(const std::string& strCommand, unsigned int nBytes, int64 nUsec)
+{
+    std::string strKey = IsKnownMessageType(strCommand) ? strCommand : "*other*";
+
+    LOCK(cs_stats);
+    mapRecvBytesPerMsgCmd[strKey] += nBytes;
+    mapRecvUsecPerMsgCmd[strKey] += nUsec;
+}
+
+void CNode::RecordBytesSent(unsigned int nBytes)
+{
+    {
+        LOCK(cs_stats);
+        nSendBytes += nBytes;
+    }
+    LOCK(cs_totalBytes);
+    nTotalBytesSent += nBytes;
+}
+
+void CNode::RecordBytesRecv(unsigned int nBytes)
+{
+    {
+        LOCK(cs_stats);
+        nRecvBytes += nBytes;
+    }
+    LOCK(cs_totalBytes);
+    nTotalBytesRecv += nBytes;
+}
+
+uint64 CNode::GetTotalBytesSent()
+{
+    LOCK(cs_totalBytes);
+    return nTotalBytesSent;
+}
+
+uint64 CNode::GetTotalBytesRecv()
+{
+    LOCK(cs_totalBytes);
+    return nTotalBytesRecv;
+}
+
 #undef X
 #define X(name) stats.name = name
 void CNode::copyStats(CNodeStats &stats)
@@ -625,6 +906,22 @@ void CNode::copyStats(CNodeStats &stats)
     X(nReleaseTime);
     X(nStartingHeight);
     X(nMisbehavior);
+    {
+        LOCK(cs_stats);
+        X(nSendBytes);
+        X(nRecvBytes);
+        X(nSendSizeMax);
+        X(mapSendBytesPerMsgCmd);
+        X(mapRecvBytesPerMsgCmd);
+        X(mapRecvUsecPerMsgCmd);
+    }
+
+    // Seconds; an outstanding ping shows how long it has been waiting
+    int64 nPingUsecWait = 0;
+    if (nPingNonceSent != 0 && nPingUsecStart != 0)
+        nPingUsecWait = GetTimeMicros() - nPingUsecStart;
+    stats.dPingTime = ((double)nPingUsecTime) / 1e6;
+    stats.dPingWait = ((double)nPingUsecWait) / 1e6;
 }
 #undef X
 
@@ -637,6 +934,63 @@ void CNode::copyStats(CNodeStats &stats)
 
 
 
+// The socket thread waits on epoll where the kernel has it and on select()
+// elsewhere. Node sockets are registered with epoll once, edge triggered for
+// both directions, so idle peers cost nothing per wakeup; their readiness is
+// kept in fSocketReadable/fSocketWritable until a call would block. Queuing
+// a message in an empty send buffer writes to a pipe to wake the thread.
+#ifdef HAVE_EPOLL
+static int hEpoll = -1;
+#endif
+#ifndef WIN32
+static int pipeWake[2] = { -1, -1 };
+#endif
+
+void WakeSocketHandler()
+{
+#ifndef WIN32
+    if (pipeWake[1] != -1)
+    {
+        // A full pipe is just as good a wakeup
+        char c = 0;
+        if (write(pipeWake[1], &c, 1) < 0) {}
+    }
+#endif
+}
+
+void static InitSocketEvents()
+{
+#ifndef WIN32
+    if (pipe(pipeWake) == 0)
+    {
+        fcntl(pipeWake[0], F_SETFL, O_NONBLOCK);
+        fcntl(pipeWake[1], F_SETFL, O_NONBLOCK);
+    }
+    else
+        pipeWake[0] = pipeWake[1] = -1;
+#endif
+#ifdef HAVE_EPOLL
+    hEpoll = epoll_create(128);
+    if (hEpoll == -1)
+    {
+        printf("epoll_create failed %d, using select\n", errno);
+        return;
+    }
+    // Listen sockets and the wake pipe stay level triggered
+    vector<SOCKET> vSocket = vhListenSocket;
+    if (pipeWake[0] != -1)
+        vSocket.push_back(pipeWake[0]);
+    BOOST_FOREACH(SOCKET hSocket, vSocket)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = hSocket;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) == -1)
+            printf("epoll_ctl add %d failed %d\n", hSocket, errno);
+    }
+#endif
+}
+
 void ThreadSocketHandler(void* parg)
 {
     // Make this thread recognisable as the networking thread
@@ -663,6 +1017,10 @@ void ThreadSocketHandler2(void* parg)
     printf("ThreadSocketHandler started\n");
     list<CNode*> vNodesDisconnected;
     unsigned int nPrevNodeCount = 0;
+    map<SOCKET, CNode*> mapSocketNode;
+    bool fMoreWork = false;
+
+    InitSocketEvents();
 
     loop
     {
@@ -676,7 +1034,7 @@ void ThreadSocketHandler2(void* parg)
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
                 if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->vSendMsg.empty()))
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
@@ -687,6 +1045,23 @@ void ThreadSocketHandler2(void* parg)
                     // close socket and cleanup
                     pnode->CloseSocketDisconnect();
                     pnode->Cleanup();
+                    {
+                        TRY_LOCK(pnode->cs_vRecv, lockRecv);
+                        if (lockRecv)
+                            pnode->vRecvMsg.clear();
+                    }
+                    {
+                        TRY_LOCK(pnode->cs_vSend, lockSend);
+                        if (lockSend)
+                        {
+                            pnode->vSendMsg.clear();
+                            pnode->nSendSize = 0;
+                            pnode->nSendOffset = 0;
+                        }
+                    }
+                    map<SOCKET, CNode*>::iterator mi = mapSocketNode.find(pnode->hSocketPolled);
+                    if (mi != mapSocketNode.end() && mi->second == pnode)
+                        mapSocketNode.erase(mi);
 
                     // hold in disconnected pool until all refs are released
                     pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
@@ -737,70 +1112,174 @@ void ThreadSocketHandler2(void* parg)
 
 
         //
-        // Find which sockets have data to receive
+        // Wait for sockets to become ready
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+        int nTimeout = fMoreWork ? 0 : 50; // milliseconds; frequency to poll pnode->vSendMsg without a wake pipe
+        fMoreWork = false;
+        set<SOCKET> setListenReady; // listen sockets and the wake pipe with something to read
+
+#ifdef HAVE_EPOLL
+        if (hEpoll != -1)
         {
+            // Register sockets we have not seen yet. A socket number closed
+            // elsewhere can come back for a new node, so events are looked up
+            // by socket and only trusted while the node still owns it.
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                {
+                    SOCKET hSocket = pnode->hSocket;
+                    if (hSocket == INVALID_SOCKET || hSocket == pnode->hSocketPolled)
+                        continue;
+                    struct epoll_event event;
+                    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+                    event.data.fd = hSocket;
+                    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) == -1 &&
+                        (errno != EEXIST || epoll_ctl(hEpoll, EPOLL_CTL_MOD, hSocket, &event) == -1))
+                    {
+                        printf("epoll_ctl add %d failed %d\n", hSocket, errno);
+                        continue;
+                    }
+                    pnode->hSocketPolled = hSocket;
+                    mapSocketNode[hSocket] = pnode;
+                }
+            }
+
+            struct epoll_event vEvent[256];
+            vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+            int nEvents = epoll_wait(hEpoll, vEvent, 256, nTimeout);
+            vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+            if (fShutdown)
+                return;
+            if (nEvents == -1 && errno != EINTR)
+            {
+                printf("socket epoll_wait error %d\n", errno);
+                Sleep(nTimeout);
+            }
+
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
+            for (int i = 0; i < nEvents; i++)
             {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetRecv);
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
+                SOCKET hSocket = vEvent[i].data.fd;
+                map<SOCKET, CNode*>::iterator mi = mapSocketNode.find(hSocket);
+                if (mi != mapSocketNode.end())
+                {
+                    CNode* pnode = mi->second;
+                    if (pnode->hSocket != hSocket)
+                        continue;
+                    if (vEvent[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                        pnode->fSocketReadable = true;
+                    if (vEvent[i].events & EPOLLOUT)
+                        pnode->fSocketWritable = true;
+                }
+                else
+                    setListenReady.insert(hSocket);
+            }
+        }
+        else
+#endif
+        {
+            struct timeval timeout;
+            timeout.tv_sec  = 0;
+            timeout.tv_usec = nTimeout * 1000;
+
+            fd_set fdsetRecv;
+            fd_set fdsetSend;
+            fd_set fdsetError;
+            FD_ZERO(&fdsetRecv);
+            FD_ZERO(&fdsetSend);
+            FD_ZERO(&fdsetError);
+            SOCKET hSocketMax = 0;
+            bool have_fds = false;
+
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+                FD_SET(hListenSocket, &fdsetRecv);
+                hSocketMax = max(hSocketMax, hListenSocket);
+                have_fds = true;
+            }
+#ifndef WIN32
+            if (pipeWake[0] != -1)
+            {
+                FD_SET(pipeWake[0], &fdsetRecv);
+                hSocketMax = max(hSocketMax, (SOCKET)pipeWake[0]);
                 have_fds = true;
+            }
+#endif
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        continue;
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+                    FD_SET(pnode->hSocket, &fdsetError);
+                    hSocketMax = max(hSocketMax, pnode->hSocket);
+                    have_fds = true;
+                    if (pnode->fConnecting)
+                    {
                         FD_SET(pnode->hSocket, &fdsetSend);
+                        continue;
+                    }
+                    {
+                        TRY_LOCK(pnode->cs_vSend, lockSend);
+                        if (lockSend && !pnode->vSendMsg.empty())
+                            FD_SET(pnode->hSocket, &fdsetSend);
+                    }
                 }
             }
-        }
 
-        vnThreadsRunning[THREAD_SOCKETHANDLER]--;
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        vnThreadsRunning[THREAD_SOCKETHANDLER]++;
-        if (fShutdown)
-            return;
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
+            vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+            int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                                 &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+            vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+            if (fShutdown)
+                return;
+            if (nSelect == SOCKET_ERROR)
             {
-                int nErr = WSAGetLastError();
-                printf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                if (have_fds)
+                {
+                    int nErr = WSAGetLastError();
+                    printf("socket select error %d\n", nErr);
+                    for (unsigned int i = 0; i <= hSocketMax; i++)
+                        FD_SET(i, &fdsetRecv);
+                }
+                FD_ZERO(&fdsetSend);
+                FD_ZERO(&fdsetError);
+                Sleep(timeout.tv_usec/1000);
+            }
+
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                if (FD_ISSET(hListenSocket, &fdsetRecv))
+                    setListenReady.insert(hListenSocket);
+#ifndef WIN32
+            if (pipeWake[0] != -1 && FD_ISSET(pipeWake[0], &fdsetRecv))
+                setListenReady.insert(pipeWake[0]);
+#endif
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+            {
+                if (pnode->hSocket == INVALID_SOCKET)
+                    continue;
+                pnode->fSocketReadable = FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError);
+                pnode->fSocketWritable = FD_ISSET(pnode->hSocket, &fdsetSend);
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            Sleep(timeout.tv_usec/1000);
         }
 
+#ifndef WIN32
+        // Drain the wake pipe
+        if (pipeWake[0] != -1 && setListenReady.count(pipeWake[0]))
+        {
+            char pchBuf[256];
+            while (read(pipeWake[0], pchBuf, sizeof(pchBuf)) > 0) {}
+        }
+#endif
+
 
         //
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (hListenSocket != INVALID_SOCKET && setListenReady.count(hListenSocket))
         {
 #ifdef USE_IPV6
             struct sockaddr_storage sockaddr;
@@ -813,10 +1292,10 @@ void ThreadSocketHandler2(void* parg)
             int nInbound = 0;
 
             if (hSocket != INVALID_SOCKET)
+            {
                 if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
                     printf("Warning: Unknown socket family\n");
 
-            {
                 LOCK(cs_vNodes);
                 BOOST_FOREACH(CNode* pnode, vNodes)
                     if (pnode->fInbound)
@@ -870,33 +1349,42 @@ void ThreadSocketHandler2(void* parg)
             if (fShutdown)
                 return;
 
+            //
+            // Connect
+            //
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            if (pnode->fConnecting && CheckConnectNode(pnode, GetTimeMillis()))
+                continue;
+
             //
             // Receive
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (pnode->fSocketReadable)
             {
                 TRY_LOCK(pnode->cs_vRecv, lockRecv);
                 if (lockRecv)
                 {
-                    CDataStream& vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
-
-                    if (nPos > ReceiveBufferSize()) {
-                        if (!pnode->fDisconnect)
-                            printf("socket recv flood control disconnect (%"PRIszu" bytes)\n", vRecv.size());
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else {
+                    // Leave the data in the kernel until the message handler catches up
+                    if (pnode->GetTotalRecvSize() <= ReceiveBufferSize())
+                    {
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
                         int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
-                            vRecv.resize(nPos + nBytes);
-                            memcpy(&vRecv[nPos], pchBuf, nBytes);
+                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                                pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
+                            pnode->RecordBytesRecv(nBytes);
+
+                            // A full buffer may have left more in the kernel
+                            if (nBytes == (int)sizeof(pchBuf))
+                                fMoreWork = true;
+                            else
+                                pnode->fSocketReadable = false;
                         }
                         else if (nBytes == 0)
                         {
@@ -909,7 +1397,9 @@ void ThreadSocketHandler2(void* parg)
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fSocketReadable = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
                                     printf("socket recv error %d\n", nErr);
@@ -925,38 +1415,18 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fSocketWritable)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
-                    {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-                            pnode->nLastSend = GetTime();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                printf("socket send error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                if (lockSend && !pnode->vSendMsg.empty())
+                    if (SocketSendData(pnode))
+                        fMoreWork = true;
             }
 
             //
             // Inactivity checking
             //
-            if (pnode->vSend.empty())
+            if (pnode->vSendMsg.empty())
                 pnode->nLastSendEmpty = GetTime();
             if (GetTime() - pnode->nTimeConnected > 60)
             {
@@ -982,8 +1452,6 @@ void ThreadSocketHandler2(void* parg)
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->Release();
         }
-
-        Sleep(10);
     }
 }
 
@@ -1653,12 +2121,31 @@ void ThreadMessageHandler(void* parg)
     printf("ThreadMessageHandler exited\n");
 }
 
+// The message handler sleeps until the socket thread completes a message or
+// drains a full send buffer, or the verification threads finish a
+// transaction. The timeout keeps the timers in SendMessages running.
+static CWaitableCriticalSection cs_msgHandler;
+static boost::condition_variable cvMsgHandler;
+static bool fMsgHandlerWake = false;
+
+void WakeMessageHandler()
+{
+    {
+        boost::unique_lock<CWaitableCriticalSection> lock(cs_msgHandler);
+        fMsgHandlerWake = true;
+    }
+    cvMsgHandler.notify_one();
+}
+
 void ThreadMessageHandler2(void* parg)
 {
     printf("ThreadMessageHandler started\n");
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    int64 nLastTrickle = 0;
     while (!fShutdown)
     {
+        bool fMoreWork = false;
+
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
@@ -1667,17 +2154,32 @@ void ThreadMessageHandler2(void* parg)
                 pnode->AddRef();
         }
 
-        // Poll the connected nodes for messages
+        // Passes now run as often as messages arrive; trickle at the
+        // old pace so inventory still bunches up
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        int64 nNow = GetTimeMillis();
+        if (!vNodesCopy.empty() && nNow - nLastTrickle >= 100)
+        {
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+            nLastTrickle = nNow;
+        }
+
+        // Take one message from each peer in turn
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecv, lockRecv);
                 if (lockRecv)
-                    ProcessMessages(pnode);
+                {
+                    if (!ProcessMessages(pnode))
+                        pnode->CloseSocketDisconnect();
+                    if (!pnode->fDisconnect && pnode->nSendSize < SendBufferSize() &&
+                        (!pnode->vGetDataBlocks.empty() || !pnode->vGetBlockTxn.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete())))
+                        fMoreWork = true;
+                }
+                else
+                    fMoreWork = true;
             }
             if (fShutdown)
                 return;
@@ -1692,17 +2194,34 @@ void ThreadMessageHandler2(void* parg)
                 return;
         }
 
+        // Accept the transactions the verification threads are done with,
+        // then retry orphans whose missing parents arrived during this pass
+        {
+            TRY_LOCK(cs_main, lockMain);
+            if (lockMain)
+            {
+                ProcessVerifiedTransactions();
+                if (ProcessOrphanWork(MAX_ORPHAN_WORK))
+                    fMoreWork = true;
+            }
+        }
+
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->Release();
         }
 
-        // Wait and allow messages to bunch up.
+        // Wait for something to do unless this pass left work behind.
         // Reduce vnThreadsRunning so StopNode has permission to exit while
         // we're sleeping, but we must always check fShutdown after doing this.
         vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        Sleep(100);
+        {
+            boost::unique_lock<CWaitableCriticalSection> lock(cs_msgHandler);
+            if (!fMoreWork && !fMsgHandlerWake)
+                cvMsgHandler.timed_wait(lock, boost::posix_time::milliseconds(100));
+            fMsgHandlerWake = false;
+        }
         if (fRequestShutdown)
             StartShutdown();
         vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
@@ -1969,6 +2488,8 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_DNSSEED] > 0) printf("ThreadDNSAddressSeed still running\n");
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
+    if (vnThreadsRunning[THREAD_MEMPOOL] > 0) printf("ThreadMempoolPersist still running\n");
+    if (vnThreadsRunning[THREAD_TXVERIFY] > 0) printf("ThreadTxVerify still running\n");
     while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
         Sleep(20);
     Sleep(50);
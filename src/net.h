@@ -8,13 +8,14 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
 #include <arpa/inet.h>
 #endif
 
-#include "mruset.h"
+#include "bloom.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "addrman.h"
@@ -29,6 +30,13 @@ extern int nBestHeight;
 inline unsigned int ReceiveBufferSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
+// Addresses and inventory remembered per peer as known to it, and the rate
+// at which something it does not know is taken for known and not sent
+static const unsigned int ADDR_KNOWN_ELEMENTS = 5000;
+static const double ADDR_KNOWN_FP_RATE = 0.001;
+static const unsigned int INVENTORY_KNOWN_ELEMENTS = 10000;
+static const double INVENTORY_KNOWN_FP_RATE = 0.000001;
+
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
 bool GetMyExternalIP(CNetAddr& ipRet);
@@ -41,6 +49,8 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
 void StartNode(void* parg);
 bool StopNode();
+void WakeSocketHandler();
+void WakeMessageHandler();
 
 enum
 {
@@ -106,6 +116,8 @@ enum threadId
     THREAD_ADDEDCONNECTIONS,
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
+    THREAD_MEMPOOL,
+    THREAD_TXVERIFY,
 
     THREAD_MAX
 };
@@ -128,6 +140,8 @@ extern std::map<CInv, int64> mapAlreadyAskedFor;
 
 
 
+typedef std::map<std::string, uint64> mapMsgCmdSize; // command -> bytes or microseconds
+
 class CNodeStats
 {
 public:
@@ -142,6 +156,82 @@ public:
     int64 nReleaseTime;
     int nStartingHeight;
     int nMisbehavior;
+    uint64 nSendBytes;
+    uint64 nRecvBytes;
+    uint64 nSendSizeMax;
+    double dPingTime;
+    double dPingWait;
+    mapMsgCmdSize mapSendBytesPerMsgCmd;
+    mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    mapMsgCmdSize mapRecvUsecPerMsgCmd;
+};
+
+
+
+
+/** A complete message, header included, waiting in a send queue. Queued
+ * buffers are never modified, so a message serialized once (a block, say)
+ * can sit in the queues of many peers at the same time.
+ */
+typedef boost::shared_ptr<const CSerializeData> CSendMsg;
+
+/** Fill in the size and checksum of the header at the front of ss */
+void SetMessageHeader(CDataStream& ss);
+
+/** Serialize a message once for sending to any number of peers */
+template<typename T>
+CSendMsg MakeSendMsg(const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ::GetSerializeSize(obj, SER_NETWORK, PROTOCOL_VERSION));
+    ss << CMessageHeader(pszCommand, 0) << obj;
+    SetMessageHeader(ss);
+    boost::shared_ptr<CSerializeData> pmsg(new CSerializeData());
+    ss.GetAndClear(*pmsg);
+    return pmsg;
+}
+
+
+
+
+/** A message being received from a peer. The socket thread fills in the
+ * header, then the payload, as bytes arrive; the message handler takes it
+ * from the front of CNode::vRecvMsg once complete.
+ */
+class CNetMessage
+{
+public:
+    bool fInData; // header complete, reading the payload
+
+    CDataStream hdrbuf; // partially received header
+    CMessageHeader hdr;
+    unsigned int nHdrPos;
+
+    CDataStream vRecv; // payload, allocated to hdr.nMessageSize
+    unsigned int nDataPos;
+
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    {
+        hdrbuf.resize(24);
+        fInData = false;
+        nHdrPos = 0;
+        nDataPos = 0;
+    }
+
+    bool complete() const
+    {
+        return fInData && hdr.nMessageSize == nDataPos;
+    }
+
+    void SetVersion(int nVersionIn)
+    {
+        hdrbuf.SetVersion(nVersionIn);
+        vRecv.SetVersion(nVersionIn);
+    }
+
+    // Consume up to nBytes, returning how many were used or -1 on a bad header
+    int readHeader(const char* pch, unsigned int nBytes);
+    int readData(const char* pch, unsigned int nBytes);
 };
 
 
@@ -155,16 +245,18 @@ public:
     // socket
     uint64 nServices;
     SOCKET hSocket;
-    CDataStream vSend;
-    CDataStream vRecv;
+    CDataStream ssSend; // message being built between BeginMessage and EndMessage
+    std::deque<CSendMsg> vSendMsg;
+    size_t nSendSize; // bytes in vSendMsg still to be sent
+    size_t nSendOffset; // bytes of vSendMsg.front() already sent
+    std::deque<CNetMessage> vRecvMsg;
+    int nRecvVersion;
     CCriticalSection cs_vSend;
     CCriticalSection cs_vRecv;
     int64 nLastSend;
     int64 nLastRecv;
     int64 nLastSendEmpty;
     int64 nTimeConnected;
-    int nHeaderStart;
-    unsigned int nMessageStart;
     CAddress addr;
     std::string addrName;
     CService addrLocal;
@@ -176,9 +268,19 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    bool fConnecting; // outbound connect in progress, finished by the socket thread
     CSemaphoreGrant grantOutbound;
+    int id;
+
+    // Socket handler state: the socket registered with epoll, and whether
+    // the socket was last seen readable/writable (cleared on EWOULDBLOCK)
+    SOCKET hSocketPolled;
+    bool fSocketReadable;
+    bool fSocketWritable;
 protected:
     int nRefCount;
+    static int nLastNodeId;
+    static CCriticalSection cs_nLastNodeId;
 
     // Denial-of-service detection/prevention
     // Key is IP address, value is banned-until-time
@@ -186,37 +288,62 @@ protected:
     static CCriticalSection cs_setBanned;
     int nMisbehavior;
 
+    // Traffic totals of all peers
+    static uint64 nTotalBytesRecv;
+    static uint64 nTotalBytesSent;
+    static CCriticalSection cs_totalBytes;
+
 public:
     int64 nReleaseTime;
     std::map<uint256, CRequestTracker> mapRequests;
     CCriticalSection cs_mapRequests;
     uint256 hashContinue;
-    CBlockIndex* pindexLastGetBlocksBegin;
-    uint256 hashLastGetBlocksEnd;
+    std::deque<CBlockIndex*> vGetDataBlocks; // requested blocks waiting for send buffer space
+    std::deque<std::pair<CBlockIndex*, std::vector<unsigned short> > > vGetBlockTxn; // getshorttxn requests, likewise
+    uint256 hashLastGetHeadersBegin;
     int nStartingHeight;
+    bool fSendCompact; // announce new blocks to it with shortblock
+
+    // Traffic accounting, per command for known message types
+    CCriticalSection cs_stats;
+    uint64 nSendBytes;
+    uint64 nRecvBytes;
+    uint64 nSendSizeMax; // most ever waiting in vSendMsg
+    mapMsgCmdSize mapSendBytesPerMsgCmd;
+    mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    mapMsgCmdSize mapRecvUsecPerMsgCmd; // time spent handling each command
+
+    // Ping round trip; nPingNonceSent is 0 when no ping is outstanding
+    uint64 nPingNonceSent;
+    int64 nPingUsecStart;
+    int64 nPingUsecTime;
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    std::set<CAddress> setAddrKnown;
+    CRollingBloomFilter filterAddrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), vRecv(SER_NETWORK, MIN_PROTO_VERSION)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) :
+        ssSend(SER_NETWORK, MIN_PROTO_VERSION),
+        filterAddrKnown(ADDR_KNOWN_ELEMENTS, ADDR_KNOWN_FP_RATE),
+        filterInventoryKnown(INVENTORY_KNOWN_ELEMENTS, INVENTORY_KNOWN_FP_RATE)
     {
         nServices = 0;
         hSocket = hSocketIn;
+        nSendSize = 0;
+        nSendOffset = 0;
+        nRecvVersion = MIN_PROTO_VERSION;
         nLastSend = 0;
         nLastRecv = 0;
         nLastSendEmpty = GetTime();
         nTimeConnected = GetTime();
-        nHeaderStart = -1;
-        nMessageStart = -1;
         addr = addrIn;
         addrName = addrNameIn == "" ? addr.ToStringIPPort() : addrNameIn;
         nVersion = 0;
@@ -227,15 +354,29 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fConnecting = false;
         nRefCount = 0;
         nReleaseTime = 0;
         hashContinue = 0;
-        pindexLastGetBlocksBegin = 0;
-        hashLastGetBlocksEnd = 0;
+        hashLastGetHeadersBegin = 0;
         nStartingHeight = -1;
+        fSendCompact = false;
+        nSendBytes = 0;
+        nRecvBytes = 0;
+        nSendSizeMax = 0;
+        nPingNonceSent = 0;
+        nPingUsecStart = 0;
+        nPingUsecTime = 0;
         fGetAddr = false;
         nMisbehavior = 0;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
+        hSocketPolled = INVALID_SOCKET;
+        fSocketReadable = true;
+        fSocketWritable = true;
+
+        {
+            LOCK(cs_nLastNodeId);
+            id = nLastNodeId++;
+        }
 
         // Be shy and don't send version until we hear
         if (!fInbound)
@@ -257,6 +398,25 @@ private:
 public:
 
 
+    // Frame received bytes into vRecvMsg; false if the peer sent garbage
+    bool ReceiveMsgBytes(const char* pch, unsigned int nBytes);
+
+    // Bytes held by received messages, complete or not
+    unsigned int GetTotalRecvSize()
+    {
+        unsigned int nTotal = 0;
+        BOOST_FOREACH(const CNetMessage& msg, vRecvMsg)
+            nTotal += msg.vRecv.size() + 24;
+        return nTotal;
+    }
+
+    void SetRecvVersion(int nVersionIn)
+    {
+        nRecvVersion = nVersionIn;
+        BOOST_FOREACH(CNetMessage& msg, vRecvMsg)
+            msg.SetVersion(nVersionIn);
+    }
+
     int GetRefCount()
     {
         return std::max(nRefCount, 0) + (GetTime() < nReleaseTime ? 1 : 0);
@@ -280,7 +440,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        filterAddrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -288,7 +448,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr))
+        if (addr.IsValid() && !filterAddrKnown.contains(addr.GetKey()))
             vAddrToSend.push_back(addr);
     }
 
@@ -297,7 +457,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -305,7 +465,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -335,22 +495,18 @@ public:
     void BeginMessage(const char* pszCommand)
     {
         ENTER_CRITICAL_SECTION(cs_vSend);
-        if (nHeaderStart != -1)
+        if (!ssSend.empty())
             AbortMessage();
-        nHeaderStart = vSend.size();
-        vSend << CMessageHeader(pszCommand, 0);
-        nMessageStart = vSend.size();
+        ssSend << CMessageHeader(pszCommand, 0);
         if (fDebug)
             printf("sending: %s ", pszCommand);
     }
 
     void AbortMessage()
     {
-        if (nHeaderStart < 0)
+        if (ssSend.empty())
             return;
-        vSend.resize(nHeaderStart);
-        nHeaderStart = -1;
-        nMessageStart = -1;
+        ssSend.clear();
         LEAVE_CRITICAL_SECTION(cs_vSend);
 
         if (fDebug)
@@ -366,34 +522,29 @@ public:
             return;
         }
 
-        if (nHeaderStart < 0)
+        if (ssSend.empty())
             return;
 
-        // Set the size
-        unsigned int nSize = vSend.size() - nMessageStart;
-        memcpy((char*)&vSend[nHeaderStart] + CMessageHeader::MESSAGE_SIZE_OFFSET, &nSize, sizeof(nSize));
-
-        // Set the checksum
-        uint256 hash = Hash(vSend.begin() + nMessageStart, vSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(nMessageStart - nHeaderStart >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&vSend[nHeaderStart] + CMessageHeader::CHECKSUM_OFFSET, &nChecksum, sizeof(nChecksum));
+        SetMessageHeader(ssSend);
 
         if (fDebug) {
-            printf("(%d bytes)\n", nSize);
+            printf("(%d bytes)\n", (int)(ssSend.size() - CMessageHeader::HEADER_SIZE));
         }
 
-        nHeaderStart = -1;
-        nMessageStart = -1;
+        // The buffer moves into the queue as it is
+        boost::shared_ptr<CSerializeData> pmsg(new CSerializeData());
+        ssSend.GetAndClear(*pmsg);
+        bool fWake = QueueSendMsg(pmsg);
         LEAVE_CRITICAL_SECTION(cs_vSend);
+        if (fWake)
+            WakeSocketHandler();
     }
 
     void EndMessageAbortIfEmpty()
     {
-        if (nHeaderStart < 0)
+        if (ssSend.empty())
             return;
-        int nSize = vSend.size() - nMessageStart;
+        int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
         if (nSize > 0)
             EndMessage();
         else
@@ -402,6 +553,29 @@ public:
 
 
 
+    // Queue a message made by MakeSendMsg; cs_vSend must be held.
+    // Returns true if the queue was empty, so the socket thread may be asleep.
+    bool QueueSendMsg(const CSendMsg& pmsg)
+    {
+        vSendMsg.push_back(pmsg);
+        nSendSize += pmsg->size();
+        RecordSendMsg(pmsg);
+        return vSendMsg.size() == 1;
+    }
+
+    void PushSendMsg(const CSendMsg& pmsg)
+    {
+        bool fWake;
+        {
+            LOCK(cs_vSend);
+            fWake = QueueSendMsg(pmsg);
+        }
+        if (fDebug)
+            printf("sending: %.12s (%d bytes, shared)\n", &(*pmsg)[CMessageHeader::MESSAGE_START_SIZE], (int)(pmsg->size() - CMessageHeader::HEADER_SIZE));
+        if (fWake)
+            WakeSocketHandler();
+    }
+
     void PushVersion();
 
 
@@ -425,7 +599,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1;
+            ssSend << a1;
             EndMessage();
         }
         catch (...)
@@ -441,7 +615,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2;
+            ssSend << a1 << a2;
             EndMessage();
         }
         catch (...)
@@ -457,7 +631,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3;
+            ssSend << a1 << a2 << a3;
             EndMessage();
         }
         catch (...)
@@ -473,7 +647,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4;
+            ssSend << a1 << a2 << a3 << a4;
             EndMessage();
         }
         catch (...)
@@ -489,7 +663,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5;
+            ssSend << a1 << a2 << a3 << a4 << a5;
             EndMessage();
         }
         catch (...)
@@ -505,7 +679,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5 << a6;
+            ssSend << a1 << a2 << a3 << a4 << a5 << a6;
             EndMessage();
         }
         catch (...)
@@ -521,7 +695,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5 << a6 << a7;
+            ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7;
             EndMessage();
         }
         catch (...)
@@ -537,7 +711,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8;
+            ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8;
             EndMessage();
         }
         catch (...)
@@ -553,7 +727,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9;
+            ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9;
             EndMessage();
         }
         catch (...)
@@ -610,7 +784,7 @@ public:
 
 
 
-    void PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd);
+    void PushGetHeaders(CBlockIndex* pindexBegin);
     bool IsSubscribed(unsigned int nChannel);
     void Subscribe(unsigned int nChannel, unsigned int nHops=0);
     void CancelSubscribe(unsigned int nChannel);
@@ -635,6 +809,13 @@ public:
     static void ClearBanned(); // needed for unit testing
     static bool IsBanned(CNetAddr ip);
     bool Misbehaving(int howmuch); // 1 == a little, 100 == a lot
+
+    void RecordSendMsg(const CSendMsg& pmsg);
+    void RecordRecvMsg(const std::string& strCommand, unsigned int nBytes, int64 nUsec);
+    void RecordBytesSent(unsigned int nBytes);
+    void RecordBytesRecv(unsigned int nBytes);
+    static uint64 GetTotalBytesSent();
+    static uint64 GetTotalBytesRecv();
     void copyStats(CNodeStats &stats);
 };
 
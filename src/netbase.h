@@ -148,6 +148,10 @@ bool Lookup(const char *pszName, CService& addr, int portDefault = 0, bool fAllo
 bool Lookup(const char *pszName, std::vector<CService>& vAddr, int portDefault = 0, bool fAllowLookup = true, unsigned int nMaxSolutions = 0);
 bool LookupNumeric(const char *pszName, CService& addr, int portDefault = 0);
 bool ConnectSocket(const CService &addr, SOCKET& hSocketRet, int nTimeout = nConnectTimeout);
+// Begin connecting directly to addr without waiting; the socket is left non-blocking
+bool StartConnectSocket(const CService &addr, SOCKET& hSocketRet);
+// Once a started connection is writable, whether it succeeded
+bool FinishConnectSocket(SOCKET hSocket);
 bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault = 0, int nTimeout = nConnectTimeout);
 
 #endif
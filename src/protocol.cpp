@@ -18,6 +18,22 @@ static const char* ppszTypeName[] =
     "block",
 };
 
+static const char* ppszMessageType[] =
+{
+    "version", "verack", "addr", "inv", "getdata", "getblocks", "getheaders",
+    "tx", "block", "headers", "getaddr", "mempool", "checkorder", "submitorder",
+    "reply", "ping", "pong", "alert", "sendshort", "shortblock", "getshorttxn",
+    "shorttxn",
+};
+
+bool IsKnownMessageType(const std::string& strCommand)
+{
+    for (unsigned int i = 0; i < ARRAYLEN(ppszMessageType); i++)
+        if (strCommand == ppszMessageType[i])
+            return true;
+    return false;
+}
+
 CMessageHeader::CMessageHeader()
 {
     memcpy(pchMessageStart, ::pchMessageStart, sizeof(pchMessageStart));
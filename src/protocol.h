@@ -24,6 +24,10 @@ static inline unsigned short GetDefaultPort(const bool testnet = fTestNet)
 
 extern unsigned char pchMessageStart[4];
 
+/** Whether strCommand is a message type we know of; statistics are only kept
+ * per command for these, so a peer cannot grow them with made up commands */
+bool IsKnownMessageType(const std::string& strCommand);
+
 /** Message header.
  * (4) message start.
  * (12) command.
@@ -56,7 +60,8 @@ class CMessageHeader
             CHECKSUM_SIZE=sizeof(int),
 
             MESSAGE_SIZE_OFFSET=MESSAGE_START_SIZE+COMMAND_SIZE,
-            CHECKSUM_OFFSET=MESSAGE_SIZE_OFFSET+MESSAGE_SIZE_SIZE
+            CHECKSUM_OFFSET=MESSAGE_SIZE_OFFSET+MESSAGE_SIZE_SIZE,
+            HEADER_SIZE=CHECKSUM_OFFSET+CHECKSUM_SIZE
         };
         char pchMessageStart[MESSAGE_START_SIZE];
         char pchCommand[COMMAND_SIZE];
@@ -109,19 +109,54 @@ Value settxfee(const Array& params, bool fHelp)
 
 Value getrawmempool(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "getrawmempool\n"
-            "Returns all transaction ids in memory pool.");
+            "getrawmempool [verbose=false]\n"
+            "Returns all transaction ids in memory pool.\n"
+            "With verbose, returns an object per transaction id with its size, fee,\n"
+            "time and height of entry, starting and current priority and the\n"
+            "memory pool transactions it depends on.");
+
+    bool fVerbose = false;
+    if (params.size() > 0)
+        fVerbose = params[0].get_bool();
 
-    vector<uint256> vtxid;
-    mempool.queryHashes(vtxid);
+    if (!fVerbose)
+    {
+        vector<uint256> vtxid;
+        mempool.queryHashes(vtxid);
 
-    Array a;
-    BOOST_FOREACH(const uint256& hash, vtxid)
-        a.push_back(hash.ToString());
+        Array a;
+        BOOST_FOREACH(const uint256& hash, vtxid)
+            a.push_back(hash.ToString());
 
-    return a;
+        return a;
+    }
+
+    Object o;
+    LOCK(mempool.cs);
+    BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& item, mempool.mapTx)
+    {
+        const CTxMemPoolEntry& entry = item.second;
+        Object info;
+        info.push_back(Pair("size", (int)entry.nTxSize));
+        info.push_back(Pair("time", (boost::int64_t)entry.nTime));
+        if (entry.fChecked)
+        {
+            info.push_back(Pair("fee", ValueFromAmount(entry.nFee)));
+            info.push_back(Pair("height", entry.nHeight));
+            info.push_back(Pair("startingpriority", entry.dStartPriority));
+            info.push_back(Pair("currentpriority", entry.GetPriority(nBestHeight)));
+        }
+        Array depends;
+        set<uint256> setDepends;
+        BOOST_FOREACH(const CTxIn& txin, entry.tx.vin)
+            if (mempool.mapTx.count(txin.prevout.hash) && setDepends.insert(txin.prevout.hash).second)
+                depends.push_back(txin.prevout.hash.ToString());
+        info.push_back(Pair("depends", depends));
+        o.push_back(Pair(item.first.ToString(), info));
+    }
+    return o;
 }
 
 Value getblockhash(const Array& params, bool fHelp)
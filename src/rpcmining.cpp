@@ -83,6 +83,79 @@ Value getmininginfo(const Array& params, bool fHelp)
 }
 
 
+/** The block template shared by getwork and getblocktemplate, so any number
+ * of miners polling costs one CreateNewBlock per change. */
+class CTemplateCache
+{
+public:
+    boost::shared_ptr<CBlock> pblock;
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    int64 nStart;
+
+    CTemplateCache()
+    {
+        pindexPrev = NULL;
+        nTransactionsUpdatedLast = 0;
+        nStart = 0;
+    }
+};
+
+static CCriticalSection cs_templateCache;
+static CTemplateCache templateCache;
+
+static CReserveKey& TemplateReserveKey()
+{
+    static CReserveKey reservekey(pwalletMain);
+    return reservekey;
+}
+
+// Returns the current template, rebuilding it if the best block changed or
+// transactions changed and it is more than nMaxAge seconds old.  The block
+// is shared; copy it before changing anything.  Caller holds cs_main.
+static CTemplateCache GetTemplate(int64 nMaxAge)
+{
+    LOCK(cs_templateCache);
+    CTemplateCache& t = templateCache;
+    if (t.pindexPrev != pindexBest ||
+        (nTransactionsUpdated != t.nTransactionsUpdatedLast && GetTime() - t.nStart > nMaxAge))
+    {
+        // Clear pindexPrev so future calls make a new block, despite any failures from here on
+        t.pindexPrev = NULL;
+
+        // Store the pindexBest used before CreateNewBlock, to avoid races
+        t.nTransactionsUpdatedLast = nTransactionsUpdated;
+        CBlockIndex* pindexPrevNew = pindexBest;
+        t.nStart = GetTime();
+
+        // Create new block
+        CBlock* pblock = CreateNewBlock(TemplateReserveKey());
+        if (!pblock)
+            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+        t.pblock.reset(pblock);
+
+        // Need to update only after we know CreateNewBlock succeeded
+        t.pindexPrev = pindexPrevNew;
+    }
+    return t;
+}
+
+// BIP22 long polling: park until the best block changes, or transactions
+// have changed and a minute has passed, without holding cs_main
+static void WaitForTemplateChange(const uint256& hashWatched, unsigned int nTransactionsWatched)
+{
+    int64 nStart = GetTime();
+    boost::unique_lock<CWaitableCriticalSection> lock(csBestBlock);
+    while (!fShutdown)
+    {
+        if (hashBestChain != hashWatched)
+            break;
+        if (nTransactionsUpdated != nTransactionsWatched && GetTime() - nStart >= 60)
+            break;
+        cvBlockChange.timed_wait(lock, boost::posix_time::seconds(1));
+    }
+}
+
 Value getwork(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -102,21 +175,22 @@ Value getwork(const Array& params, bool fHelp)
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Bitcoin is downloading blocks...");
 
     typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
+    static CCriticalSection cs_getwork;
+    static mapNewBlock_t mapNewBlock;
     static vector<CBlock*> vNewBlock;
-    static CReserveKey reservekey(pwalletMain);
+    LOCK(cs_getwork);
 
     if (params.size() == 0)
     {
-        // Update block
-        static unsigned int nTransactionsUpdatedLast;
+        // Update block: every getwork hands out its own extranonce, so work
+        // on a private copy of the shared template
+        static boost::shared_ptr<CBlock> pblockTemplate;
         static CBlockIndex* pindexPrev;
-        static int64 nStart;
         static CBlock* pblock;
-        if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+        CTemplateCache t = GetTemplate(60);
+        if (t.pblock != pblockTemplate)
         {
-            if (pindexPrev != pindexBest)
+            if (pindexPrev != t.pindexPrev)
             {
                 // Deallocate old blocks since they're obsolete now
                 mapNewBlock.clear();
@@ -125,22 +199,10 @@ Value getwork(const Array& params, bool fHelp)
                 vNewBlock.clear();
             }
 
-            // Clear pindexPrev so future getworks make a new block, despite any failures from here on
-            pindexPrev = NULL;
-
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            CBlockIndex* pindexPrevNew = pindexBest;
-            nStart = GetTime();
-
-            // Create new block
-            pblock = CreateNewBlock(reservekey);
-            if (!pblock)
-                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+            pblock = new CBlock(*t.pblock);
             vNewBlock.push_back(pblock);
-
-            // Need to update only after we know CreateNewBlock succeeded
-            pindexPrev = pindexPrevNew;
+            pblockTemplate = t.pblock;
+            pindexPrev = t.pindexPrev;
         }
 
         // Update nTime
@@ -191,7 +253,7 @@ Value getwork(const Array& params, bool fHelp)
         pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 
-        return CheckWork(pblock, *pwalletMain, reservekey);
+        return CheckWork(pblock, *pwalletMain, TemplateReserveKey());
     }
 }
 
@@ -216,9 +278,11 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : limit of block size\n"
             "  \"bits\" : compressed target of next block\n"
             "  \"height\" : height of the next block\n"
+            "  \"longpollid\" : pass back in [params] to wait for the next template change\n"
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
+    Value lpval;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
@@ -231,94 +295,90 @@ Value getblocktemplate(const Array& params, bool fHelp)
         }
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
+        lpval = find_value(oparam, "longpollid");
     }
 
     if (strMode != "template")
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
 
-    if (vNodes.empty())
-        throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Bitcoin is not connected!");
-
-    if (IsInitialBlockDownload())
-        throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Bitcoin is downloading blocks...");
-
-    static CReserveKey reservekey(pwalletMain);
-
-    // Update block
-    static unsigned int nTransactionsUpdatedLast;
-    static CBlockIndex* pindexPrev;
-    static int64 nStart;
-    static CBlock* pblock;
-    if (pindexPrev != pindexBest ||
-        (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
     {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrevNew = pindexBest;
-        nStart = GetTime();
-
-        // Create new block
-        if(pblock)
-        {
-            delete pblock;
-            pblock = NULL;
-        }
-        pblock = CreateNewBlock(reservekey);
-        if (!pblock)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+        LOCK(cs_main);
+        if (vNodes.empty())
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Bitcoin is not connected!");
 
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
+        if (IsInitialBlockDownload())
+            throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Bitcoin is downloading blocks...");
     }
 
-    // Update nTime
+    if (lpval.type() == str_type)
+    {
+        // longpollid is the best block hash the client's template built on,
+        // followed by the transaction update count it saw
+        std::string strId = lpval.get_str();
+        if (strId.size() < 64)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+        uint256 hashWatched(strId.substr(0, 64));
+        unsigned int nTransactionsWatched = atoi(strId.substr(64));
+        WaitForTemplateChange(hashWatched, nTransactionsWatched);
+        if (fShutdown)
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+    }
+    else if (lpval.type() != null_type)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+
+    // The template first: building it takes cs_templateCache and then
+    // mempool.cs, the same order getwork takes them in
+    LOCK(cs_main);
+    CTemplateCache t = GetTemplate(5);
+    CBlockIndex* pindexPrev = t.pindexPrev;
+
+    // Update nTime on a copy, the template itself is shared
+    CBlock block(*t.pblock);
+    CBlock* pblock = &block;
     pblock->UpdateTime(pindexPrev);
     pblock->nNonce = 0;
 
     Array transactions;
     map<uint256, int64_t> setTxIndex;
     int i = 0;
-    CTxDB txdb("r");
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx)
     {
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
-
-        if (tx.IsCoinBase())
-            continue;
+        LOCK(mempool.cs);
+        BOOST_FOREACH (CTransaction& tx, pblock->vtx)
+        {
+            uint256 txHash = tx.GetHash();
+            setTxIndex[txHash] = i++;
 
-        Object entry;
+            if (tx.IsCoinBase())
+                continue;
 
-        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-        ssTx << tx;
-        entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
+            Object entry;
 
-        entry.push_back(Pair("hash", txHash.GetHex()));
+            CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+            ssTx << tx;
+            entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
 
-        MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
-        bool fInvalid = false;
-        if (tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
-        {
-            entry.push_back(Pair("fee", (int64_t)(tx.GetValueIn(mapInputs) - tx.GetValueOut())));
+            entry.push_back(Pair("hash", txHash.GetHex()));
 
-            Array deps;
-            BOOST_FOREACH (MapPrevTx::value_type& inp, mapInputs)
+            // Fee and sigops were worked out when the transaction entered the pool
+            const CTxMemPoolEntry* pentry = mempool.lookupEntry(txHash);
+            if (pentry && pentry->fChecked)
             {
-                if (setTxIndex.count(inp.first))
-                    deps.push_back(setTxIndex[inp.first]);
+                entry.push_back(Pair("fee", (int64_t)pentry->nFee));
+
+                Array deps;
+                set<uint256> setDeps;
+                BOOST_FOREACH (const CTxIn& txin, tx.vin)
+                {
+                    if (setTxIndex.count(txin.prevout.hash) && setDeps.insert(txin.prevout.hash).second)
+                        deps.push_back(setTxIndex[txin.prevout.hash]);
+                }
+                entry.push_back(Pair("depends", deps));
+
+                entry.push_back(Pair("sigops", (int64_t)pentry->nSigOps));
             }
-            entry.push_back(Pair("depends", deps));
 
-            int64_t nSigOps = tx.GetLegacySigOpCount();
-            nSigOps += tx.GetP2SHSigOpCount(mapInputs);
-            entry.push_back(Pair("sigops", nSigOps));
+            transactions.push_back(entry);
         }
-
-        transactions.push_back(entry);
     }
 
     Object aux;
@@ -349,6 +409,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("curtime", (int64_t)pblock->nTime));
     result.push_back(Pair("bits", HexBits(pblock->nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
+    result.push_back(Pair("longpollid", pindexPrev->GetBlockHash().GetHex() + strprintf("%u", t.nTransactionsUpdatedLast)));
 
     return result;
 }
@@ -58,6 +58,28 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("releasetime", (boost::int64_t)stats.nReleaseTime));
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
+        obj.push_back(Pair("bytessent", (boost::int64_t)stats.nSendBytes));
+        obj.push_back(Pair("bytesrecv", (boost::int64_t)stats.nRecvBytes));
+        obj.push_back(Pair("sendbufmax", (boost::int64_t)stats.nSendSizeMax));
+        if (stats.dPingTime > 0.0)
+            obj.push_back(Pair("pingtime", stats.dPingTime));
+        if (stats.dPingWait > 0.0)
+            obj.push_back(Pair("pingwait", stats.dPingWait));
+
+        Object sendPerMsg;
+        BOOST_FOREACH(const PAIRTYPE(std::string, uint64)& item, stats.mapSendBytesPerMsgCmd)
+            sendPerMsg.push_back(Pair(item.first, (boost::int64_t)item.second));
+        obj.push_back(Pair("bytessent_per_msg", sendPerMsg));
+
+        Object recvPerMsg;
+        BOOST_FOREACH(const PAIRTYPE(std::string, uint64)& item, stats.mapRecvBytesPerMsgCmd)
+            recvPerMsg.push_back(Pair(item.first, (boost::int64_t)item.second));
+        obj.push_back(Pair("bytesrecv_per_msg", recvPerMsg));
+
+        Object timePerMsg;
+        BOOST_FOREACH(const PAIRTYPE(std::string, uint64)& item, stats.mapRecvUsecPerMsgCmd)
+            timePerMsg.push_back(Pair(item.first, ((double)item.second) / 1e6));
+        obj.push_back(Pair("processtime_per_msg", timePerMsg));
 
         ret.push_back(obj);
     }
@@ -65,3 +87,18 @@ Value getpeerinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getnettotals(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnettotals\n"
+            "Returns information about network traffic, including bytes in, bytes out,\n"
+            "and current time.");
+
+    Object obj;
+    obj.push_back(Pair("totalbytesrecv", (boost::int64_t)CNode::GetTotalBytesRecv()));
+    obj.push_back(Pair("totalbytessent", (boost::int64_t)CNode::GetTotalBytesSent()));
+    obj.push_back(Pair("timemillis", (boost::int64_t)GetTimeMillis()));
+    return obj;
+}
+
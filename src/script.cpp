@@ -5,6 +5,8 @@
 #include <boost/foreach.hpp>
 #include <boost/tuple/tuple.hpp>
 
+#include <openssl/sha.h>
+
 using namespace std;
 using namespace boost;
 
@@ -12,11 +14,12 @@ using namespace boost;
 #include "keystore.h"
 #include "bignum.h"
 #include "key.h"
+#include "secp256k1.h"
 #include "main.h"
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool CheckSig(const vector<unsigned char>& vchSig, const vector<unsigned char>& vchPubKey, const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 
 
 
@@ -901,7 +904,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     else if (opcode == OP_SHA1)
                         SHA1(&vch[0], vch.size(), &vchHash[0]);
                     else if (opcode == OP_SHA256)
-                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                        CSHA256().Write(vch.empty() ? NULL : &vch[0], vch.size()).Finalize(&vchHash[0]);
                     else if (opcode == OP_HASH160)
                     {
                         uint160 hash160 = Hash160(vch);
@@ -1180,27 +1183,109 @@ public:
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
+// Parsed public key cache, so keys that sign over and over (busy wallets,
+// pool payouts, multisig cosigners) are only decoded once.  Least recently
+// used entries are evicted first.
+
+class CPubKeyCache
+{
+private:
+    typedef std::list<std::pair<std::vector<unsigned char>, Secp256k1::CPoint> > list_type;
+    list_type listLRU; // most recently used first
+    std::map<std::vector<unsigned char>, list_type::iterator> mapEntries;
+    CCriticalSection cs_pubkeycache;
+
+public:
+    bool Get(const std::vector<unsigned char>& vchPubKey, Secp256k1::CPoint& pointRet)
+    {
+        LOCK(cs_pubkeycache);
+
+        std::map<std::vector<unsigned char>, list_type::iterator>::iterator mi = mapEntries.find(vchPubKey);
+        if (mi == mapEntries.end())
+            return false;
+        listLRU.splice(listLRU.begin(), listLRU, mi->second);
+        pointRet = mi->second->second;
+        return true;
+    }
+
+    void Set(const std::vector<unsigned char>& vchPubKey, const Secp256k1::CPoint& point)
+    {
+        // ~250 bytes per entry with container overhead
+        int64 nMaxCacheSize = GetArg("-maxpubkeycachesize", 20000);
+        if (nMaxCacheSize <= 0) return;
+
+        LOCK(cs_pubkeycache);
+
+        if (mapEntries.count(vchPubKey))
+            return;
+        listLRU.push_front(std::make_pair(vchPubKey, point));
+        mapEntries[vchPubKey] = listLRU.begin();
+        while (static_cast<int64>(mapEntries.size()) > nMaxCacheSize)
+        {
+            mapEntries.erase(listLRU.back().first);
+            listLRU.pop_back();
+        }
+    }
+};
+
+bool CheckSig(const vector<unsigned char>& vchSigIn, const vector<unsigned char>& vchPubKey, const CScript& scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
     static CSignatureCache signatureCache;
+    static CPubKeyCache pubkeyCache;
 
     // Hash type is one byte tacked on to the end of the signature
-    if (vchSig.empty())
+    if (vchSigIn.empty())
         return false;
     if (nHashType == 0)
-        nHashType = vchSig.back();
-    else if (nHashType != vchSig.back())
+        nHashType = vchSigIn.back();
+    else if (nHashType != vchSigIn.back())
         return false;
-    vchSig.pop_back();
+    vector<unsigned char> vchSig(vchSigIn.begin(), vchSigIn.end() - 1);
 
     uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
 
     if (signatureCache.Get(sighash, vchSig, vchPubKey))
         return true;
 
+    // Decompressing a public key costs a field square root with either
+    // engine, so both take the parsed point from the cache
+    Secp256k1::CPoint pubkey;
+    bool fParsed = pubkeyCache.Get(vchPubKey, pubkey);
+    if (!fParsed && vchPubKey.size() == 33 && Secp256k1::ParsePubKey(vchPubKey, pubkey))
+    {
+        pubkeyCache.Set(vchPubKey, pubkey);
+        fParsed = true;
+    }
+
+    if (GetECVerifyEngine() == ECVERIFY_SECP256K1)
+    {
+        // Skips building an OpenSSL key; unusual encodings still go through CKey
+        if (!fParsed && Secp256k1::ParsePubKey(vchPubKey, pubkey))
+        {
+            pubkeyCache.Set(vchPubKey, pubkey);
+            fParsed = true;
+        }
+        int nResult = fParsed ? Secp256k1::Verify(pubkey, sighash, vchSig) : -1;
+        if (nResult == 0)
+            return false;
+        if (nResult == 1)
+        {
+            signatureCache.Set(sighash, vchSig, vchPubKey);
+            return true;
+        }
+    }
+
+    // OpenSSL decodes an uncompressed key without the square root
     CKey key;
-    if (!key.SetPubKey(vchPubKey))
+    if (fParsed)
+    {
+        vector<unsigned char> vchUncompressed;
+        Secp256k1::GetPubKey(pubkey, vchUncompressed);
+        if (!key.SetPubKey(vchUncompressed))
+            return false;
+    }
+    else if (!key.SetPubKey(vchPubKey))
         return false;
 
     if (!key.Verify(sighash, vchSig))
@@ -1571,8 +1656,270 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
     return true;
 }
 
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  bool fValidatePayToScriptHash, int nHashType)
+//
+// Template-matched verification of standard scripts.
+//
+// Nearly every input spends one of the templates Solver() knows about, so
+// VerifyScript tries these first: the scripts are matched in place and the
+// signatures are checked directly, without running the EvalScript stack
+// machine.  Anything that doesn't fit exactly is left to the interpreter.
+//
+typedef pair<CScript::const_iterator, CScript::const_iterator> valrange;
+
+// Largest standard multisig scriptSig: OP_0, 16 signatures and a serialized script
+static const int MAX_TEMPLATE_PUSHES = 18;
+
+// GetOp() that locates push data inside the script instead of copying it out
+static bool GetOpRange(const CScript& script, CScript::const_iterator& pc, opcodetype& opcodeRet, valrange& dataRet)
+{
+    CScript::const_iterator pcOp = pc;
+    if (!script.GetOp(pc, opcodeRet))
+        return false;
+    if (opcodeRet < OP_PUSHDATA1)
+        dataRet.first = pcOp + 1;
+    else if (opcodeRet == OP_PUSHDATA1)
+        dataRet.first = pcOp + 2;
+    else if (opcodeRet == OP_PUSHDATA2)
+        dataRet.first = pcOp + 3;
+    else if (opcodeRet == OP_PUSHDATA4)
+        dataRet.first = pcOp + 5;
+    else
+        dataRet.first = pc;
+    dataRet.second = pc;
+    return true;
+}
+
+static inline bool IsTemplatePubKey(const valrange& vch)
+{
+    // Same size bounds Solver() uses for OP_PUBKEY/OP_PUBKEYS
+    return vch.second - vch.first >= 33 && vch.second - vch.first <= 120;
+}
+
+// True if scriptCode.FindAndDelete(CScript(vch)) would change scriptCode
+static bool ContainsPush(const CScript& scriptCode, const valrange& vch)
+{
+    unsigned int nSize = vch.second - vch.first;
+    unsigned char pchHeader[5];
+    unsigned int nHeader;
+    if (nSize < OP_PUSHDATA1)
+    {
+        pchHeader[0] = nSize;
+        nHeader = 1;
+    }
+    else if (nSize <= 0xff)
+    {
+        pchHeader[0] = OP_PUSHDATA1;
+        pchHeader[1] = nSize;
+        nHeader = 2;
+    }
+    else if (nSize <= 0xffff)
+    {
+        pchHeader[0] = OP_PUSHDATA2;
+        unsigned short nShort = nSize;
+        memcpy(&pchHeader[1], &nShort, 2);
+        nHeader = 3;
+    }
+    else
+    {
+        pchHeader[0] = OP_PUSHDATA4;
+        memcpy(&pchHeader[1], &nSize, 4);
+        nHeader = 5;
+    }
+
+    CScript::const_iterator pc = scriptCode.begin();
+    opcodetype opcode;
+    do
+    {
+        if ((unsigned int)(scriptCode.end() - pc) >= nHeader + nSize &&
+            memcmp(&pc[0], pchHeader, nHeader) == 0 &&
+            equal(vch.first, vch.second, pc + nHeader))
+            return true;
+    }
+    while (scriptCode.GetOp(pc, opcode));
+    return false;
+}
+
+static bool CheckSig(const valrange& sig, const valrange& pubkey, const CScript& scriptCode,
+                     const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    return CheckSig(valtype(sig.first, sig.second), valtype(pubkey.first, pubkey.second), scriptCode, txTo, nIn, nHashType);
+}
+
+// In-place counterpart of Solver() for TX_PUBKEY, TX_PUBKEYHASH and TX_MULTISIG.
+// vSolutionsRet gets the pubkey, the pubkey hash or the multisig pubkeys.
+static txnouttype MatchTemplate(const CScript& script, valrange* vSolutionsRet, int& nSolutionsRet, int& nRequiredRet)
+{
+    CScript::const_iterator pc = script.begin();
+    opcodetype opcode;
+    valrange vch;
+    nSolutionsRet = 0;
+    nRequiredRet = 0;
+    if (!GetOpRange(script, pc, opcode, vch))
+        return TX_NONSTANDARD;
+
+    if (opcode == OP_DUP)
+    {
+        // OP_DUP OP_HASH160 <pubkeyhash> OP_EQUALVERIFY OP_CHECKSIG
+        if (!GetOpRange(script, pc, opcode, vch) || opcode != OP_HASH160)
+            return TX_NONSTANDARD;
+        if (!GetOpRange(script, pc, opcode, vch) || opcode > OP_PUSHDATA4 || vch.second - vch.first != sizeof(uint160))
+            return TX_NONSTANDARD;
+        vSolutionsRet[nSolutionsRet++] = vch;
+        if (!GetOpRange(script, pc, opcode, vch) || opcode != OP_EQUALVERIFY)
+            return TX_NONSTANDARD;
+        if (!GetOpRange(script, pc, opcode, vch) || opcode != OP_CHECKSIG || pc != script.end())
+            return TX_NONSTANDARD;
+        return TX_PUBKEYHASH;
+    }
+
+    if (opcode <= OP_PUSHDATA4)
+    {
+        // <pubkey> OP_CHECKSIG
+        if (!IsTemplatePubKey(vch))
+            return TX_NONSTANDARD;
+        vSolutionsRet[nSolutionsRet++] = vch;
+        if (!GetOpRange(script, pc, opcode, vch) || opcode != OP_CHECKSIG || pc != script.end())
+            return TX_NONSTANDARD;
+        return TX_PUBKEY;
+    }
+
+    if (opcode >= OP_1 && opcode <= OP_16)
+    {
+        // m <pubkey>... n OP_CHECKMULTISIG
+        nRequiredRet = CScript::DecodeOP_N(opcode);
+        loop
+        {
+            if (!GetOpRange(script, pc, opcode, vch))
+                return TX_NONSTANDARD;
+            if (opcode > OP_PUSHDATA4 || !IsTemplatePubKey(vch))
+                break;
+            if (nSolutionsRet == 16)
+                return TX_NONSTANDARD;
+            vSolutionsRet[nSolutionsRet++] = vch;
+        }
+        if (opcode < OP_1 || opcode > OP_16 || CScript::DecodeOP_N(opcode) != nSolutionsRet || nRequiredRet > nSolutionsRet)
+            return TX_NONSTANDARD;
+        if (!GetOpRange(script, pc, opcode, vch) || opcode != OP_CHECKMULTISIG || pc != script.end())
+            return TX_NONSTANDARD;
+        return TX_MULTISIG;
+    }
+
+    return TX_NONSTANDARD;
+}
+
+// Verify the pushes vStack (bottom first) against a standard scriptCode.
+// Returns false if this isn't a case the fast path handles exactly.
+static bool VerifyTemplate(const CScript& scriptCode, const valrange* vStack, int nStack,
+                           const CTransaction& txTo, unsigned int nIn, int nHashType, bool& fResultRet)
+{
+    valrange vSolutions[16];
+    int nSolutions, nRequired;
+    switch (MatchTemplate(scriptCode, vSolutions, nSolutions, nRequired))
+    {
+    case TX_PUBKEY:
+        // <sig>
+        if (nStack != 1 || ContainsPush(scriptCode, vStack[0]))
+            return false;
+        fResultRet = CheckSig(vStack[0], vSolutions[0], scriptCode, txTo, nIn, nHashType);
+        return true;
+
+    case TX_PUBKEYHASH:
+    {
+        // <sig> <pubkey>
+        if (nStack != 2)
+            return false;
+        uint160 hash = Hash160(vStack[1].first, vStack[1].second);
+        if (memcmp(&hash, &vSolutions[0].first[0], sizeof(hash)) != 0)
+        {
+            // OP_EQUALVERIFY fails
+            fResultRet = false;
+            return true;
+        }
+        if (ContainsPush(scriptCode, vStack[0]))
+            return false;
+        fResultRet = CheckSig(vStack[0], vStack[1], scriptCode, txTo, nIn, nHashType);
+        return true;
+    }
+
+    case TX_MULTISIG:
+    {
+        // OP_0 <sig>...  (the extra item is consumed by OP_CHECKMULTISIG)
+        if (nStack != nRequired + 1)
+            return false;
+        for (int i = 1; i < nStack; i++)
+            if (ContainsPush(scriptCode, vStack[i]))
+                return false;
+
+        // Same order as EvalScript: from the top of the stack down
+        int isig = nStack - 1;
+        int ikey = nSolutions - 1;
+        int nSigsCount = nRequired;
+        int nKeysCount = nSolutions;
+        bool fSuccess = true;
+        while (fSuccess && nSigsCount > 0)
+        {
+            if (CheckSig(vStack[isig], vSolutions[ikey], scriptCode, txTo, nIn, nHashType))
+            {
+                isig--;
+                nSigsCount--;
+            }
+            ikey--;
+            nKeysCount--;
+
+            if (nSigsCount > nKeysCount)
+                fSuccess = false;
+        }
+        fResultRet = fSuccess;
+        return true;
+    }
+
+    default:
+        return false;
+    }
+}
+
+bool VerifyStandardScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                          bool fValidatePayToScriptHash, int nHashType, bool& fResultRet)
+{
+    if (scriptSig.size() > 10000)
+        return false;
+
+    // scriptSig must be nothing but data pushes
+    valrange vStack[MAX_TEMPLATE_PUSHES];
+    int nStack = 0;
+    CScript::const_iterator pc = scriptSig.begin();
+    while (pc < scriptSig.end())
+    {
+        opcodetype opcode;
+        valrange vch;
+        if (nStack == MAX_TEMPLATE_PUSHES || !GetOpRange(scriptSig, pc, opcode, vch))
+            return false;
+        if (opcode > OP_PUSHDATA4 || vch.second - vch.first > 520)
+            return false;
+        vStack[nStack++] = vch;
+    }
+
+    if (scriptPubKey.IsPayToScriptHash())
+    {
+        if (!fValidatePayToScriptHash || nStack == 0)
+            return false;
+        const valrange& vchSerialized = vStack[nStack-1];
+        uint160 hash = Hash160(vchSerialized.first, vchSerialized.second);
+        if (memcmp(&hash, &scriptPubKey[2], sizeof(hash)) != 0)
+        {
+            // OP_EQUAL leaves false on the stack
+            fResultRet = false;
+            return true;
+        }
+        CScript subscript(vchSerialized.first, vchSerialized.second);
+        return VerifyTemplate(subscript, vStack, nStack - 1, txTo, nIn, nHashType, fResultRet);
+    }
+
+    return VerifyTemplate(scriptPubKey, vStack, nStack, txTo, nIn, nHashType, fResultRet);
+}
+
+bool VerifyScriptEval(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                      bool fValidatePayToScriptHash, int nHashType)
 {
     vector<vector<unsigned char> > stack, stackCopy;
     if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType))
@@ -1607,6 +1954,15 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
     return true;
 }
 
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                  bool fValidatePayToScriptHash, int nHashType)
+{
+    bool fResult;
+    if (VerifyStandardScript(scriptSig, scriptPubKey, txTo, nIn, fValidatePayToScriptHash, nHashType, fResult))
+        return fResult;
+    return VerifyScriptEval(scriptSig, scriptPubKey, txTo, nIn, fValidatePayToScriptHash, nHashType);
+}
+
 
 bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
 {
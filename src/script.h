@@ -595,6 +595,13 @@ bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransa
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
                   bool fValidatePayToScriptHash, int nHashType);
+// Fast path of VerifyScript for standard templates; returns false (fResultRet untouched)
+// if the scripts aren't handled, otherwise fResultRet is what VerifyScriptEval returns.
+bool VerifyStandardScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                          bool fValidatePayToScriptHash, int nHashType, bool& fResultRet);
+// VerifyScript using only the EvalScript interpreter
+bool VerifyScriptEval(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                      bool fValidatePayToScriptHash, int nHashType);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
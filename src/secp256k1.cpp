@@ -0,0 +1,905 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <string.h>
+
+#include <boost/thread/once.hpp>
+
+#include "secp256k1.h"
+#include "util.h"
+
+namespace Secp256k1
+{
+
+//
+// Multi-limb helpers, 32-bit limbs least significant first
+//
+
+static int CompareLimbs(const unsigned int* a, const unsigned int* b)
+{
+    for (int i = 7; i >= 0; i--)
+    {
+        if (a[i] < b[i])
+            return -1;
+        if (a[i] > b[i])
+            return 1;
+    }
+    return 0;
+}
+
+static unsigned int AddLimbs(unsigned int* r, const unsigned int* a, const unsigned int* b)
+{
+    uint64 c = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        c += (uint64)a[i] + b[i];
+        r[i] = (unsigned int)c;
+        c >>= 32;
+    }
+    return (unsigned int)c;
+}
+
+static unsigned int SubLimbs(unsigned int* r, const unsigned int* a, const unsigned int* b)
+{
+    int64 c = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        c += (int64)a[i] - b[i];
+        r[i] = (unsigned int)c;
+        c >>= 32;
+    }
+    return c ? 1 : 0;
+}
+
+static void MulLimbs(unsigned int* r, const unsigned int* a, int na, const unsigned int* b, int nb)
+{
+    memset(r, 0, (na + nb) * sizeof(unsigned int));
+    for (int i = 0; i < na; i++)
+    {
+        uint64 c = 0;
+        for (int j = 0; j < nb; j++)
+        {
+            c += (uint64)a[i] * b[j] + r[i + j];
+            r[i + j] = (unsigned int)c;
+            c >>= 32;
+        }
+        r[i + nb] = (unsigned int)c;
+    }
+}
+
+static void SetBytes(unsigned int* r, const unsigned char* p32)
+{
+    for (int i = 0; i < 8; i++)
+        r[i] = ((unsigned int)p32[31 - 4*i]) | ((unsigned int)p32[30 - 4*i] << 8) |
+               ((unsigned int)p32[29 - 4*i] << 16) | ((unsigned int)p32[28 - 4*i] << 24);
+}
+
+
+//
+// Field arithmetic mod p = 2^256 - 2^32 - 977
+//
+
+static const CFieldElem FIELD_P = {{ 0xFFFFFC2F, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF }};
+static const CFieldElem FIELD_BETA = {{ 0x719501EE, 0xC1396C28, 0x12F58995, 0x9CF04975, 0xAC3434E9, 0x6E64479E, 0x657C0710, 0x7AE96A2B }};
+
+static inline bool FeIsZero(const CFieldElem& a)
+{
+    return (a.n[0] | a.n[1] | a.n[2] | a.n[3] | a.n[4] | a.n[5] | a.n[6] | a.n[7]) == 0;
+}
+
+static inline bool FeEqual(const CFieldElem& a, const CFieldElem& b)
+{
+    return memcmp(a.n, b.n, sizeof(a.n)) == 0;
+}
+
+static inline void FeSetInt(CFieldElem& r, unsigned int v)
+{
+    memset(r.n, 0, sizeof(r.n));
+    r.n[0] = v;
+}
+
+static void FeGetBytes(unsigned char* p32, const CFieldElem& a)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        p32[31 - 4*i] = a.n[i];
+        p32[30 - 4*i] = a.n[i] >> 8;
+        p32[29 - 4*i] = a.n[i] >> 16;
+        p32[28 - 4*i] = a.n[i] >> 24;
+    }
+}
+
+static bool FeSetBytes(CFieldElem& r, const unsigned char* p32)
+{
+    SetBytes(r.n, p32);
+    return CompareLimbs(r.n, FIELD_P.n) < 0;
+}
+
+static void FeAdd(CFieldElem& r, const CFieldElem& a, const CFieldElem& b)
+{
+    // A carry out means the sum is at least 2^256 > p; the wrapped
+    // subtraction below then lands on the right value
+    if (AddLimbs(r.n, a.n, b.n) || CompareLimbs(r.n, FIELD_P.n) >= 0)
+        SubLimbs(r.n, r.n, FIELD_P.n);
+}
+
+static void FeSub(CFieldElem& r, const CFieldElem& a, const CFieldElem& b)
+{
+    if (SubLimbs(r.n, a.n, b.n))
+        AddLimbs(r.n, r.n, FIELD_P.n);
+}
+
+static void FeNeg(CFieldElem& r, const CFieldElem& a)
+{
+    if (FeIsZero(a))
+        r = a;
+    else
+        SubLimbs(r.n, FIELD_P.n, a.n);
+}
+
+// Reduce a 512-bit product using 2^256 == 2^32 + 977 (mod p)
+static void FeReduce(CFieldElem& r, const unsigned int* t)
+{
+    unsigned int u[8];
+    uint64 c = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        c += (uint64)t[i] + (uint64)t[8 + i] * 977;
+        if (i > 0)
+            c += t[7 + i];
+        u[i] = (unsigned int)c;
+        c >>= 32;
+    }
+    uint64 nTop = c + t[15];
+
+    // Fold the remaining bits above 2^256 once more
+    c = (uint64)u[0] + nTop * 977;
+    r.n[0] = (unsigned int)c;
+    c >>= 32;
+    c += (uint64)u[1] + nTop;
+    r.n[1] = (unsigned int)c;
+    c >>= 32;
+    for (int i = 2; i < 8; i++)
+    {
+        c += u[i];
+        r.n[i] = (unsigned int)c;
+        c >>= 32;
+    }
+    if (c)
+    {
+        // Wrapped past 2^256, so the low part is small and this cannot carry out
+        c = (uint64)r.n[0] + 977;
+        r.n[0] = (unsigned int)c;
+        c >>= 32;
+        c += (uint64)r.n[1] + 1;
+        r.n[1] = (unsigned int)c;
+        c >>= 32;
+        for (int i = 2; i < 8 && c; i++)
+        {
+            c += r.n[i];
+            r.n[i] = (unsigned int)c;
+            c >>= 32;
+        }
+    }
+    if (CompareLimbs(r.n, FIELD_P.n) >= 0)
+        SubLimbs(r.n, r.n, FIELD_P.n);
+}
+
+static void FeMul(CFieldElem& r, const CFieldElem& a, const CFieldElem& b)
+{
+    unsigned int t[16];
+    MulLimbs(t, a.n, 8, b.n, 8);
+    FeReduce(r, t);
+}
+
+static void FeSqr(CFieldElem& r, const CFieldElem& a)
+{
+    // Cross products once, doubled, then the squares on the diagonal
+    unsigned int t[16];
+    memset(t, 0, sizeof(t));
+    for (int i = 0; i < 7; i++)
+    {
+        uint64 c = 0;
+        for (int j = i + 1; j < 8; j++)
+        {
+            c += (uint64)a.n[i] * a.n[j] + t[i + j];
+            t[i + j] = (unsigned int)c;
+            c >>= 32;
+        }
+        t[i + 8] = (unsigned int)c;
+    }
+    unsigned int nCarry = 0;
+    for (int k = 0; k < 16; k++)
+    {
+        unsigned int v = t[k];
+        t[k] = (v << 1) | nCarry;
+        nCarry = v >> 31;
+    }
+    uint64 c = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        uint64 sq = (uint64)a.n[i] * a.n[i];
+        c += (uint64)t[2*i] + (unsigned int)sq;
+        t[2*i] = (unsigned int)c;
+        c >>= 32;
+        c += (uint64)t[2*i + 1] + (sq >> 32);
+        t[2*i + 1] = (unsigned int)c;
+        c >>= 32;
+    }
+    FeReduce(r, t);
+}
+
+static void FeSqrN(CFieldElem& r, const CFieldElem& a, int n)
+{
+    r = a;
+    for (int i = 0; i < n; i++)
+        FeSqr(r, r);
+}
+
+// a^(2^223 - 1) and a^(2^22 - 1), shared by the inverse and square root chains
+static void FePow223(CFieldElem& x223, CFieldElem& x22, CFieldElem& x2, const CFieldElem& a)
+{
+    CFieldElem x3, x6, x9, x11, x44, x88, x176, t;
+    FeSqr(x2, a);
+    FeMul(x2, x2, a);
+    FeSqr(x3, x2);
+    FeMul(x3, x3, a);
+    FeSqrN(x6, x3, 3);
+    FeMul(x6, x6, x3);
+    FeSqrN(x9, x6, 3);
+    FeMul(x9, x9, x3);
+    FeSqrN(x11, x9, 2);
+    FeMul(x11, x11, x2);
+    FeSqrN(x22, x11, 11);
+    FeMul(x22, x22, x11);
+    FeSqrN(x44, x22, 22);
+    FeMul(x44, x44, x22);
+    FeSqrN(x88, x44, 44);
+    FeMul(x88, x88, x44);
+    FeSqrN(x176, x88, 88);
+    FeMul(x176, x176, x88);
+    FeSqrN(t, x176, 44);
+    FeMul(t, t, x44);
+    FeSqrN(t, t, 3);
+    FeMul(x223, t, x3);
+}
+
+// r = a^(p-2)
+static void FeInv(CFieldElem& r, const CFieldElem& a)
+{
+    CFieldElem x223, x22, x2, t;
+    FePow223(x223, x22, x2, a);
+    FeSqrN(t, x223, 23);
+    FeMul(t, t, x22);
+    FeSqrN(t, t, 5);
+    FeMul(t, t, a);
+    FeSqrN(t, t, 3);
+    FeMul(t, t, x2);
+    FeSqrN(t, t, 2);
+    FeMul(r, t, a);
+}
+
+// r = a^((p+1)/4), a square root of a if one exists
+static bool FeSqrt(CFieldElem& r, const CFieldElem& a)
+{
+    CFieldElem x223, x22, x2, t, check;
+    FePow223(x223, x22, x2, a);
+    FeSqrN(t, x223, 23);
+    FeMul(t, t, x22);
+    FeSqrN(t, t, 6);
+    FeMul(t, t, x2);
+    FeSqrN(r, t, 2);
+    FeSqr(check, r);
+    return FeEqual(check, a);
+}
+
+
+//
+// Scalar arithmetic mod the group order n
+//
+
+struct CScalar
+{
+    unsigned int n[8];
+};
+
+static const CScalar ORDER_N = {{ 0xD0364141, 0xBFD25E8C, 0xAF48A03B, 0xBAAEDCE6, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF }};
+static const CScalar ORDER_HALF = {{ 0x681B20A0, 0xDFE92F46, 0x57A4501D, 0x5D576E73, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0x7FFFFFFF }};
+static const unsigned int ORDER_COMPLEMENT[5] = { 0x2FC9BEBF, 0x402DA173, 0x50B75FC4, 0x45512319, 0x00000001 };
+static const unsigned int FIELD_P_MINUS_N[8] = { 0x2FC9BAEE, 0x402DA172, 0x50B75FC4, 0x45512319, 0x00000001, 0, 0, 0 };
+
+// Endomorphism constants: lambda*(x,y) == (beta*x,y) and the lattice basis
+// used to split a scalar into two halves of about 128 bits
+static const CScalar SPLIT_G1 = {{ 0x45DBB031, 0xE893209A, 0x71E8CA7F, 0x3DAA8A14, 0x9284EB15, 0xE86C90E4, 0xA7D46BCD, 0x3086D221 }};
+static const CScalar SPLIT_G2 = {{ 0x8AC47F71, 0x1571B4AE, 0x9DF506C6, 0x221208AC, 0x0ABFE4C4, 0x6F547FA9, 0x010E8828, 0xE4437ED6 }};
+static const CScalar SPLIT_MINUS_B1 = {{ 0x0ABFE4C3, 0x6F547FA9, 0x010E8828, 0xE4437ED6, 0, 0, 0, 0 }};
+static const CScalar SPLIT_MINUS_B2 = {{ 0x3DB1562C, 0xD765CDA8, 0x0774346D, 0x8A280AC5, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF }};
+static const CScalar SPLIT_MINUS_LAMBDA = {{ 0xB51283CF, 0xE0CFC810, 0x8EC739C2, 0xA880B9FC, 0x77ED9BA4, 0x5AD9E3FD, 0x3FA3CF1F, 0xAC9C52B3 }};
+
+static inline bool ScalarIsZero(const CScalar& a)
+{
+    return (a.n[0] | a.n[1] | a.n[2] | a.n[3] | a.n[4] | a.n[5] | a.n[6] | a.n[7]) == 0;
+}
+
+static inline bool ScalarIsHigh(const CScalar& a)
+{
+    return CompareLimbs(a.n, ORDER_HALF.n) > 0;
+}
+
+// Reduce a 512-bit value using 2^256 == 2^256 - n (mod n), a 129-bit constant
+static void ScalarReduce(CScalar& r, const unsigned int* t)
+{
+    unsigned int acc[16];
+    memcpy(acc, t, sizeof(acc));
+    int nLen = 16;
+    loop
+    {
+        while (nLen > 8 && acc[nLen - 1] == 0)
+            nLen--;
+        if (nLen <= 8)
+            break;
+        int nHigh = nLen - 8;
+        unsigned int prod[13];
+        MulLimbs(prod, &acc[8], nHigh, ORDER_COMPLEMENT, 5);
+        int nProd = nHigh + 5;
+        int nNew = std::max(8, nProd);
+        uint64 c = 0;
+        for (int i = 0; i < nNew; i++)
+        {
+            c += (uint64)(i < 8 ? acc[i] : 0) + (i < nProd ? prod[i] : 0);
+            acc[i] = (unsigned int)c;
+            c >>= 32;
+        }
+        acc[nNew] = (unsigned int)c;
+        nLen = nNew + 1;
+    }
+    memcpy(r.n, acc, sizeof(r.n));
+    while (CompareLimbs(r.n, ORDER_N.n) >= 0)
+        SubLimbs(r.n, r.n, ORDER_N.n);
+}
+
+// Big-endian bytes to scalar; returns false if the value was not below n
+static bool ScalarSetBytes(CScalar& r, const unsigned char* p32)
+{
+    SetBytes(r.n, p32);
+    if (CompareLimbs(r.n, ORDER_N.n) < 0)
+        return true;
+    SubLimbs(r.n, r.n, ORDER_N.n);
+    return false;
+}
+
+static void ScalarAdd(CScalar& r, const CScalar& a, const CScalar& b)
+{
+    if (AddLimbs(r.n, a.n, b.n) || CompareLimbs(r.n, ORDER_N.n) >= 0)
+        SubLimbs(r.n, r.n, ORDER_N.n);
+}
+
+static void ScalarMul(CScalar& r, const CScalar& a, const CScalar& b)
+{
+    unsigned int t[16];
+    MulLimbs(t, a.n, 8, b.n, 8);
+    ScalarReduce(r, t);
+}
+
+static void ScalarNeg(CScalar& r, const CScalar& a)
+{
+    if (ScalarIsZero(a))
+        r = a;
+    else
+        SubLimbs(r.n, ORDER_N.n, a.n);
+}
+
+// r = a^(n-2), four bits at a time
+static void ScalarInv(CScalar& r, const CScalar& a)
+{
+    CScalar table[16];
+    memset(&table[0], 0, sizeof(table[0]));
+    table[0].n[0] = 1;
+    table[1] = a;
+    for (int i = 2; i < 16; i++)
+        ScalarMul(table[i], table[i - 1], a);
+
+    CScalar exp = ORDER_N;
+    exp.n[0] -= 2;
+    CScalar acc = table[0];
+    for (int i = 63; i >= 0; i--)
+    {
+        if (i != 63)
+            for (int j = 0; j < 4; j++)
+                ScalarMul(acc, acc, acc);
+        int nNibble = (exp.n[i / 8] >> (4 * (i % 8))) & 15;
+        if (nNibble)
+            ScalarMul(acc, acc, table[nNibble]);
+    }
+    r = acc;
+}
+
+// r = round(a * b / 2^384)
+static void ScalarMulShift384(CScalar& r, const CScalar& a, const CScalar& b)
+{
+    unsigned int t[16];
+    MulLimbs(t, a.n, 8, b.n, 8);
+    uint64 c = t[11] >> 31;
+    for (int i = 0; i < 4; i++)
+    {
+        c += t[12 + i];
+        r.n[i] = (unsigned int)c;
+        c >>= 32;
+    }
+    memset(&r.n[4], 0, 4 * sizeof(unsigned int));
+}
+
+// Find r1, r2 of about 128 bits each with k == r1 + r2*lambda (mod n)
+static void ScalarSplitLambda(CScalar& r1, CScalar& r2, const CScalar& k)
+{
+    CScalar c1, c2;
+    ScalarMulShift384(c1, k, SPLIT_G1);
+    ScalarMulShift384(c2, k, SPLIT_G2);
+    ScalarMul(c1, c1, SPLIT_MINUS_B1);
+    ScalarMul(c2, c2, SPLIT_MINUS_B2);
+    ScalarAdd(r2, c1, c2);
+    ScalarMul(r1, r2, SPLIT_MINUS_LAMBDA);
+    ScalarAdd(r1, r1, k);
+}
+
+// Width-w non-adjacent form: odd digits in (-2^(w-1), 2^(w-1)), returns length
+static int ScalarWNAF(int* pwnaf, const CScalar& a, int w, int nSign)
+{
+    unsigned int k[9];
+    memcpy(k, a.n, sizeof(a.n));
+    k[8] = 0;
+    int nLen = 0;
+    for (int i = 0; ; i++)
+    {
+        bool fZero = true;
+        for (int j = 0; j < 9; j++)
+            if (k[j])
+                fZero = false;
+        if (fZero)
+            break;
+
+        int nDigit = 0;
+        if (k[0] & 1)
+        {
+            nDigit = k[0] & ((1 << w) - 1);
+            if (nDigit >= (1 << (w - 1)))
+                nDigit -= (1 << w);
+            // k -= nDigit
+            int64 c = -(int64)nDigit;
+            for (int j = 0; j < 9 && c; j++)
+            {
+                c += k[j];
+                k[j] = (unsigned int)c;
+                c >>= 32;
+            }
+        }
+        pwnaf[i] = nDigit * nSign;
+        nLen = i + 1;
+
+        for (int j = 0; j < 8; j++)
+            k[j] = (k[j] >> 1) | (k[j + 1] << 31);
+        k[8] >>= 1;
+    }
+    return nLen;
+}
+
+
+//
+// Group operations in Jacobian coordinates (X/Z^2, Y/Z^3)
+//
+
+struct CPointJ
+{
+    CFieldElem x, y, z;
+    bool fInfinity;
+};
+
+static const CPoint GENERATOR =
+{
+    {{ 0x16F81798, 0x59F2815B, 0x2DCE28D9, 0x029BFCDB, 0xCE870B07, 0x55A06295, 0xF9DCBBAC, 0x79BE667E }},
+    {{ 0xFB10D4B8, 0x9C47D08F, 0xA6855419, 0xFD17B448, 0x0E1108A8, 0x5DA4FBFC, 0x26A3C465, 0x483ADA77 }}
+};
+
+static void GejSetAffine(CPointJ& r, const CPoint& a)
+{
+    r.x = a.x;
+    r.y = a.y;
+    FeSetInt(r.z, 1);
+    r.fInfinity = false;
+}
+
+static void GejSetInfinity(CPointJ& r)
+{
+    memset(&r, 0, sizeof(r));
+    r.fInfinity = true;
+}
+
+static void GejToAffine(CPoint& r, const CPointJ& a)
+{
+    CFieldElem zinv, zinv2, zinv3;
+    FeInv(zinv, a.z);
+    FeSqr(zinv2, zinv);
+    FeMul(zinv3, zinv2, zinv);
+    FeMul(r.x, a.x, zinv2);
+    FeMul(r.y, a.y, zinv3);
+}
+
+static void GejDouble(CPointJ& r, const CPointJ& a)
+{
+    // dbl-2009-l, valid because the curve has a = 0 and no point of order 2
+    if (a.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    CFieldElem A, B, C, D, E, F, t;
+    FeSqr(A, a.x);
+    FeSqr(B, a.y);
+    FeSqr(C, B);
+    FeAdd(t, a.x, B);
+    FeSqr(t, t);
+    FeSub(t, t, A);
+    FeSub(t, t, C);
+    FeAdd(D, t, t);
+    FeAdd(E, A, A);
+    FeAdd(E, E, A);
+    FeSqr(F, E);
+
+    FeMul(t, a.y, a.z);
+    FeAdd(r.z, t, t);
+    FeSub(r.x, F, D);
+    FeSub(r.x, r.x, D);
+    FeSub(t, D, r.x);
+    FeMul(t, E, t);
+    FeAdd(C, C, C);
+    FeAdd(C, C, C);
+    FeAdd(C, C, C);
+    FeSub(r.y, t, C);
+    r.fInfinity = false;
+}
+
+// r = a + b with b affine (madd-2007-bl)
+static void GejAddAffine(CPointJ& r, const CPointJ& a, const CPoint& b)
+{
+    if (a.fInfinity)
+    {
+        GejSetAffine(r, b);
+        return;
+    }
+    CFieldElem z1z1, u2, s2, h, hh, i, j, rr, v, t;
+    FeSqr(z1z1, a.z);
+    FeMul(u2, b.x, z1z1);
+    FeMul(s2, b.y, a.z);
+    FeMul(s2, s2, z1z1);
+    FeSub(h, u2, a.x);
+    FeSub(rr, s2, a.y);
+    if (FeIsZero(h))
+    {
+        if (FeIsZero(rr))
+            GejDouble(r, a);
+        else
+            GejSetInfinity(r);
+        return;
+    }
+    FeAdd(rr, rr, rr);
+    FeSqr(hh, h);
+    FeAdd(i, hh, hh);
+    FeAdd(i, i, i);
+    FeMul(j, h, i);
+    FeMul(v, a.x, i);
+
+    FeMul(t, a.z, h);
+    FeAdd(r.z, t, t);
+    FeMul(t, a.y, j);
+    FeAdd(t, t, t);
+    FeSqr(r.x, rr);
+    FeSub(r.x, r.x, j);
+    FeSub(r.x, r.x, v);
+    FeSub(r.x, r.x, v);
+    FeSub(v, v, r.x);
+    FeMul(v, rr, v);
+    FeSub(r.y, v, t);
+    r.fInfinity = false;
+}
+
+// r = a + b (add-2007-bl)
+static void GejAdd(CPointJ& r, const CPointJ& a, const CPointJ& b)
+{
+    if (a.fInfinity)
+    {
+        r = b;
+        return;
+    }
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    CFieldElem z1z1, z2z2, u1, u2, s1, s2, h, i, j, rr, v, t;
+    FeSqr(z1z1, a.z);
+    FeSqr(z2z2, b.z);
+    FeMul(u1, a.x, z2z2);
+    FeMul(u2, b.x, z1z1);
+    FeMul(s1, a.y, b.z);
+    FeMul(s1, s1, z2z2);
+    FeMul(s2, b.y, a.z);
+    FeMul(s2, s2, z1z1);
+    FeSub(h, u2, u1);
+    FeSub(rr, s2, s1);
+    if (FeIsZero(h))
+    {
+        if (FeIsZero(rr))
+            GejDouble(r, a);
+        else
+            GejSetInfinity(r);
+        return;
+    }
+    FeAdd(rr, rr, rr);
+    FeAdd(i, h, h);
+    FeSqr(i, i);
+    FeMul(j, h, i);
+    FeMul(v, u1, i);
+
+    FeMul(t, a.z, b.z);
+    FeAdd(t, t, t);
+    FeMul(r.z, t, h);
+    FeMul(s1, s1, j);
+    FeAdd(s1, s1, s1);
+    FeSqr(r.x, rr);
+    FeSub(r.x, r.x, j);
+    FeSub(r.x, r.x, v);
+    FeSub(r.x, r.x, v);
+    FeSub(v, v, r.x);
+    FeMul(v, rr, v);
+    FeSub(r.y, v, s1);
+    r.fInfinity = false;
+}
+
+static void GejNeg(CPointJ& r, const CPointJ& a)
+{
+    r = a;
+    FeNeg(r.y, a.y);
+}
+
+
+//
+// Generator multiplication: table of j * 16^i * G, one window of four bits
+// per row, so u*G costs at most 64 mixed additions and no doublings
+//
+
+static CPoint gtable[64][15];
+static boost::once_flag gtableInit = BOOST_ONCE_INIT;
+
+static void BuildGeneratorTable()
+{
+    CPointJ base;
+    GejSetAffine(base, GENERATOR);
+    for (int i = 0; i < 64; i++)
+    {
+        CPoint baseAffine;
+        GejToAffine(baseAffine, base);
+        CPointJ acc = base;
+        gtable[i][0] = baseAffine;
+        for (int j = 1; j < 15; j++)
+        {
+            GejAddAffine(acc, acc, baseAffine);
+            GejToAffine(gtable[i][j], acc);
+        }
+        GejAddAffine(base, acc, baseAffine);
+    }
+}
+
+static void EcMultGen(CPointJ& r, const CScalar& u)
+{
+    boost::call_once(gtableInit, BuildGeneratorTable);
+    GejSetInfinity(r);
+    for (int i = 0; i < 64; i++)
+    {
+        int nNibble = (u.n[i / 8] >> (4 * (i % 8))) & 15;
+        if (nNibble)
+            GejAddAffine(r, r, gtable[i][nNibble - 1]);
+    }
+}
+
+// r = u1*G + u2*Q
+static void EcMult(CPointJ& r, const CScalar& u1, const CScalar& u2, const CPoint& q)
+{
+    static const int WINDOW = 5;
+    static const int TABLE_SIZE = 1 << (WINDOW - 2);
+
+    // Odd multiples Q, 3Q, ... 15Q and their images under the endomorphism
+    CPointJ pre[TABLE_SIZE], preLambda[TABLE_SIZE], q2;
+    GejSetAffine(pre[0], q);
+    GejDouble(q2, pre[0]);
+    for (int i = 1; i < TABLE_SIZE; i++)
+        GejAdd(pre[i], pre[i - 1], q2);
+    for (int i = 0; i < TABLE_SIZE; i++)
+    {
+        preLambda[i] = pre[i];
+        FeMul(preLambda[i].x, pre[i].x, FIELD_BETA);
+    }
+
+    CScalar r1, r2;
+    ScalarSplitLambda(r1, r2, u2);
+    int nSign1 = 1, nSign2 = 1;
+    if (ScalarIsHigh(r1))
+    {
+        ScalarNeg(r1, r1);
+        nSign1 = -1;
+    }
+    if (ScalarIsHigh(r2))
+    {
+        ScalarNeg(r2, r2);
+        nSign2 = -1;
+    }
+    int wnaf1[257], wnaf2[257];
+    int nLen1 = ScalarWNAF(wnaf1, r1, WINDOW, nSign1);
+    int nLen2 = ScalarWNAF(wnaf2, r2, WINDOW, nSign2);
+
+    GejSetInfinity(r);
+    CPointJ t;
+    for (int i = std::max(nLen1, nLen2) - 1; i >= 0; i--)
+    {
+        GejDouble(r, r);
+        if (i < nLen1 && wnaf1[i])
+        {
+            if (wnaf1[i] > 0)
+                GejAdd(r, r, pre[(wnaf1[i] - 1) / 2]);
+            else
+            {
+                GejNeg(t, pre[(-wnaf1[i] - 1) / 2]);
+                GejAdd(r, r, t);
+            }
+        }
+        if (i < nLen2 && wnaf2[i])
+        {
+            if (wnaf2[i] > 0)
+                GejAdd(r, r, preLambda[(wnaf2[i] - 1) / 2]);
+            else
+            {
+                GejNeg(t, preLambda[(-wnaf2[i] - 1) / 2]);
+                GejAdd(r, r, t);
+            }
+        }
+    }
+
+    CPointJ g;
+    EcMultGen(g, u1);
+    GejAdd(r, r, g);
+}
+
+
+//
+// Encodings
+//
+
+static bool IsOnCurve(const CPoint& p)
+{
+    CFieldElem y2, x3, seven;
+    FeSqr(y2, p.y);
+    FeSqr(x3, p.x);
+    FeMul(x3, x3, p.x);
+    FeSetInt(seven, 7);
+    FeAdd(x3, x3, seven);
+    return FeEqual(y2, x3);
+}
+
+bool ParsePubKey(const std::vector<unsigned char>& vchPubKey, CPoint& pointRet)
+{
+    if (vchPubKey.size() == 33 && (vchPubKey[0] == 0x02 || vchPubKey[0] == 0x03))
+    {
+        if (!FeSetBytes(pointRet.x, &vchPubKey[1]))
+            return false;
+        CFieldElem rhs, seven;
+        FeSqr(rhs, pointRet.x);
+        FeMul(rhs, rhs, pointRet.x);
+        FeSetInt(seven, 7);
+        FeAdd(rhs, rhs, seven);
+        if (!FeSqrt(pointRet.y, rhs))
+            return false;
+        if ((pointRet.y.n[0] & 1) != (vchPubKey[0] & 1))
+            FeNeg(pointRet.y, pointRet.y);
+        return true;
+    }
+    if (vchPubKey.size() == 65 && vchPubKey[0] == 0x04)
+    {
+        if (!FeSetBytes(pointRet.x, &vchPubKey[1]) || !FeSetBytes(pointRet.y, &vchPubKey[33]))
+            return false;
+        return IsOnCurve(pointRet);
+    }
+    return false;
+}
+
+void GetPubKey(const CPoint& point, std::vector<unsigned char>& vchPubKeyRet)
+{
+    vchPubKeyRet.resize(65);
+    vchPubKeyRet[0] = 0x04;
+    FeGetBytes(&vchPubKeyRet[1], point.x);
+    FeGetBytes(&vchPubKeyRet[33], point.y);
+}
+
+// Copy one minimally encoded, non-negative DER INTEGER right aligned into p32
+static bool ParseDERInteger(const unsigned char* p, unsigned int nLen, unsigned char* p32)
+{
+    if (nLen == 0 || nLen > 33)
+        return false;
+    if (p[0] & 0x80)
+        return false;
+    if (nLen > 1 && p[0] == 0x00 && !(p[1] & 0x80))
+        return false;
+    if (nLen == 33)
+    {
+        if (p[0] != 0x00)
+            return false;
+        p++;
+        nLen--;
+    }
+    memset(p32, 0, 32);
+    memcpy(p32 + 32 - nLen, p, nLen);
+    return true;
+}
+
+// Strict DER: 0x30 [total-length] 0x02 [R-length] [R] 0x02 [S-length] [S]
+static bool ParseDERSignature(const std::vector<unsigned char>& vchSig, unsigned char* pr32, unsigned char* ps32)
+{
+    unsigned int nSize = vchSig.size();
+    if (nSize < 8 || nSize > 72)
+        return false;
+    if (vchSig[0] != 0x30 || vchSig[1] != nSize - 2)
+        return false;
+    if (vchSig[2] != 0x02)
+        return false;
+    unsigned int nLenR = vchSig[3];
+    if (5 + nLenR >= nSize)
+        return false;
+    if (vchSig[4 + nLenR] != 0x02)
+        return false;
+    unsigned int nLenS = vchSig[5 + nLenR];
+    if (6 + nLenR + nLenS != nSize)
+        return false;
+    return ParseDERInteger(&vchSig[4], nLenR, pr32) &&
+           ParseDERInteger(&vchSig[6 + nLenR], nLenS, ps32);
+}
+
+int Verify(const CPoint& pubkey, const uint256& hash, const std::vector<unsigned char>& vchSig)
+{
+    unsigned char pr[32], ps[32];
+    if (!ParseDERSignature(vchSig, pr, ps))
+        return -1;
+
+    CScalar r, s, z;
+    if (!ScalarSetBytes(r, pr) || !ScalarSetBytes(s, ps) || ScalarIsZero(r) || ScalarIsZero(s))
+        return 0;
+    // Same byte order OpenSSL sees when handed (unsigned char*)&hash
+    ScalarSetBytes(z, (const unsigned char*)&hash);
+
+    CScalar sinv, u1, u2;
+    ScalarInv(sinv, s);
+    ScalarMul(u1, z, sinv);
+    ScalarMul(u2, r, sinv);
+
+    CPointJ R;
+    EcMult(R, u1, u2, pubkey);
+    if (R.fInfinity)
+        return 0;
+
+    // Check R.x mod n == r without leaving Jacobian coordinates: r < n < p,
+    // and R.x may also be r + n when that is still below p
+    CFieldElem zz, xr, fr;
+    FeSqr(zz, R.z);
+    memcpy(fr.n, r.n, sizeof(fr.n));
+    FeMul(xr, fr, zz);
+    if (FeEqual(xr, R.x))
+        return 1;
+    if (CompareLimbs(r.n, FIELD_P_MINUS_N) < 0)
+    {
+        AddLimbs(fr.n, r.n, ORDER_N.n);
+        FeMul(xr, fr, zz);
+        if (FeEqual(xr, R.x))
+            return 1;
+    }
+    return 0;
+}
+
+}
@@ -0,0 +1,47 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SECP256K1_H
+#define BITCOIN_SECP256K1_H
+
+#include <vector>
+
+#include "uint256.h"
+
+/** In-tree ECDSA verification over secp256k1.
+ *
+ * Specialized to the one curve bitcoin uses: fixed-size limb arithmetic with
+ * the fast modular reduction p = 2^256 - 2^32 - 977 allows, a precomputed
+ * table of generator multiples, and the GLV endomorphism to halve the
+ * doublings needed for the public key multiplication.  Only strictly DER
+ * encoded signatures and standard public key encodings are handled; anything
+ * else is left to OpenSSL so the two engines can never disagree.
+ */
+namespace Secp256k1
+{
+    // Field element mod p, eight 32-bit limbs least significant first, fully reduced
+    struct CFieldElem
+    {
+        unsigned int n[8];
+    };
+
+    // Affine point on the curve
+    struct CPoint
+    {
+        CFieldElem x, y;
+    };
+
+    // Decode a 33-byte compressed or 65-byte uncompressed public key.
+    // Returns false for anything else, including points not on the curve.
+    bool ParsePubKey(const std::vector<unsigned char>& vchPubKey, CPoint& pointRet);
+
+    // Encode a point as a 65-byte uncompressed public key
+    void GetPubKey(const CPoint& point, std::vector<unsigned char>& vchPubKeyRet);
+
+    // Verify an ECDSA signature of hash against a parsed public key.
+    // Returns 1 if valid, 0 if invalid, or -1 if the signature is not
+    // strict DER and the caller should fall back to OpenSSL.
+    int Verify(const CPoint& pubkey, const uint256& hash, const std::vector<unsigned char>& vchSig);
+}
+
+#endif
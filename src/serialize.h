@@ -707,10 +707,12 @@ struct ser_streamplaceholder
  * >> and << read and write unformatted data using the above serialization templates.
  * Fills with data in linear time; some stringstream implementations take N^2 time.
  */
+typedef std::vector<char, zero_after_free_allocator<char> > CSerializeData;
+
 class CDataStream
 {
 protected:
-    typedef std::vector<char, zero_after_free_allocator<char> > vector_type;
+    typedef CSerializeData vector_type;
     vector_type vch;
     unsigned int nReadPos;
     short state;
@@ -803,6 +805,15 @@ public:
     const_reference operator[](size_type pos) const  { return vch[pos + nReadPos]; }
     reference operator[](size_type pos)              { return vch[pos + nReadPos]; }
     void clear()                                     { vch.clear(); nReadPos = 0; }
+
+    // Hand the unread contents over to data without copying them
+    void GetAndClear(CSerializeData& data)
+    {
+        if (nReadPos > 0)
+            vch.erase(vch.begin(), vch.begin() + nReadPos);
+        vch.swap(data);
+        clear();
+    }
     iterator insert(iterator it, const char& x=char()) { return vch.insert(it, x); }
     void insert(iterator it, size_type n, const char& x) { vch.insert(it, n, x); }
 
@@ -0,0 +1,649 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <string.h>
+#include <vector>
+
+#include <boost/thread/once.hpp>
+
+#include "sha256.h"
+#include "util.h"
+
+#if defined(USE_SHA256_X86)
+#include <cpuid.h>
+
+// sha256_sse41.cpp and sha256_avx2.cpp, built with the matching instruction set flags.
+// pstate holds one 8-word state per lane; ppblock one 64-byte block per lane.
+void SHA256Transform4_SSE41(unsigned int* pstate, const unsigned char* const* ppblock);
+void SHA256Transform8_AVX2(unsigned int* pstate, const unsigned char* const* ppblock);
+unsigned int SHA256ScanNonces4_SSE41(const unsigned int* pmidstate, const unsigned int* ppre, const unsigned int* pw, unsigned int nNonce, unsigned int nTargetHigh);
+unsigned int SHA256ScanNonces8_AVX2(const unsigned int* pmidstate, const unsigned int* ppre, const unsigned int* pw, unsigned int nNonce, unsigned int nTargetHigh);
+
+// sha256_shani.cpp: nBlocks consecutive blocks of one message
+void SHA256Transform_SHANI(unsigned int* s, const unsigned char* pblock, size_t nBlocks);
+#endif
+
+static const unsigned int SHA256_INIT[8] =
+{
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const unsigned int SHA256_K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// Padding for the fixed size messages of double hashing: the second block
+// of a 64-byte message, the 32 bytes after a 32-byte one, and the 48 after
+// the last 16 bytes of an 80-byte block header
+static const unsigned char PAD_64[64] = { 0x80, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+                                          0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x02,0 };
+static const unsigned char PAD_32[32] = { 0x80, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x01,0 };
+static const unsigned char PAD_80[48] = { 0x80, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+                                          0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x02,0x80 };
+
+static inline unsigned int ReadBE32(const unsigned char* p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+static inline void WriteBE32(unsigned char* p, unsigned int x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+static inline unsigned int Rotr(unsigned int x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+// Portable single block transform
+static void SHA256TransformGeneric(unsigned int* s, const unsigned char* pblock)
+{
+    unsigned int w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = ReadBE32(pblock + 4*i);
+    for (int i = 16; i < 64; i++)
+    {
+        unsigned int s0 = Rotr(w[i-15], 7) ^ Rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+        unsigned int s1 = Rotr(w[i-2], 17) ^ Rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    unsigned int a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++)
+    {
+        unsigned int t1 = h + (Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25)) + (g ^ (e & (f ^ g))) + SHA256_K[i] + w[i];
+        unsigned int t2 = (Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22)) + ((a & b) | (c & (a | b)));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+    s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+}
+
+// One round on the state words v = a..h
+static inline void RoundGeneric(unsigned int* v, unsigned int kw)
+{
+    unsigned int t1 = v[7] + (Rotr(v[4], 6) ^ Rotr(v[4], 11) ^ Rotr(v[4], 25)) + (v[6] ^ (v[4] & (v[5] ^ v[6]))) + kw;
+    unsigned int t2 = (Rotr(v[0], 2) ^ Rotr(v[0], 13) ^ Rotr(v[0], 22)) + ((v[0] & v[1]) | (v[2] & (v[0] | v[1])));
+    v[7] = v[6];
+    v[6] = v[5];
+    v[5] = v[4];
+    v[4] = v[3] + t1;
+    v[3] = v[2];
+    v[2] = v[1];
+    v[1] = v[0];
+    v[0] = t1 + t2;
+}
+
+static void SHA256Transform_Generic(unsigned int* s, const unsigned char* pblock, size_t nBlocks)
+{
+    for (; nBlocks > 0; nBlocks--, pblock += 64)
+        SHA256TransformGeneric(s, pblock);
+}
+
+static void SHA256Transform1_Generic(unsigned int* pstate, const unsigned char* const* ppblock)
+{
+    SHA256TransformGeneric(pstate, ppblock[0]);
+}
+
+#if defined(USE_SHA256_X86)
+static void SHA256Transform1_SHANI(unsigned int* pstate, const unsigned char* const* ppblock)
+{
+    SHA256Transform_SHANI(pstate, ppblock[0], 1);
+}
+#endif
+
+// Miner nonce scan of one nonce, with the arguments of the SIMD versions in
+// sha256_sse41.cpp: the rounds not depending on the nonce start from ppre,
+// and the second hash stops once its last state word is known
+static unsigned int SHA256ScanNonces1_Generic(const unsigned int* pmidstate, const unsigned int* ppre, const unsigned int* pw, unsigned int nNonce, unsigned int nTargetHigh)
+{
+    unsigned int w[64], v[8];
+    w[0] = pw[0];
+    w[1] = pw[1];
+    w[2] = pw[2];
+    w[3] = ByteReverse(nNonce);
+    w[4] = 0x80000000;
+    for (int i = 5; i < 15; i++)
+        w[i] = 0;
+    w[15] = 640;
+    for (int i = 16; i < 64; i++)
+        w[i] = w[i-16] + (Rotr(w[i-15], 7) ^ Rotr(w[i-15], 18) ^ (w[i-15] >> 3)) + w[i-7] + (Rotr(w[i-2], 17) ^ Rotr(w[i-2], 19) ^ (w[i-2] >> 10));
+    memcpy(v, ppre, sizeof(v));
+    for (int i = 3; i < 64; i++)
+        RoundGeneric(v, SHA256_K[i] + w[i]);
+
+    for (int i = 0; i < 8; i++)
+        w[i] = pmidstate[i] + v[i];
+    w[8] = 0x80000000;
+    for (int i = 9; i < 15; i++)
+        w[i] = 0;
+    w[15] = 256;
+    for (int i = 16; i < 61; i++)
+        w[i] = w[i-16] + (Rotr(w[i-15], 7) ^ Rotr(w[i-15], 18) ^ (w[i-15] >> 3)) + w[i-7] + (Rotr(w[i-2], 17) ^ Rotr(w[i-2], 19) ^ (w[i-2] >> 10));
+    memcpy(v, SHA256_INIT, sizeof(v));
+    for (int i = 0; i < 61; i++)
+        RoundGeneric(v, SHA256_K[i] + w[i]);
+    return ByteReverse(SHA256_INIT[7] + v[4]) <= nTargetHigh;
+}
+
+#if defined(USE_SHA256_X86)
+// Eight nonces with two full SHA-NI transforms each, which still beats
+// skipping rounds in software; the padded blocks are set up once per call
+static unsigned int SHA256ScanNonces8_SHANI(const unsigned int* pmidstate, const unsigned int* ppre, const unsigned int* pw, unsigned int nNonce, unsigned int nTargetHigh)
+{
+    unsigned char block1[64], block2[64];
+    for (int i = 0; i < 3; i++)
+        WriteBE32(block1 + 4*i, pw[i]);
+    memcpy(block1 + 16, PAD_80, 48);
+    memcpy(block2 + 32, PAD_32, 32);
+
+    unsigned int fMatch = 0;
+    for (int l = 0; l < 8; l++)
+    {
+        unsigned int state[8];
+        WriteBE32(block1 + 12, ByteReverse(nNonce + l));
+        memcpy(state, pmidstate, sizeof(state));
+        SHA256Transform_SHANI(state, block1, 1);
+        for (int i = 0; i < 8; i++)
+            WriteBE32(block2 + 4*i, state[i]);
+        memcpy(state, SHA256_INIT, sizeof(state));
+        SHA256Transform_SHANI(state, block2, 1);
+        if (ByteReverse(state[7]) <= nTargetHigh)
+            fMatch |= 1U << l;
+    }
+    return fMatch;
+}
+#endif
+
+
+//
+// Implementation selection
+//
+
+typedef void (*TransformFn)(unsigned int* s, const unsigned char* pblock, size_t nBlocks);
+typedef void (*TransformLanesFn)(unsigned int* pstate, const unsigned char* const* ppblock);
+typedef unsigned int (*ScanLanesFn)(const unsigned int* pmidstate, const unsigned int* ppre, const unsigned int* pw, unsigned int nNonce, unsigned int nTargetHigh);
+
+// Single stream transform, used by CSHA256 and for leftover batch messages.
+// Starts out portable so hashing during static initialization is safe.
+static TransformFn pTransform = SHA256Transform_Generic;
+static const char* pszImplementation = "generic";
+
+static const int MAX_LANES = 8;
+
+static TransformLanesFn pTransformLanes = SHA256Transform1_Generic;
+static ScanLanesFn pScanLanes = SHA256ScanNonces1_Generic;
+static int nScanLanes = 1;
+static const char* pszScanImplementation = "generic";
+static int nLanes = 1;
+static const char* pszBatchImplementation = "generic";
+static boost::once_flag batchInit = BOOST_ONCE_INIT;
+
+static bool CPUSupports(const char* pszName)
+{
+    if (strcmp(pszName, "generic") == 0)
+        return true;
+#if defined(USE_SHA256_X86)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    bool fSSE41 = (ecx >> 19) & 1;
+    if (strcmp(pszName, "sse41") == 0)
+        return fSSE41;
+    if (strcmp(pszName, "shani") == 0)
+    {
+        if (!fSSE41 || __get_cpuid_max(0, NULL) < 7)
+            return false;
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        return (ebx >> 29) & 1;
+    }
+    if (strcmp(pszName, "avx2") == 0)
+    {
+        // AVX2 needs the OS to save the YMM registers, and CPUID leaf 7
+        bool fOSXSAVE = (ecx >> 27) & 1;
+        bool fAVX = (ecx >> 28) & 1;
+        if (!fOSXSAVE || !fAVX || __get_cpuid_max(0, NULL) < 7)
+            return false;
+        unsigned int xcr0lo, xcr0hi;
+        __asm__ ("xgetbv" : "=a"(xcr0lo), "=d"(xcr0hi) : "c"(0));
+        if ((xcr0lo & 6) != 6)
+            return false;
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        return (ebx >> 5) & 1;
+    }
+#endif
+    return false;
+}
+
+// The miner's nonce scan kernel that goes with each batch implementation
+static void SetScanImplementation(const char* pszName)
+{
+    pScanLanes = SHA256ScanNonces1_Generic;
+    nScanLanes = 1;
+    pszScanImplementation = "generic";
+#if defined(USE_SHA256_X86)
+    if (strcmp(pszName, "sse41") == 0)
+    {
+        pScanLanes = SHA256ScanNonces4_SSE41;
+        nScanLanes = 4;
+        pszScanImplementation = "sse41";
+    }
+    else if (strcmp(pszName, "avx2") == 0)
+    {
+        pScanLanes = SHA256ScanNonces8_AVX2;
+        nScanLanes = 8;
+        pszScanImplementation = "avx2";
+    }
+    else if (strcmp(pszName, "shani") == 0)
+    {
+        pScanLanes = SHA256ScanNonces8_SHANI;
+        nScanLanes = 8;
+        pszScanImplementation = "shani";
+    }
+#endif
+}
+
+static bool SetBatchImplementation(const char* pszName)
+{
+    if (!CPUSupports(pszName))
+        return false;
+    if (strcmp(pszName, "generic") == 0)
+    {
+        pTransformLanes = SHA256Transform1_Generic;
+        nLanes = 1;
+        pszBatchImplementation = "generic";
+    }
+#if defined(USE_SHA256_X86)
+    else if (strcmp(pszName, "sse41") == 0)
+    {
+        pTransformLanes = SHA256Transform4_SSE41;
+        nLanes = 4;
+        pszBatchImplementation = "sse41";
+    }
+    else if (strcmp(pszName, "avx2") == 0)
+    {
+        pTransformLanes = SHA256Transform8_AVX2;
+        nLanes = 8;
+        pszBatchImplementation = "avx2";
+    }
+    else if (strcmp(pszName, "shani") == 0)
+    {
+        // One message at a time, but each block costs less than a lane of avx2
+        pTransformLanes = SHA256Transform1_SHANI;
+        nLanes = 1;
+        pszBatchImplementation = "shani";
+    }
+#endif
+    else
+        return false;
+    SetScanImplementation(pszName);
+    return true;
+}
+
+static void AutoSelectBatch()
+{
+    if (!SetBatchImplementation("shani") && !SetBatchImplementation("avx2") && !SetBatchImplementation("sse41"))
+        SetBatchImplementation("generic");
+
+    // The avx2 scan kernel skips the rounds SHA-NI has to run in full, and
+    // is the faster miner even on CPUs that have both
+    if (strcmp(pszBatchImplementation, "shani") == 0 && CPUSupports("avx2"))
+        SetScanImplementation("avx2");
+}
+
+bool SHA256BatchSelect(const char* pszName)
+{
+    boost::call_once(batchInit, AutoSelectBatch);
+    return SetBatchImplementation(pszName);
+}
+
+const char* SHA256BatchImplementation()
+{
+    boost::call_once(batchInit, AutoSelectBatch);
+    return pszBatchImplementation;
+}
+
+int SHA256BatchLanes()
+{
+    boost::call_once(batchInit, AutoSelectBatch);
+    return nLanes;
+}
+
+bool SHA256ScanNonces(const unsigned char* pheader, unsigned int nTargetHigh, unsigned int& nNonce, unsigned int nCount, unsigned int& nHashesDone)
+{
+    boost::call_once(batchInit, AutoSelectBatch);
+    ScanLanesFn pScan = pScanLanes;
+    unsigned int nWays = nScanLanes;
+
+    // Everything before the nonce is the same for the whole scan
+    unsigned int midstate[8], pre[8], w[3];
+    memcpy(midstate, SHA256_INIT, sizeof(midstate));
+    pTransform(midstate, pheader, 1);
+    memcpy(pre, midstate, sizeof(pre));
+    for (int i = 0; i < 3; i++)
+    {
+        w[i] = ReadBE32(pheader + 64 + 4*i);
+        RoundGeneric(pre, SHA256_K[i] + w[i]);
+    }
+
+    nHashesDone = 0;
+    while (nHashesDone < nCount)
+    {
+        unsigned int fMatch = pScan(midstate, pre, w, nNonce + nHashesDone, nTargetHigh);
+        unsigned int nStep = std::min(nWays, nCount - nHashesDone);
+        fMatch &= (1U << nStep) - 1;
+        if (fMatch)
+        {
+            unsigned int nLane = 0;
+            while (!(fMatch & (1U << nLane)))
+                nLane++;
+            nNonce += nHashesDone + nLane;
+            nHashesDone += nLane + 1;
+            return true;
+        }
+        nHashesDone += nStep;
+    }
+    nNonce += nCount;
+    return false;
+}
+
+bool SHA256Select(const char* pszName)
+{
+    if (!CPUSupports(pszName))
+        return false;
+    if (strcmp(pszName, "generic") == 0)
+    {
+        pTransform = SHA256Transform_Generic;
+        pszImplementation = "generic";
+    }
+#if defined(USE_SHA256_X86)
+    else if (strcmp(pszName, "shani") == 0)
+    {
+        pTransform = SHA256Transform_SHANI;
+        pszImplementation = "shani";
+    }
+#endif
+    else
+        return false;
+    return true;
+}
+
+const char* SHA256Implementation()
+{
+    return pszImplementation;
+}
+
+std::string SHA256AutoDetect()
+{
+    if (!SHA256Select("shani"))
+        SHA256Select("generic");
+    boost::call_once(batchInit, AutoSelectBatch);
+    return strprintf("%s (batch: %s, miner: %s)", pszImplementation, pszBatchImplementation, pszScanImplementation);
+}
+
+void SHA256Blocks(unsigned int* s, const unsigned char* pblock, size_t nBlocks)
+{
+    pTransform(s, pblock, nBlocks);
+}
+
+
+//
+// CSHA256
+//
+
+CSHA256::CSHA256()
+{
+    Reset();
+}
+
+CSHA256& CSHA256::Reset()
+{
+    memcpy(s, SHA256_INIT, sizeof(s));
+    nBytes = 0;
+    return *this;
+}
+
+CSHA256& CSHA256::Write(const unsigned char* pch, size_t nLen)
+{
+    const unsigned char* pend = pch + nLen;
+    size_t nBufSize = nBytes % 64;
+    if (nBufSize && nBufSize + nLen >= 64)
+    {
+        // Complete the buffered block
+        memcpy(buf + nBufSize, pch, 64 - nBufSize);
+        nBytes += 64 - nBufSize;
+        pch += 64 - nBufSize;
+        pTransform(s, buf, 1);
+        nBufSize = 0;
+    }
+    if (pend - pch >= 64)
+    {
+        // Whole blocks straight from the input
+        size_t nBlocks = (pend - pch) / 64;
+        pTransform(s, pch, nBlocks);
+        pch += 64 * nBlocks;
+        nBytes += 64 * nBlocks;
+    }
+    if (pend > pch)
+    {
+        memcpy(buf + nBufSize, pch, pend - pch);
+        nBytes += pend - pch;
+    }
+    return *this;
+}
+
+void CSHA256::Finalize(unsigned char pout[OUTPUT_SIZE])
+{
+    static const unsigned char pad[64] = { 0x80 };
+    unsigned char sizedesc[8];
+    WriteBE32(sizedesc, (unsigned int)(nBytes >> 29));
+    WriteBE32(sizedesc + 4, (unsigned int)(nBytes << 3));
+    Write(pad, 1 + ((119 - (nBytes % 64)) % 64));
+    Write(sizedesc, 8);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(pout + 4*i, s[i]);
+}
+
+
+//
+// Lane scheduler: every lane works through its own message, and picks up
+// the next one as soon as it finishes, so messages of different lengths
+// keep all lanes busy
+//
+
+static void SHA256Batch(unsigned char* pout, const unsigned char* const* ppin, const size_t* pnLen, size_t nCount)
+{
+    boost::call_once(batchInit, AutoSelectBatch);
+    TransformLanesFn pLanes = pTransformLanes;
+    int nWays = nLanes;
+
+    unsigned int state[MAX_LANES * 8];
+    const unsigned char* pblock[MAX_LANES];
+    unsigned char tail[MAX_LANES][64];
+    size_t nJob[MAX_LANES], nBlock[MAX_LANES], nBlocks[MAX_LANES];
+    bool fActive[MAX_LANES];
+    static const unsigned char pidle[64] = {0};
+
+    for (int l = 0; l < nWays; l++)
+        fActive[l] = false;
+    size_t nNext = 0;
+    loop
+    {
+        int nActive = 0;
+        for (int l = 0; l < nWays; l++)
+        {
+            if (!fActive[l] && nNext < nCount)
+            {
+                nJob[l] = nNext++;
+                nBlock[l] = 0;
+                nBlocks[l] = (pnLen[nJob[l]] + 8) / 64 + 1;
+                memcpy(&state[l * 8], SHA256_INIT, sizeof(SHA256_INIT));
+                fActive[l] = true;
+            }
+            if (!fActive[l])
+            {
+                pblock[l] = pidle;
+                continue;
+            }
+            nActive++;
+
+            // Whole message blocks are read in place, the padded tail from a copy
+            size_t nLen = pnLen[nJob[l]];
+            size_t nPos = nBlock[l] * 64;
+            if (nPos + 64 <= nLen)
+                pblock[l] = ppin[nJob[l]] + nPos;
+            else
+            {
+                memset(tail[l], 0, 64);
+                if (nPos <= nLen)
+                {
+                    memcpy(tail[l], ppin[nJob[l]] + nPos, nLen - nPos);
+                    tail[l][nLen - nPos] = 0x80;
+                }
+                if (nBlock[l] + 1 == nBlocks[l])
+                {
+                    WriteBE32(&tail[l][56], (unsigned int)((unsigned long long)nLen >> 29));
+                    WriteBE32(&tail[l][60], (unsigned int)(nLen << 3));
+                }
+                pblock[l] = tail[l];
+            }
+        }
+        if (nActive == 0)
+            break;
+
+        // A mostly idle wide transform is slower than a few narrow ones
+        if (nActive * 4 <= nWays)
+        {
+            for (int l = 0; l < nWays; l++)
+                if (fActive[l])
+                    pTransform(&state[l * 8], pblock[l], 1);
+        }
+        else
+            pLanes(state, pblock);
+
+        for (int l = 0; l < nWays; l++)
+        {
+            if (fActive[l] && ++nBlock[l] == nBlocks[l])
+            {
+                for (int i = 0; i < 8; i++)
+                    WriteBE32(pout + nJob[l] * 32 + 4*i, state[l * 8 + i]);
+                fActive[l] = false;
+            }
+        }
+    }
+}
+
+static void SHA256Transform1(unsigned int* pstate, const unsigned char* const* ppblock)
+{
+    pTransform(pstate, ppblock[0], 1);
+}
+
+// Single SHA-256 of nWays 64-byte inputs (two transforms each) or 32-byte inputs (one)
+static void HashFixedLanes(TransformLanesFn pTransform, int nWays, unsigned char* pout, const unsigned char* pin, size_t nLen)
+{
+    unsigned int state[MAX_LANES * 8];
+    const unsigned char* pblock[MAX_LANES] = { NULL };
+    unsigned char padded[MAX_LANES][64];
+    for (int l = 0; l < nWays; l++)
+    {
+        memcpy(&state[l * 8], SHA256_INIT, sizeof(SHA256_INIT));
+        if (nLen == 64)
+            pblock[l] = pin + 64 * l;
+        else
+        {
+            memcpy(padded[l], pin + 32 * l, 32);
+            memcpy(padded[l] + 32, PAD_32, 32);
+            pblock[l] = padded[l];
+        }
+    }
+    pTransform(state, pblock);
+    if (nLen == 64)
+    {
+        for (int l = 0; l < nWays; l++)
+            pblock[l] = PAD_64;
+        pTransform(state, pblock);
+    }
+    for (int l = 0; l < nWays; l++)
+        for (int i = 0; i < 8; i++)
+            WriteBE32(pout + 32 * l + 4*i, state[l * 8 + i]);
+}
+
+static void HashFixed(unsigned char* pout, const unsigned char* pin, size_t nLen, size_t nCount)
+{
+    boost::call_once(batchInit, AutoSelectBatch);
+    size_t i = 0;
+    for (; i + nLanes <= nCount; i += nLanes)
+        HashFixedLanes(pTransformLanes, nLanes, pout + 32 * i, pin + nLen * i, nLen);
+    for (; i < nCount; i++)
+        HashFixedLanes(SHA256Transform1, 1, pout + 32 * i, pin + nLen * i, nLen);
+}
+
+void SHA256DBatch(unsigned char* pout, const unsigned char* const* ppin, const size_t* pnLen, size_t nCount)
+{
+    if (nCount == 0)
+        return;
+    boost::call_once(batchInit, AutoSelectBatch);
+    if (nLanes == 1)
+    {
+        // Nothing to interleave: whole messages through the multi-block transform
+        for (size_t i = 0; i < nCount; i++)
+        {
+            unsigned char hash[32];
+            CSHA256().Write(ppin[i], pnLen[i]).Finalize(hash);
+            CSHA256().Write(hash, 32).Finalize(pout + 32 * i);
+        }
+        return;
+    }
+    std::vector<unsigned char> vFirst(nCount * 32);
+    SHA256Batch(&vFirst[0], ppin, pnLen, nCount);
+    HashFixed(pout, &vFirst[0], 32, nCount);
+}
+
+void SHA256D64(unsigned char* pout, const unsigned char* pin, size_t nCount)
+{
+    if (nCount == 0)
+        return;
+    std::vector<unsigned char> vFirst(nCount * 32);
+    HashFixed(&vFirst[0], pin, 64, nCount);
+    HashFixed(pout, &vFirst[0], 32, nCount);
+}
@@ -0,0 +1,82 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SHA256_H
+#define BITCOIN_SHA256_H
+
+#include <stddef.h>
+#include <string>
+
+/** SHA-256 for Hash(), CHashWriter, script opcodes and the miner.
+ *
+ * The block transform is the portable one until SHA256AutoDetect() picks
+ * the x86 SHA extensions when the CPU has them; the node does that once at
+ * startup.
+ */
+class CSHA256
+{
+private:
+    unsigned int s[8];
+    unsigned char buf[64];
+    unsigned long long nBytes;
+
+public:
+    static const size_t OUTPUT_SIZE = 32;
+
+    CSHA256();
+    CSHA256& Write(const unsigned char* pch, size_t nLen);
+    // Writes the 32 byte digest; Reset() before reusing the object
+    void Finalize(unsigned char pout[OUTPUT_SIZE]);
+    CSHA256& Reset();
+};
+
+// Run the block transform over nBlocks consecutive 64-byte blocks, updating the eight state words s
+void SHA256Blocks(unsigned int* s, const unsigned char* pblock, size_t nBlocks);
+
+// Pick the fastest single stream and batch implementations the CPU supports.
+// Returns a description for the debug log.
+std::string SHA256AutoDetect();
+
+// Force the single stream implementation: "generic" or "shani".
+// Returns false, leaving the current one in place, if the CPU lacks support.
+bool SHA256Select(const char* pszName);
+
+// Name of the single stream implementation in use
+const char* SHA256Implementation();
+
+
+/** Batch SHA-256.
+ *
+ * Independent messages are hashed side by side, one per SIMD lane: eight at
+ * a time with AVX2, four with SSE4.1, one at a time with the SHA extensions
+ * or the portable implementation.  The best implementation the CPU supports
+ * is picked on first use.  Digests are written as the 32 raw bytes SHA256() produces.
+ */
+
+// Double-SHA256 of nCount messages ppin[i] of pnLen[i] bytes; 32 bytes per message to pout
+void SHA256DBatch(unsigned char* pout, const unsigned char* const* ppin, const size_t* pnLen, size_t nCount);
+
+// Double-SHA256 of nCount consecutive 64-byte inputs, such as pairs of merkle tree nodes
+void SHA256D64(unsigned char* pout, const unsigned char* pin, size_t nCount);
+
+// Force a batch implementation: "generic", "sse41", "avx2" or "shani",
+// along with the miner scan kernel of the same name.
+// Returns false, leaving the current one in place, if the CPU lacks support.
+bool SHA256BatchSelect(const char* pszName);
+
+// Name of the batch implementation in use
+const char* SHA256BatchImplementation();
+
+// Number of messages it hashes side by side
+int SHA256BatchLanes();
+
+// Miner nonce scan, several nonces side by side; on CPUs with both SHA-NI
+// and AVX2 the avx2 kernel is used unless another is forced.  pheader is an 80-byte block header; its nonce field is ignored.  Tries up
+// to nCount nonces from nNonce and stops at the first whose double-SHA256,
+// read as a uint256, has its top 32 bits at most nTargetHigh: returns true
+// with nNonce set to it, so the caller can compare the full hash with the
+// target.  Otherwise returns false with nNonce advanced past the range.
+// nHashesDone is set to the number of nonces tried either way.
+bool SHA256ScanNonces(const unsigned char* pheader, unsigned int nTargetHigh, unsigned int& nNonce, unsigned int nCount, unsigned int& nHashesDone);
+
+#endif
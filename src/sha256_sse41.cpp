@@ -0,0 +1,179 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Four-way SHA-256 transform with SSE4.1: one message per 32-bit lane.
+// Built with -msse4.1 and only called after CPUID reports support.
+
+#if defined(USE_SHA256_X86)
+
+#include <smmintrin.h>
+
+static const unsigned int K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline __m128i Add(__m128i x, __m128i y) { return _mm_add_epi32(x, y); }
+static inline __m128i Xor(__m128i x, __m128i y) { return _mm_xor_si128(x, y); }
+static inline __m128i And(__m128i x, __m128i y) { return _mm_and_si128(x, y); }
+static inline __m128i Or(__m128i x, __m128i y) { return _mm_or_si128(x, y); }
+
+#define SHR(x, n) _mm_srli_epi32(x, n)
+#define ROTR(x, n) _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - (n)))
+
+static inline __m128i Ch(__m128i e, __m128i f, __m128i g) { return Xor(g, And(e, Xor(f, g))); }
+static inline __m128i Maj(__m128i a, __m128i b, __m128i c) { return Or(And(a, b), And(c, Or(a, b))); }
+static inline __m128i Sigma0(__m128i a) { return Xor(Xor(ROTR(a, 2), ROTR(a, 13)), ROTR(a, 22)); }
+static inline __m128i Sigma1(__m128i e) { return Xor(Xor(ROTR(e, 6), ROTR(e, 11)), ROTR(e, 25)); }
+static inline __m128i sigma0(__m128i w) { return Xor(Xor(ROTR(w, 7), ROTR(w, 18)), SHR(w, 3)); }
+static inline __m128i sigma1(__m128i w) { return Xor(Xor(ROTR(w, 17), ROTR(w, 19)), SHR(w, 10)); }
+
+static inline void Round(__m128i a, __m128i b, __m128i c, __m128i& d, __m128i e, __m128i f, __m128i g, __m128i& h, __m128i kw)
+{
+    __m128i t1 = Add(Add(h, Sigma1(e)), Add(Ch(e, f, g), kw));
+    __m128i t2 = Add(Sigma0(a), Maj(a, b, c));
+    d = Add(d, t1);
+    h = Add(t1, t2);
+}
+
+// Rows of four words in, columns out: r[i] word j becomes r[j] word i
+static inline void Transpose(__m128i* r)
+{
+    __m128i t0 = _mm_unpacklo_epi32(r[0], r[1]), t1 = _mm_unpacklo_epi32(r[2], r[3]);
+    __m128i t2 = _mm_unpackhi_epi32(r[0], r[1]), t3 = _mm_unpackhi_epi32(r[2], r[3]);
+    r[0] = _mm_unpacklo_epi64(t0, t1);
+    r[1] = _mm_unpackhi_epi64(t0, t1);
+    r[2] = _mm_unpacklo_epi64(t2, t3);
+    r[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+void SHA256Transform4_SSE41(unsigned int* pstate, const unsigned char* const* ppblock)
+{
+    const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m128i s[8], w[64];
+    for (int half = 0; half < 2; half++)
+    {
+        for (int l = 0; l < 4; l++)
+            s[4 * half + l] = _mm_loadu_si128((const __m128i*)(pstate + 8 * l + 4 * half));
+        Transpose(&s[4 * half]);
+    }
+    for (int quarter = 0; quarter < 4; quarter++)
+    {
+        for (int l = 0; l < 4; l++)
+            w[4 * quarter + l] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(ppblock[l] + 16 * quarter)), bswap);
+        Transpose(&w[4 * quarter]);
+    }
+    for (int i = 16; i < 64; i++)
+        w[i] = Add(Add(w[i - 16], sigma0(w[i - 15])), Add(w[i - 7], sigma1(w[i - 2])));
+
+    __m128i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i += 8)
+    {
+        Round(a, b, c, d, e, f, g, h, Add(_mm_set1_epi32(K[i + 0]), w[i + 0]));
+        Round(h, a, b, c, d, e, f, g, Add(_mm_set1_epi32(K[i + 1]), w[i + 1]));
+        Round(g, h, a, b, c, d, e, f, Add(_mm_set1_epi32(K[i + 2]), w[i + 2]));
+        Round(f, g, h, a, b, c, d, e, Add(_mm_set1_epi32(K[i + 3]), w[i + 3]));
+        Round(e, f, g, h, a, b, c, d, Add(_mm_set1_epi32(K[i + 4]), w[i + 4]));
+        Round(d, e, f, g, h, a, b, c, Add(_mm_set1_epi32(K[i + 5]), w[i + 5]));
+        Round(c, d, e, f, g, h, a, b, Add(_mm_set1_epi32(K[i + 6]), w[i + 6]));
+        Round(b, c, d, e, f, g, h, a, Add(_mm_set1_epi32(K[i + 7]), w[i + 7]));
+    }
+    s[0] = Add(s[0], a); s[1] = Add(s[1], b); s[2] = Add(s[2], c); s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e); s[5] = Add(s[5], f); s[6] = Add(s[6], g); s[7] = Add(s[7], h);
+
+    for (int half = 0; half < 2; half++)
+    {
+        Transpose(&s[4 * half]);
+        for (int l = 0; l < 4; l++)
+            _mm_storeu_si128((__m128i*)(pstate + 8 * l + 4 * half), s[4 * half + l]);
+    }
+}
+
+// Miner nonce scan: four consecutive nonces from nNonce through both
+// transforms of the block header hash.  pmidstate is the state after the
+// first header block, ppre the state after rounds 0-2 of the second block,
+// which do not depend on the nonce, and pw that block's first three words.
+// Returns a bit per lane whose hash has its top 32 bits at most nTargetHigh.
+// The last three rounds do not affect that word and are skipped, so the
+// caller hashes matching nonces again in full.
+unsigned int SHA256ScanNonces4_SSE41(const unsigned int* pmidstate, const unsigned int* ppre, const unsigned int* pw, unsigned int nNonce, unsigned int nTargetHigh)
+{
+    const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m128i w[64];
+    w[0] = _mm_set1_epi32(pw[0]);
+    w[1] = _mm_set1_epi32(pw[1]);
+    w[2] = _mm_set1_epi32(pw[2]);
+    w[3] = _mm_shuffle_epi8(_mm_add_epi32(_mm_set1_epi32(nNonce), _mm_set_epi32(3, 2, 1, 0)), bswap);
+    w[4] = _mm_set1_epi32(0x80000000);
+    for (int i = 5; i < 15; i++)
+        w[i] = _mm_setzero_si128();
+    w[15] = _mm_set1_epi32(640);
+    for (int i = 16; i < 64; i++)
+        w[i] = Add(Add(w[i - 16], sigma0(w[i - 15])), Add(w[i - 7], sigma1(w[i - 2])));
+
+    __m128i a = _mm_set1_epi32(ppre[3]), b = _mm_set1_epi32(ppre[4]), c = _mm_set1_epi32(ppre[5]), d = _mm_set1_epi32(ppre[6]);
+    __m128i e = _mm_set1_epi32(ppre[7]), f = _mm_set1_epi32(ppre[0]), g = _mm_set1_epi32(ppre[1]), h = _mm_set1_epi32(ppre[2]);
+    Round(f, g, h, a, b, c, d, e, Add(_mm_set1_epi32(K[3]), w[3]));
+    Round(e, f, g, h, a, b, c, d, Add(_mm_set1_epi32(K[4]), w[4]));
+    Round(d, e, f, g, h, a, b, c, Add(_mm_set1_epi32(K[5]), w[5]));
+    Round(c, d, e, f, g, h, a, b, Add(_mm_set1_epi32(K[6]), w[6]));
+    Round(b, c, d, e, f, g, h, a, Add(_mm_set1_epi32(K[7]), w[7]));
+    for (int i = 8; i < 64; i += 8)
+    {
+        Round(a, b, c, d, e, f, g, h, Add(_mm_set1_epi32(K[i + 0]), w[i + 0]));
+        Round(h, a, b, c, d, e, f, g, Add(_mm_set1_epi32(K[i + 1]), w[i + 1]));
+        Round(g, h, a, b, c, d, e, f, Add(_mm_set1_epi32(K[i + 2]), w[i + 2]));
+        Round(f, g, h, a, b, c, d, e, Add(_mm_set1_epi32(K[i + 3]), w[i + 3]));
+        Round(e, f, g, h, a, b, c, d, Add(_mm_set1_epi32(K[i + 4]), w[i + 4]));
+        Round(d, e, f, g, h, a, b, c, Add(_mm_set1_epi32(K[i + 5]), w[i + 5]));
+        Round(c, d, e, f, g, h, a, b, Add(_mm_set1_epi32(K[i + 6]), w[i + 6]));
+        Round(b, c, d, e, f, g, h, a, Add(_mm_set1_epi32(K[i + 7]), w[i + 7]));
+    }
+
+    // The first hash is the whole of the second message
+    w[0] = Add(a, _mm_set1_epi32(pmidstate[0])); w[1] = Add(b, _mm_set1_epi32(pmidstate[1]));
+    w[2] = Add(c, _mm_set1_epi32(pmidstate[2])); w[3] = Add(d, _mm_set1_epi32(pmidstate[3]));
+    w[4] = Add(e, _mm_set1_epi32(pmidstate[4])); w[5] = Add(f, _mm_set1_epi32(pmidstate[5]));
+    w[6] = Add(g, _mm_set1_epi32(pmidstate[6])); w[7] = Add(h, _mm_set1_epi32(pmidstate[7]));
+    w[8] = _mm_set1_epi32(0x80000000);
+    for (int i = 9; i < 15; i++)
+        w[i] = _mm_setzero_si128();
+    w[15] = _mm_set1_epi32(256);
+    for (int i = 16; i < 61; i++)
+        w[i] = Add(Add(w[i - 16], sigma0(w[i - 15])), Add(w[i - 7], sigma1(w[i - 2])));
+
+    a = _mm_set1_epi32(0x6a09e667); b = _mm_set1_epi32(0xbb67ae85); c = _mm_set1_epi32(0x3c6ef372); d = _mm_set1_epi32(0xa54ff53a);
+    e = _mm_set1_epi32(0x510e527f); f = _mm_set1_epi32(0x9b05688c); g = _mm_set1_epi32(0x1f83d9ab); h = _mm_set1_epi32(0x5be0cd19);
+    for (int i = 0; i < 56; i += 8)
+    {
+        Round(a, b, c, d, e, f, g, h, Add(_mm_set1_epi32(K[i + 0]), w[i + 0]));
+        Round(h, a, b, c, d, e, f, g, Add(_mm_set1_epi32(K[i + 1]), w[i + 1]));
+        Round(g, h, a, b, c, d, e, f, Add(_mm_set1_epi32(K[i + 2]), w[i + 2]));
+        Round(f, g, h, a, b, c, d, e, Add(_mm_set1_epi32(K[i + 3]), w[i + 3]));
+        Round(e, f, g, h, a, b, c, d, Add(_mm_set1_epi32(K[i + 4]), w[i + 4]));
+        Round(d, e, f, g, h, a, b, c, Add(_mm_set1_epi32(K[i + 5]), w[i + 5]));
+        Round(c, d, e, f, g, h, a, b, Add(_mm_set1_epi32(K[i + 6]), w[i + 6]));
+        Round(b, c, d, e, f, g, h, a, Add(_mm_set1_epi32(K[i + 7]), w[i + 7]));
+    }
+    Round(a, b, c, d, e, f, g, h, Add(_mm_set1_epi32(K[56]), w[56]));
+    Round(h, a, b, c, d, e, f, g, Add(_mm_set1_epi32(K[57]), w[57]));
+    Round(g, h, a, b, c, d, e, f, Add(_mm_set1_epi32(K[58]), w[58]));
+    Round(f, g, h, a, b, c, d, e, Add(_mm_set1_epi32(K[59]), w[59]));
+    Round(e, f, g, h, a, b, c, d, Add(_mm_set1_epi32(K[60]), w[60]));
+
+    // Round 60 leaves the final last state word in h; byte swapped it is the
+    // top word of the hash as a uint256
+    __m128i top = _mm_shuffle_epi8(Add(h, _mm_set1_epi32(0x5be0cd19)), bswap);
+    __m128i pass = _mm_cmpeq_epi32(_mm_min_epu32(top, _mm_set1_epi32(nTargetHigh)), top);
+    return _mm_movemask_ps(_mm_castsi128_ps(pass));
+}
+
+#endif
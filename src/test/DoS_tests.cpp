@@ -15,11 +15,13 @@
 
 #include <stdint.h>
 
-// Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CDataStream& vMsg);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-extern std::map<uint256, CDataStream*> mapOrphanTransactions;
-extern std::map<uint256, std::map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
+// Tests these internal-to-main.cpp methods:
+extern bool AddOrphanTx(const CTransaction& tx, int nPeer);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, unsigned int nMaxBytes);
+extern std::map<uint256, COrphanTx> mapOrphanTransactions;
+extern std::map<COutPoint, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<int, COrphanPeer> mapOrphanTransactionsByPeer;
+extern unsigned int nOrphanTransactionsBytes;
 
 CService ip(uint32_t i)
 {
@@ -134,14 +136,11 @@ BOOST_AUTO_TEST_CASE(DoS_checknbits)
 
 CTransaction RandomOrphan()
 {
-    std::map<uint256, CDataStream*>::iterator it;
+    std::map<uint256, COrphanTx>::iterator it;
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    const CDataStream* pvMsg = it->second;
-    CTransaction tx;
-    CDataStream(*pvMsg) >> tx;
-    return tx;
+    return it->second.tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -163,9 +162,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
 
-        CDataStream ds(SER_DISK, CLIENT_VERSION);
-        ds << tx;
-        AddOrphanTx(ds);
+        AddOrphanTx(tx, i % 5);
     }
 
     // ... and 50 that depend on other orphans:
@@ -182,9 +179,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0);
 
-        CDataStream ds(SER_DISK, CLIENT_VERSION);
-        ds << tx;
-        AddOrphanTx(ds);
+        AddOrphanTx(tx, i % 5);
     }
 
     // This really-big orphan should be ignored:
@@ -208,19 +203,55 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        CDataStream ds(SER_DISK, CLIENT_VERSION);
-        ds << tx;
-        BOOST_CHECK(!AddOrphanTx(ds));
+        BOOST_CHECK(!AddOrphanTx(tx, 0));
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    LimitOrphanTxSize(40, MAX_ORPHAN_BYTES);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, MAX_ORPHAN_BYTES);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, MAX_ORPHAN_BYTES);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPeer.empty());
+    BOOST_CHECK(nOrphanTransactionsBytes == 0);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphansByPeer)
+{
+    // One peer floods the orphan pool, another sends a single orphan
+    unsigned int nSize = 0;
+    for (int i = 0; i < 100; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.n = 0;
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].scriptSig << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1*CENT;
+        BOOST_CHECK(AddOrphanTx(tx, i == 0 ? 2 : 1));
+        nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    }
+    BOOST_CHECK(nOrphanTransactionsBytes == 100 * nSize);
+    BOOST_CHECK(mapOrphanTransactionsByPeer[1].nBytes == 99 * nSize);
+    BOOST_CHECK(mapOrphanTransactionsByPeer[2].setHash.size() == 1);
+
+    // The byte limit evicts the flooding peer's orphans first
+    LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, 10 * nSize);
+    BOOST_CHECK(nOrphanTransactionsBytes <= 10 * nSize);
+    BOOST_CHECK(mapOrphanTransactions.size() == 10);
+    BOOST_CHECK(mapOrphanTransactionsByPeer[1].setHash.size() == 9);
+    BOOST_CHECK(mapOrphanTransactionsByPeer[2].setHash.size() == 1);
+
+    // Every input of an orphan is indexed by outpoint
+    BOOST_FOREACH(const PAIRTYPE(uint256, COrphanTx)& item, mapOrphanTransactions)
+        BOOST_CHECK(mapOrphanTransactionsByPrev.count(item.second.tx.vin[0].prevout));
+
+    LimitOrphanTxSize(0, 0);
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPeer.empty());
 }
 
 BOOST_AUTO_TEST_CASE(DoS_checkSig)
@@ -246,9 +277,7 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
 
-        CDataStream ds(SER_DISK, CLIENT_VERSION);
-        ds << tx;
-        AddOrphanTx(ds);
+        AddOrphanTx(tx, i % 5);
     }
 
     // Create a transaction that depends on orphans:
@@ -308,7 +337,7 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
         BOOST_CHECK(VerifySignature(orphans[j], tx, j, true, SIGHASH_ALL));
     mapArgs.erase("-maxsigcachesize");
 
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, MAX_ORPHAN_BYTES);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
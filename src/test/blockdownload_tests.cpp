@@ -0,0 +1,293 @@
+//
+// Unit tests for the headers-first block download scheduler
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+// Tests these internal-to-main.cpp methods:
+extern void FindBlocksToDownload(CNode* pto, std::vector<CInv>& vGetData);
+extern void ExpireBlockDownloads();
+extern void UpdateBlockAvailability(CNode* pnode, const uint256& hash);
+extern std::map<uint256, CBlockIndex*> mapHeaderIndex;
+extern std::map<uint256, CBlock*> mapOrphanBlocks;
+extern std::map<int, CBlockDownloadPeer> mapBlockDownloadPeer;
+extern std::map<uint256, std::pair<int, int64> > mapBlocksInFlight;
+extern int nDownloadHeight;
+extern unsigned int nOrphanBlocksSize;
+extern uint256 hashBlockStalled;
+extern int nBlockStalledPeer;
+
+// Header-only entries on top of the best header, as AcceptHeader makes them
+static void AddHeaders(int nCount)
+{
+    for (int i = 0; i < nCount; i++)
+    {
+        CBlockIndex* pindexPrev = pindexBestHeader;
+        CBlock header;
+        header.hashPrevBlock = pindexPrev->GetBlockHash();
+        header.hashMerkleRoot = GetRandHash();
+        header.nTime = pindexPrev->nTime + 600;
+        header.nBits = pindexPrev->nBits;
+        CBlockIndex* pindexNew = new CBlockIndex(0, 0, header);
+        std::map<uint256, CBlockIndex*>::iterator mi = mapHeaderIndex.insert(std::make_pair(header.GetHash(), pindexNew)).first;
+        pindexNew->phashBlock = &((*mi).first);
+        pindexNew->pprev = pindexPrev;
+        pindexNew->nHeight = pindexPrev->nHeight + 1;
+        pindexNew->bnChainWork = pindexPrev->bnChainWork + pindexNew->GetBlockWork();
+        pindexNew->BuildSkip();
+        pindexBestHeader = pindexNew;
+    }
+}
+
+static uint256 HeaderHash(int nHeight)
+{
+    return pindexBestHeader->GetAncestor(nHeight)->GetBlockHash();
+}
+
+static CNode* NewPeer()
+{
+    CNode* pnode = new CNode(INVALID_SOCKET, CAddress(), "", false);
+    LOCK(cs_vNodes);
+    vNodes.push_back(pnode);
+    return pnode;
+}
+
+static std::vector<CInv> Ask(CNode* pnode)
+{
+    std::vector<CInv> vGetData;
+    mapBlockDownloadPeer[pnode->id].nIdleGeneration = -1;
+    FindBlocksToDownload(pnode, vGetData);
+    return vGetData;
+}
+
+static bool SameBlocks(const std::vector<CInv>& vInv1, const std::vector<CInv>& vInv2)
+{
+    if (vInv1.size() != vInv2.size())
+        return false;
+    for (unsigned int i = 0; i < vInv1.size(); i++)
+        if (vInv1[i].hash != vInv2[i].hash)
+            return false;
+    return true;
+}
+
+struct BlockDownloadSetup
+{
+    std::vector<CNode*> vPeer;
+    int64 nTime;
+
+    BlockDownloadSetup()
+    {
+        BOOST_REQUIRE(mapHeaderIndex.empty());
+        BOOST_REQUIRE(pindexBestHeader == pindexBest);
+        nTime = GetTime() + 24 * 60 * 60;
+        SetMockTime(nTime);
+        for (int i = 0; i < 10; i++)
+            vPeer.push_back(NewPeer());
+    }
+
+    void Advance(int64 nSeconds)
+    {
+        nTime += nSeconds;
+        SetMockTime(nTime);
+    }
+
+    ~BlockDownloadSetup()
+    {
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vPeer)
+            {
+                vNodes.erase(std::remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                delete pnode;
+            }
+        }
+        mapBlocksInFlight.clear();
+        mapBlockDownloadPeer.clear();
+        hashBlockStalled = 0;
+        nBlockStalledPeer = -1;
+
+        // Back to the chain the other tests expect; this frees the headers
+        pindexBestHeader = NULL;
+        SetMainChainTip(pindexBest);
+        SetMockTime(0);
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(blockdownload_tests, BlockDownloadSetup)
+
+BOOST_AUTO_TEST_CASE(blockdownload_window)
+{
+    int nBase = pindexBest->nHeight;
+    AddHeaders(BLOCK_DOWNLOAD_WINDOW + 50);
+    BOOST_FOREACH(CNode* pnode, vPeer)
+        UpdateBlockAvailability(pnode, pindexBestHeader->GetBlockHash());
+
+    // Each peer gets the next MAX_BLOCKS_IN_TRANSIT_PER_PEER blocks, in
+    // order, until the window is used up
+    int nHeight = nBase + 1;
+    BOOST_FOREACH(CNode* pnode, vPeer)
+    {
+        std::vector<CInv> vGetData = Ask(pnode);
+        int nExpected = std::min(MAX_BLOCKS_IN_TRANSIT_PER_PEER, nBase + BLOCK_DOWNLOAD_WINDOW + 1 - nHeight);
+        BOOST_CHECK_EQUAL((int)vGetData.size(), nExpected);
+        BOOST_FOREACH(const CInv& inv, vGetData)
+        {
+            BOOST_CHECK(inv.type == MSG_BLOCK);
+            BOOST_CHECK(inv.hash == HeaderHash(nHeight));
+            nHeight++;
+        }
+        BOOST_CHECK_EQUAL(mapBlockDownloadPeer[pnode->id].nBlocksInFlight, nExpected);
+    }
+    BOOST_CHECK_EQUAL(nHeight, nBase + BLOCK_DOWNLOAD_WINDOW + 1);
+    BOOST_CHECK_EQUAL((int)mapBlocksInFlight.size(), BLOCK_DOWNLOAD_WINDOW);
+
+    // A peer at its limit is not asked for more
+    BOOST_CHECK(Ask(vPeer[0]).empty());
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_known_height)
+{
+    int nBase = pindexBest->nHeight;
+    AddHeaders(10);
+
+    // What a peer said about its height when it connected does not count,
+    // only the blocks it has shown us
+    vPeer[0]->nStartingHeight = nBase + 10;
+    BOOST_CHECK(Ask(vPeer[0]).empty());
+    UpdateBlockAvailability(vPeer[0], HeaderHash(nBase + 3));
+    std::vector<CInv> vGetData = Ask(vPeer[0]);
+    BOOST_CHECK_EQUAL(vGetData.size(), 3U);
+    BOOST_CHECK(vGetData.back().hash == HeaderHash(nBase + 3));
+
+    // A block known only from headers, above the height the peer connected
+    // at, is asked for once the peer's headers or inv show it has it
+    vPeer[1]->nStartingHeight = nBase;
+    BOOST_CHECK(Ask(vPeer[1]).empty());
+    UpdateBlockAvailability(vPeer[1], pindexBestHeader->GetBlockHash());
+    vGetData = Ask(vPeer[1]);
+    BOOST_CHECK_EQUAL(vGetData.size(), 7U);
+    BOOST_CHECK(vGetData.front().hash == HeaderHash(nBase + 4));
+    BOOST_CHECK(vGetData.back().hash == pindexBestHeader->GetBlockHash());
+
+    // Hashes we have no header for tell us nothing
+    UpdateBlockAvailability(vPeer[2], GetRandHash());
+    BOOST_CHECK_EQUAL(mapBlockDownloadPeer[vPeer[2]->id].nBestKnownHeight, -1);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_timeout)
+{
+    int nBase = pindexBest->nHeight;
+    AddHeaders(20);
+    BOOST_FOREACH(CNode* pnode, vPeer)
+        UpdateBlockAvailability(pnode, pindexBestHeader->GetBlockHash());
+
+    std::vector<CInv> vGetData0 = Ask(vPeer[0]);
+    BOOST_CHECK_EQUAL((int)vGetData0.size(), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    std::vector<CInv> vGetData1 = Ask(vPeer[1]);
+    BOOST_CHECK_EQUAL((int)vGetData1.size(), 20 - MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // A peer that goes away loses its requests at once
+    vPeer[1]->fDisconnect = true;
+    Advance(1);
+    ExpireBlockDownloads();
+    BOOST_CHECK_EQUAL((int)mapBlocksInFlight.size(), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK(!mapBlockDownloadPeer.count(vPeer[1]->id));
+    std::vector<CInv> vGetData2 = Ask(vPeer[2]);
+    BOOST_CHECK(SameBlocks(vGetData2, vGetData1));
+
+    // Nothing else is taken away before BLOCK_DOWNLOAD_TIMEOUT
+    Advance(BLOCK_DOWNLOAD_TIMEOUT - 1);
+    ExpireBlockDownloads();
+    BOOST_CHECK_EQUAL(mapBlocksInFlight.size(), 20U);
+    BOOST_CHECK(Ask(vPeer[3]).empty());
+
+    // Requests older than BLOCK_DOWNLOAD_TIMEOUT go to whoever asks next
+    Advance(1);
+    ExpireBlockDownloads();
+    BOOST_CHECK_EQUAL((int)mapBlocksInFlight.size(), 20 - MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(mapBlockDownloadPeer[vPeer[0]->id].nBlocksInFlight, 0);
+    std::vector<CInv> vGetData3 = Ask(vPeer[4]);
+    BOOST_CHECK(SameBlocks(vGetData3, vGetData0));
+    BOOST_CHECK(vGetData3.front().hash == HeaderHash(nBase + 1));
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_stall)
+{
+    int nBase = pindexBest->nHeight;
+    AddHeaders(40);
+    BOOST_FOREACH(CNode* pnode, vPeer)
+        UpdateBlockAvailability(pnode, pindexBestHeader->GetBlockHash());
+
+    // Peer 0 holds the first missing block while the later ones have come
+    // in and wait for it, filling the orphan pool
+    BOOST_CHECK_EQUAL((int)Ask(vPeer[0]).size(), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    uint256 hashFirst = HeaderHash(nBase + 1);
+    CBlock* pblockOrphan = new CBlock();
+    uint256 hashOrphan = GetRandHash();
+    mapOrphanBlocks[hashOrphan] = pblockOrphan;
+    unsigned int nOrphanBlocksSizeSave = nOrphanBlocksSize;
+    nOrphanBlocksSize = MAX_ORPHAN_BLOCKS_SIZE;
+
+    // Past the limit only the first missing block is worth asking for, and
+    // it is taken
+    BOOST_CHECK(Ask(vPeer[1]).empty());
+
+    // Within BLOCK_STALL_TIMEOUT peer 0 keeps it
+    Advance(BLOCK_STALL_TIMEOUT);
+    ExpireBlockDownloads();
+    BOOST_CHECK(mapBlocksInFlight.count(hashFirst));
+    BOOST_CHECK(hashBlockStalled == 0);
+
+    // After that it is handed to another peer, never back to peer 0
+    Advance(1);
+    ExpireBlockDownloads();
+    BOOST_CHECK(!mapBlocksInFlight.count(hashFirst));
+    BOOST_CHECK(hashBlockStalled == hashFirst);
+    BOOST_CHECK_EQUAL(nBlockStalledPeer, vPeer[0]->id);
+    BOOST_CHECK(Ask(vPeer[0]).empty());
+    std::vector<CInv> vGetData = Ask(vPeer[1]);
+    BOOST_CHECK_EQUAL(vGetData.size(), 1U);
+    BOOST_CHECK(vGetData[0].hash == hashFirst);
+    BOOST_CHECK_EQUAL(mapBlocksInFlight[hashFirst].first, vPeer[1]->id);
+
+    mapOrphanBlocks.erase(hashOrphan);
+    delete pblockOrphan;
+    nOrphanBlocksSize = nOrphanBlocksSizeSave;
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_caught_up)
+{
+    CBlockIndex* pindexTipSave = pindexBest;
+    AddHeaders(5);
+    CBlockIndex* pindexHeaderTip = pindexBestHeader;
+
+    // A main chain tip with less work than the headers keeps them
+    SetMainChainTip(pindexTipSave);
+    BOOST_CHECK_EQUAL(mapHeaderIndex.size(), 5U);
+    BOOST_CHECK(pindexBestHeader == pindexHeaderTip);
+
+    // Once the blocks have caught up, the header-only entries are freed
+    CBlock block = pindexTipSave->GetBlockHeader();
+    block.hashPrevBlock = pindexTipSave->GetBlockHash();
+    block.hashMerkleRoot = GetRandHash();
+    CBlockIndex indexTip(0, 0, block);
+    uint256 hashTip = block.GetHash();
+    indexTip.phashBlock = &hashTip;
+    indexTip.pprev = pindexTipSave;
+    indexTip.nHeight = pindexTipSave->nHeight + 1;
+    indexTip.bnChainWork = pindexHeaderTip->bnChainWork;
+    SetMainChainTip(&indexTip);
+    BOOST_CHECK(mapHeaderIndex.empty());
+    BOOST_CHECK(pindexBestHeader == &indexTip);
+    BOOST_CHECK_EQUAL(nDownloadHeight, indexTip.nHeight + 1);
+
+    pindexBestHeader = NULL;
+    SetMainChainTip(pindexTipSave);
+    BOOST_CHECK(FindBlockByHeight(indexTip.nHeight) == NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
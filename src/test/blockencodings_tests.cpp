@@ -0,0 +1,110 @@
+//
+// Unit tests for compact block encoding and reconstruction
+//
+#include <boost/test/unit_test.hpp>
+
+#include "blockencodings.h"
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+// Block on top of genesis with nTx made-up transactions after the coinbase
+static CBlock BuildBlock(unsigned int nTx)
+{
+    CBlock block = pindexGenesisBlock->GetBlockHeader();
+    block.hashPrevBlock = pindexGenesisBlock->GetBlockHash();
+    block.vtx.resize(nTx + 1);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].scriptSig = CScript() << 1 << OP_0;
+    block.vtx[0].vout.resize(1);
+    block.vtx[0].vout[0].nValue = 50 * COIN;
+    for (unsigned int i = 1; i <= nTx; i++)
+    {
+        CTransaction& tx = block.vtx[i];
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(block.vtx[i - 1].GetHash(), 0);
+        tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, i) << std::vector<unsigned char>(33, i);
+        tx.vout.resize(2);
+        tx.vout[0].nValue = i;
+        tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+        tx.vout[1] = tx.vout[0];
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(blockencodings_siphash)
+{
+    // Reference vector: key 00..0f, message 00..1f
+    uint256 val("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL, val), 0x7127512f72f27cceULL);
+}
+
+BOOST_AUTO_TEST_CASE(blockencodings_reconstruct)
+{
+    CBlock block = BuildBlock(100);
+    CTxMemPool pool;
+    for (unsigned int i = 1; i <= 90; i++)
+        pool.addUnchecked(block.vtx[i].GetHash(), block.vtx[i]);
+    CTransaction txOther = BuildBlock(1).vtx[1];
+    txOther.nLockTime = 1;
+    pool.addUnchecked(txOther.GetHash(), txOther);
+
+    // Over the wire
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CBlockHeaderAndShortTxIDs(block);
+    unsigned int nBlockSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(ss.size() * 10 < nBlockSize);
+    CBlockHeaderAndShortTxIDs cmpct;
+    ss >> cmpct;
+    BOOST_CHECK(cmpct.header.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(cmpct.vShortTxIDs.size(), 100U);
+
+    CPartialBlock partial;
+    BOOST_CHECK(partial.Init(cmpct, pool));
+    BOOST_CHECK_EQUAL(partial.nFromPool, 90U);
+    BOOST_CHECK(!partial.IsComplete());
+    std::vector<unsigned short> vIndexes;
+    partial.GetMissing(vIndexes);
+    BOOST_CHECK_EQUAL(vIndexes.size(), 10U);
+    BOOST_CHECK_EQUAL(vIndexes[0], 91);
+
+    // The answer to getshorttxn completes it
+    std::vector<CTransaction> vtx;
+    BOOST_FOREACH(unsigned short nIndex, vIndexes)
+        vtx.push_back(block.vtx[nIndex]);
+    CPartialBlock partialShort = partial;
+    BOOST_CHECK(!partialShort.FillMissing(std::vector<CTransaction>(vtx.begin() + 1, vtx.end())));
+    BOOST_CHECK(partial.FillMissing(vtx));
+    BOOST_CHECK(partial.IsComplete());
+    BOOST_CHECK(partial.block.GetHash() == block.GetHash());
+    BOOST_CHECK(partial.block.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(blockencodings_collision)
+{
+    CBlock block = BuildBlock(10);
+    CTxMemPool pool;
+    for (unsigned int i = 1; i <= 10; i++)
+        pool.addUnchecked(block.vtx[i].GetHash(), block.vtx[i]);
+
+    // A short ID that appears twice is asked for at both positions
+    CBlockHeaderAndShortTxIDs cmpct(block);
+    cmpct.vShortTxIDs[4] = cmpct.vShortTxIDs[2];
+    CPartialBlock partial;
+    BOOST_CHECK(partial.Init(cmpct, pool));
+    std::vector<unsigned short> vIndexes;
+    partial.GetMissing(vIndexes);
+    BOOST_CHECK_EQUAL(vIndexes.size(), 2U);
+    BOOST_CHECK_EQUAL(vIndexes[0], 3);
+    BOOST_CHECK_EQUAL(vIndexes[1], 5);
+
+    // Prefilled positions must be in the block and not repeat
+    cmpct = CBlockHeaderAndShortTxIDs(block);
+    cmpct.vPrefilled.push_back(cmpct.vPrefilled[0]);
+    cmpct.vShortTxIDs.pop_back();
+    BOOST_CHECK(!partial.Init(cmpct, pool));
+    cmpct.vPrefilled[1].nIndex = 11;
+    BOOST_CHECK(!partial.Init(cmpct, pool));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
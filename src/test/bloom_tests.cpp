@@ -0,0 +1,86 @@
+//
+// Unit tests for the rolling Bloom filter used for per-peer relay state
+//
+#include <boost/test/unit_test.hpp>
+
+#include "bloom.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+static unsigned int MurmurHash3Hex(unsigned int nHashSeed, const char* pszHex)
+{
+    std::vector<unsigned char> vch = ParseHex(pszHex);
+    return MurmurHash3(nHashSeed, vch.empty() ? NULL : &vch[0], vch.size());
+}
+
+BOOST_AUTO_TEST_CASE(bloom_murmurhash3)
+{
+    // Reference results for MurmurHash3 x86_32
+    BOOST_CHECK_EQUAL(MurmurHash3Hex(0x00000000, ""), 0x00000000U);
+    BOOST_CHECK_EQUAL(MurmurHash3Hex(0x00000001, ""), 0x514E28B7U);
+    BOOST_CHECK_EQUAL(MurmurHash3Hex(0xffffffff, ""), 0x81F16F39U);
+    BOOST_CHECK_EQUAL(MurmurHash3Hex(0x00000000, "00000000"), 0x2362F9DEU);
+    BOOST_CHECK_EQUAL(MurmurHash3Hex(0x00000000, "21436587"), 0xF55B516BU);
+    BOOST_CHECK_EQUAL(MurmurHash3Hex(0x5082EDEE, "21436587"), 0x2362F9DEU);
+    BOOST_CHECK_EQUAL(MurmurHash3Hex(0x00000000, "214365"), 0x7E4A8634U);
+    BOOST_CHECK_EQUAL(MurmurHash3Hex(0x00000000, "2143"), 0xA0F7B07AU);
+    BOOST_CHECK_EQUAL(MurmurHash3Hex(0x00000000, "21"), 0x72661CF4U);
+}
+
+BOOST_AUTO_TEST_CASE(bloom_rolling)
+{
+    CRollingBloomFilter filter(100, 0.01);
+
+    std::vector<uint256> vHash;
+    for (int i = 0; i < 400; i++)
+        vHash.push_back(GetRandHash());
+
+    // The last 100 keys are always there
+    for (int i = 0; i < 400; i++)
+    {
+        filter.insert(vHash[i]);
+        for (int j = std::max(0, i - 99); j <= i; j++)
+            BOOST_CHECK(filter.contains(vHash[j]));
+    }
+
+    // Keys from well before that are forgotten, but for false positives
+    int nFound = 0;
+    for (int i = 0; i < 200; i++)
+        if (filter.contains(vHash[i]))
+            nFound++;
+    BOOST_CHECK(nFound < 10);
+
+    // Keys never inserted show up about one time in a hundred
+    int nFalsePositives = 0;
+    for (int i = 0; i < 10000; i++)
+        if (filter.contains(GetRandHash()))
+            nFalsePositives++;
+    BOOST_CHECK(nFalsePositives < 200);
+
+    // reset() forgets everything
+    filter.reset();
+    nFound = 0;
+    for (int i = 300; i < 400; i++)
+        if (filter.contains(vHash[i]))
+            nFound++;
+    BOOST_CHECK(nFound < 5);
+}
+
+BOOST_AUTO_TEST_CASE(bloom_rolling_size)
+{
+    // The memory use is fixed by the parameters, not by what is inserted
+    CRollingBloomFilter filter(10000, 0.000001);
+    size_t nUsage = filter.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > 100000 && nUsage < 120000);
+    for (int i = 0; i < 100000; i++)
+        filter.insert(GetRandHash());
+    BOOST_CHECK_EQUAL(filter.DynamicMemoryUsage(), nUsage);
+
+    std::vector<unsigned char> vchKey(18, 0x42);
+    BOOST_CHECK(!filter.contains(vchKey));
+    filter.insert(vchKey);
+    BOOST_CHECK(filter.contains(vchKey));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
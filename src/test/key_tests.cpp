@@ -4,6 +4,7 @@
 #include <vector>
 
 #include "key.h"
+#include "secp256k1.h"
 #include "base58.h"
 #include "uint256.h"
 #include "util.h"
@@ -144,4 +145,116 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+// OpenSSL's answer, regardless of the configured engine
+static bool VerifyOpenSSL(CKey& key, uint256 hash, const vector<unsigned char>& vchSig)
+{
+    ECVerifyEngine engine = GetECVerifyEngine();
+    SetECVerifyEngine(ECVERIFY_OPENSSL);
+    bool fResult = key.Verify(hash, vchSig);
+    SetECVerifyEngine(engine);
+    return fResult;
+}
+
+BOOST_AUTO_TEST_CASE(key_secp256k1_verify)
+{
+    int nCompared = 0;
+    for (int n = 0; n < 32; n++)
+    {
+        CKey key;
+        key.MakeNewKey(n % 2 == 1);
+        vector<unsigned char> vchPubKey = key.GetPubKey().Raw();
+        Secp256k1::CPoint pubkey;
+        BOOST_CHECK(Secp256k1::ParsePubKey(vchPubKey, pubkey));
+
+        // Re-encoding gives the uncompressed form of the same key
+        vector<unsigned char> vchUncompressed;
+        Secp256k1::GetPubKey(pubkey, vchUncompressed);
+        BOOST_CHECK_EQUAL(vchUncompressed.size(), 65U);
+        if (vchPubKey.size() == 65)
+            BOOST_CHECK(vchUncompressed == vchPubKey);
+        else
+            BOOST_CHECK(std::equal(vchPubKey.begin() + 1, vchPubKey.end(), vchUncompressed.begin() + 1));
+
+        // A key that did not sign
+        CKey keyOther;
+        keyOther.MakeNewKey(n % 2 == 0);
+        Secp256k1::CPoint pubkeyOther;
+        BOOST_CHECK(Secp256k1::ParsePubKey(keyOther.GetPubKey().Raw(), pubkeyOther));
+
+        for (int i = 0; i < 4; i++)
+        {
+            uint256 hash = GetRandHash();
+            if (i == 3)
+                hash = 0;
+            vector<unsigned char> vchSig;
+            BOOST_CHECK(key.Sign(hash, vchSig));
+
+            BOOST_CHECK(Secp256k1::Verify(pubkey, hash, vchSig) == 1);
+            BOOST_CHECK(Secp256k1::Verify(pubkeyOther, hash, vchSig) == 0);
+            BOOST_CHECK(Secp256k1::Verify(pubkey, GetRandHash(), vchSig) == 0);
+
+            // Flip bits all over the signature; whatever still parses as
+            // strict DER must get the same answer as OpenSSL
+            for (unsigned int j = 0; j < vchSig.size(); j++)
+            {
+                vector<unsigned char> vchMutated(vchSig);
+                vchMutated[j] ^= 1 << (GetRand(8));
+                int nResult = Secp256k1::Verify(pubkey, hash, vchMutated);
+                if (nResult >= 0)
+                {
+                    BOOST_CHECK_EQUAL(nResult == 1, VerifyOpenSSL(key, hash, vchMutated));
+                    nCompared++;
+                }
+            }
+
+            // Redundant zero padding of R is not strict DER: left to OpenSSL
+            vector<unsigned char> vchPadded(vchSig);
+            vchPadded.insert(vchPadded.begin() + 4, 0x00);
+            vchPadded[1]++;
+            vchPadded[3]++;
+            BOOST_CHECK(Secp256k1::Verify(pubkey, hash, vchPadded) == -1);
+
+            // Both engines through CKey
+            SetECVerifyEngine(ECVERIFY_SECP256K1);
+            BOOST_CHECK(key.Verify(hash, vchSig));
+            BOOST_CHECK(key.Verify(hash, vchPadded) == VerifyOpenSSL(key, hash, vchPadded));
+            BOOST_CHECK(!keyOther.Verify(hash, vchSig));
+            SetECVerifyEngine(ECVERIFY_OPENSSL);
+        }
+    }
+    BOOST_CHECK(nCompared > 0);
+
+    // r and s must be in [1, n-1]
+    CKey key;
+    key.MakeNewKey(true);
+    Secp256k1::CPoint pubkey;
+    BOOST_CHECK(Secp256k1::ParsePubKey(key.GetPubKey().Raw(), pubkey));
+    uint256 hash = GetRandHash();
+    vector<unsigned char> vchOrder = ParseHex("00FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEBAAEDCE6AF48A03BBFD25E8CD0364141");
+    vector<unsigned char> vchSig = ParseHex("3006020100020101");
+    BOOST_CHECK(Secp256k1::Verify(pubkey, hash, vchSig) == 0);
+    vchSig = ParseHex("3006020101020100");
+    BOOST_CHECK(Secp256k1::Verify(pubkey, hash, vchSig) == 0);
+    vchSig = ParseHex("3026020101022100");
+    vchSig.insert(vchSig.end(), vchOrder.begin() + 1, vchOrder.end());
+    BOOST_CHECK(Secp256k1::Verify(pubkey, hash, vchSig) == 0);
+    BOOST_CHECK(!VerifyOpenSSL(key, hash, vchSig));
+
+    // Points off the curve and malformed encodings are rejected
+    vector<unsigned char> vchPubKey = key.GetPubKey().Raw();
+    BOOST_CHECK(!Secp256k1::ParsePubKey(vector<unsigned char>(vchPubKey.begin(), vchPubKey.end() - 1), pubkey));
+    vchPubKey[0] = 0x04;
+    BOOST_CHECK(!Secp256k1::ParsePubKey(vchPubKey, pubkey));
+    CKey keyU;
+    keyU.MakeNewKey(false);
+    vchPubKey = keyU.GetPubKey().Raw();
+    vchPubKey[64] ^= 1;
+    BOOST_CHECK(!Secp256k1::ParsePubKey(vchPubKey, pubkey));
+    BOOST_CHECK(!CKey().SetPubKey(CPubKey(vchPubKey)));
+    // x = 5 has no square root of x^3 + 7
+    vchPubKey = ParseHex("020000000000000000000000000000000000000000000000000000000000000005");
+    BOOST_CHECK(!Secp256k1::ParsePubKey(vchPubKey, pubkey));
+    BOOST_CHECK(!CKey().SetPubKey(CPubKey(vchPubKey)));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
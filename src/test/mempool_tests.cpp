@@ -0,0 +1,320 @@
+//
+// Unit tests for the transaction memory pool
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <fstream>
+
+#include "main.h"
+#include "db.h"
+#include "keystore.h"
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+// Pool transaction spending nValueIn from a made-up previous transaction,
+// added with its inputs so it is indexed by fee rate like an accepted one
+static CTransaction AddPoolTx(CTxMemPool& pool, const CTransaction& txPrev, int64 nFee,
+                              const CScript& scriptPubKey = CScript() << OP_TRUE)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(txPrev.GetHash(), 0);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = txPrev.vout[0].nValue - nFee;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+
+    MapPrevTx mapInputs;
+    mapInputs[txPrev.GetHash()] = std::make_pair(CTxIndex(), txPrev);
+    mapInputs[txPrev.GetHash()].first.vSpent.resize(txPrev.vout.size());
+    pool.addUnchecked(tx.GetHash(), tx, &mapInputs);
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim)
+{
+    CTxMemPool pool;
+    BOOST_CHECK(pool.DynamicMemoryUsage() == 0);
+
+    std::vector<CTransaction> vtx;
+    for (int i = 0; i < 10; i++)
+    {
+        CTransaction txPrev;
+        txPrev.vin.resize(1);
+        txPrev.vin[0].scriptSig = CScript() << i;
+        txPrev.vout.resize(1);
+        txPrev.vout[0].nValue = COIN;
+        vtx.push_back(AddPoolTx(pool, txPrev, (i + 1) * 10000));
+    }
+    // A well paying child does not save its cheap parent
+    CTransaction txChild = AddPoolTx(pool, vtx[0], 1000000);
+    BOOST_CHECK(pool.size() == 11);
+
+    size_t nUsage = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > 11 * ::GetSerializeSize(txChild, SER_NETWORK, PROTOCOL_VERSION));
+
+    pool.TrimToSize(nUsage);
+    BOOST_CHECK(pool.size() == 11);
+
+    pool.TrimToSize(nUsage - 1);
+    BOOST_CHECK(pool.size() == 9);
+    BOOST_CHECK(!pool.exists(vtx[0].GetHash()));
+    BOOST_CHECK(!pool.exists(txChild.GetHash()));
+    BOOST_CHECK(pool.exists(vtx[1].GetHash()));
+    BOOST_CHECK(pool.DynamicMemoryUsage() < nUsage);
+
+    // Removing everything gives all the memory back
+    for (int i = 1; i < 10; i++)
+        pool.remove(vtx[i]);
+    BOOST_CHECK(pool.size() == 0);
+    BOOST_CHECK(pool.DynamicMemoryUsage() == 0);
+
+    pool.TrimToSize(0);
+    BOOST_CHECK(pool.size() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim_after_reorg)
+{
+    CTxMemPool pool;
+    std::vector<CTransaction> vtx;
+    for (int i = 0; i < 10; i++)
+    {
+        CTransaction txPrev;
+        txPrev.vin.resize(1);
+        txPrev.vin[0].scriptSig = CScript() << i << OP_1;
+        txPrev.vout.resize(1);
+        txPrev.vout[0].nValue = COIN;
+        vtx.push_back(AddPoolTx(pool, txPrev, (10 - i) * 10000));
+    }
+
+    // What Reorganize leaves behind: nothing checked against the new chain,
+    // plus a transaction put back without its inputs
+    pool.uncheckAll();
+    CTransaction txResurrected;
+    txResurrected.vin.resize(1);
+    txResurrected.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txResurrected.vout.resize(1);
+    txResurrected.vout[0].nValue = COIN;
+    pool.addUnchecked(txResurrected.GetHash(), txResurrected);
+    BOOST_CHECK(pool.size() == 11);
+    BOOST_CHECK(pool.setByFee.size() == 11);
+
+    // Everything can still be evicted: the one without a known fee first,
+    // then the others by the fee rate they came in with
+    size_t nUsage = pool.DynamicMemoryUsage();
+    pool.TrimToSize(nUsage - 1);
+    BOOST_CHECK(pool.size() == 10);
+    BOOST_CHECK(!pool.exists(txResurrected.GetHash()));
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(pool.size() == 9);
+    BOOST_CHECK(!pool.exists(vtx[9].GetHash()));
+    BOOST_CHECK(pool.exists(vtx[8].GetHash()));
+
+    // A newly accepted transaction is not the only one that can make room
+    CTransaction txPrev;
+    txPrev.vin.resize(1);
+    txPrev.vin[0].scriptSig = CScript() << OP_2;
+    txPrev.vout.resize(1);
+    txPrev.vout[0].nValue = COIN;
+    CTransaction txNew = AddPoolTx(pool, txPrev, 500000);
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(pool.exists(txNew.GetHash()));
+    BOOST_CHECK(!pool.exists(vtx[8].GetHash()));
+
+    pool.TrimToSize(0);
+    BOOST_CHECK(pool.size() == 0);
+    BOOST_CHECK(pool.setByFee.empty());
+    BOOST_CHECK(pool.DynamicMemoryUsage() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_accept_verified)
+{
+    CTxMemPool pool;
+    CTxDB txdb("r");
+
+    CTransaction txGrandParent;
+    txGrandParent.vin.resize(1);
+    txGrandParent.vin[0].scriptSig = CScript() << OP_3;
+    txGrandParent.vout.resize(1);
+    txGrandParent.vout[0].nValue = COIN;
+    CTransaction txParent = AddPoolTx(pool, txGrandParent, 0);
+
+    // Inputs as a worker hands them over: the scripts are not run again,
+    // so a child that could never have passed them is taken at its word
+    CTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vin[0].scriptSig = CScript() << OP_0;
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = COIN - 1000000;
+    txChild.vout[0].scriptPubKey = CScript() << OP_FALSE;
+    MapPrevTx mapInputs;
+    mapInputs[txParent.GetHash()] = std::make_pair(CTxIndex(CDiskTxPos(1,1,1), txParent.vout.size()), txParent);
+
+    CTransaction txChild2 = txChild;
+    txChild2.nLockTime = 1;
+    bool fMissingInputs = false;
+    BOOST_CHECK(pool.accept(txdb, txChild, true, &fMissingInputs, true, &mapInputs));
+    BOOST_CHECK(pool.exists(txChild.GetHash()));
+
+    // A second spend of the same output is still a conflict
+    BOOST_CHECK(!pool.accept(txdb, txChild2, true, &fMissingInputs, true, &mapInputs));
+    BOOST_CHECK(!pool.exists(txChild2.GetHash()));
+
+    // Once the pool parent is gone the snapshot is not trusted; the inputs
+    // are fetched again and found missing
+    pool.removeRecursive(txParent);
+    BOOST_CHECK(pool.size() == 0);
+    BOOST_CHECK(!pool.accept(txdb, txChild2, true, &fMissingInputs, true, &mapInputs));
+    BOOST_CHECK(fMissingInputs);
+    BOOST_CHECK(pool.size() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_accept_unchecked)
+{
+    // Inputs are looked up in the global pool, so this test uses it
+    CTxDB txdb("r");
+    mempool.clear();
+    CTransaction txGrandParent;
+    txGrandParent.vin.resize(1);
+    txGrandParent.vin[0].scriptSig = CScript() << OP_4;
+    txGrandParent.vout.resize(1);
+    txGrandParent.vout[0].nValue = COIN;
+    CTransaction txParent = AddPoolTx(mempool, txGrandParent, 100000);
+    CTransaction txOther;
+    txOther.vin.resize(1);
+    txOther.vin[0].scriptSig = CScript() << OP_5;
+    txOther.vout.resize(1);
+    txOther.vout[0].nValue = COIN;
+    CTransaction txCheap = AddPoolTx(mempool, txOther, 10000);
+
+    // A wallet re-add skips the checks, but still gets its fee rate
+    CTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = txParent.vout[0].nValue - 1000000;
+    txChild.vout[0].scriptPubKey.SetDestination(CKeyID(uint160(1)));
+    BOOST_CHECK(mempool.accept(txdb, txChild, false, NULL));
+    const CTxMemPoolEntry* pentry = mempool.lookupEntry(txChild.GetHash());
+    BOOST_REQUIRE(pentry != NULL);
+    BOOST_CHECK(pentry->fChecked);
+    BOOST_CHECK_EQUAL(pentry->nFee, 1000000);
+
+    // So the cheaper transaction goes first, not the re-added one
+    mempool.TrimToSize(mempool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!mempool.exists(txCheap.GetHash()));
+    BOOST_CHECK(mempool.exists(txChild.GetHash()));
+    mempool.clear();
+}
+
+static void SetPoolTime(const uint256& hash, int64 nTime)
+{
+    LOCK(mempool.cs);
+    mempool.mapTx.find(hash)->second.nTime = nTime;
+}
+
+static void WriteFile(const boost::filesystem::path& path, const std::vector<char>& vch)
+{
+    std::ofstream file(path.string().c_str(), std::ios::binary | std::ios::trunc);
+    file.write(&vch[0], vch.size());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_persist)
+{
+    // Loading accepts into the global pool, so this test uses it. The file
+    // goes to a temporary path, never to the data directory
+    CTxDB txdb("r");
+    mempool.clear();
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path("test_bitcoin_mempool_%%%%%%%%.dat");
+    CMempoolDB mdb(path);
+
+    // The parent spends a made-up transaction, so it can never be loaded
+    // and is put back by hand before each load; the signed child can be
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    CTransaction txGrandParent;
+    txGrandParent.vin.resize(1);
+    txGrandParent.vin[0].scriptSig = CScript() << OP_6;
+    txGrandParent.vout.resize(1);
+    txGrandParent.vout[0].nValue = COIN;
+    CTransaction txParent = AddPoolTx(mempool, txGrandParent, 0, scriptPubKey);
+
+    CTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = txParent.vout[0].nValue - 1000000;
+    txChild.vout[0].scriptPubKey.SetDestination(CKeyID(uint160(1)));
+    BOOST_REQUIRE(SignSignature(keystore, txParent, txChild, 0));
+    bool fMissingInputs = false;
+    BOOST_REQUIRE(mempool.accept(txdb, txChild, true, &fMissingInputs));
+    uint256 hashChild = txChild.GetHash();
+
+    // Round trip, keeping the time of entry
+    int64 nTime = GetTime() - 60 * 60;
+    SetPoolTime(hashChild, nTime);
+    BOOST_CHECK(DumpMempool(mdb));
+    mempool.clear();
+    AddPoolTx(mempool, txGrandParent, 0, scriptPubKey);
+    BOOST_CHECK_EQUAL(LoadMempool(mdb), 1U);
+    const CTxMemPoolEntry* pentry = mempool.lookupEntry(hashChild);
+    BOOST_REQUIRE(pentry != NULL);
+    BOOST_CHECK_EQUAL(pentry->nTime, nTime);
+    BOOST_CHECK(pentry->fChecked);
+
+    // Entries older than -mempoolexpiry are not reloaded
+    SetPoolTime(hashChild, GetTime() - 337 * 60 * 60);
+    BOOST_CHECK(DumpMempool(mdb));
+    mempool.clear();
+    AddPoolTx(mempool, txGrandParent, 0, scriptPubKey);
+    BOOST_CHECK_EQUAL(LoadMempool(mdb), 0U);
+    BOOST_CHECK(!mempool.exists(hashChild));
+    mapArgs["-mempoolexpiry"] = "400";
+    BOOST_CHECK_EQUAL(LoadMempool(mdb), 1U);
+    mapArgs.erase("-mempoolexpiry");
+
+    // A truncated, corrupted or missing file loads nothing and leaves the
+    // pool as it was
+    SetPoolTime(hashChild, nTime);
+    BOOST_CHECK(DumpMempool(mdb));
+    std::vector<char> vchFile;
+    {
+        std::ifstream file(path.string().c_str(), std::ios::binary);
+        vchFile.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    BOOST_REQUIRE(vchFile.size() > 64);
+
+    std::vector<char> vchTruncated(vchFile.begin(), vchFile.end() - 40);
+    WriteFile(path, vchTruncated);
+    mempool.clear();
+    AddPoolTx(mempool, txGrandParent, 0, scriptPubKey);
+    BOOST_CHECK_EQUAL(LoadMempool(mdb), 0U);
+    BOOST_CHECK_EQUAL(mempool.size(), 1U);
+
+    std::vector<char> vchCorrupt = vchFile;
+    vchCorrupt[vchCorrupt.size() / 2] ^= 1;
+    WriteFile(path, vchCorrupt);
+    BOOST_CHECK_EQUAL(LoadMempool(mdb), 0U);
+    BOOST_CHECK_EQUAL(mempool.size(), 1U);
+
+    WriteFile(path, std::vector<char>(1, 0));
+    BOOST_CHECK_EQUAL(LoadMempool(mdb), 0U);
+
+    boost::filesystem::remove(path);
+    BOOST_CHECK_EQUAL(LoadMempool(mdb), 0U);
+    BOOST_CHECK_EQUAL(mempool.size(), 1U);
+
+    // The intact file still loads
+    WriteFile(path, vchFile);
+    BOOST_CHECK_EQUAL(LoadMempool(mdb), 1U);
+    boost::filesystem::remove(path);
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
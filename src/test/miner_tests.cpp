@@ -77,6 +77,14 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     }
     delete pblock;
 
+    // The height index follows the tip
+    BOOST_CHECK(vBlockIndexByHeight.size() == (unsigned int)nBestHeight + 1);
+    BOOST_CHECK(FindBlockByHeight(nBestHeight) == pindexBest);
+    BOOST_CHECK(FindBlockByHeight(nBestHeight - 1) == pindexBest->pprev);
+    BOOST_CHECK(FindBlockByHeight(0) == pindexGenesisBlock);
+    BOOST_CHECK(FindBlockByHeight(nBestHeight + 1) == NULL);
+    BOOST_CHECK(pindexBest->pprev->IsInMainChain());
+
     // Just to make sure we can still make simple blocks
     BOOST_CHECK(pblock = CreateNewBlock(reservekey));
 
@@ -141,7 +149,14 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     hash = tx.GetHash();
     mempool.addUnchecked(hash, tx);
     BOOST_CHECK(pblock = CreateNewBlock(reservekey));
+    BOOST_CHECK(pblock->vtx.size() == 3);
     delete pblock;
+    // building the template filled in the pool entries
+    const CTxMemPoolEntry* pentry = mempool.lookupEntry(hash);
+    BOOST_CHECK(pentry && pentry->fChecked);
+    BOOST_CHECK(pentry && pentry->nValueIn == 4900000000LL + 5000000000LL);
+    BOOST_CHECK(pentry && pentry->nFee == 4000000000LL);
+    BOOST_CHECK(pentry && pentry->vInHeight[0] == -1 && pentry->vInHeight[1] >= 0);
     mempool.clear();
 
     // coinbase in mempool
@@ -184,9 +199,29 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     hash = tx.GetHash();
     mempool.addUnchecked(hash, tx);
     BOOST_CHECK(pblock = CreateNewBlock(reservekey));
+    BOOST_CHECK(pblock->vtx.size() == 2);
     delete pblock;
     mempool.clear();
 
+    // a block spending the same output takes the pool transaction and its
+    // children with it; confirming the parent itself leaves the child
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    hash = tx.GetHash();
+    mempool.addUnchecked(hash, tx);
+    CTransaction txChild(tx);
+    txChild.vin[0].prevout.hash = hash;
+    txChild.vout[0].nValue -= 1000000;
+    mempool.addUnchecked(txChild.GetHash(), txChild);
+    CTransaction txConflict(tx);
+    txConflict.vout[0].scriptPubKey = CScript() << OP_2;
+    mempool.removeForBlock(std::vector<CTransaction>(1, txConflict), pindexBest->nHeight + 1);
+    BOOST_CHECK(mempool.size() == 0);
+    mempool.addUnchecked(hash, tx);
+    mempool.addUnchecked(txChild.GetHash(), txChild);
+    mempool.removeForBlock(std::vector<CTransaction>(1, tx), pindexBest->nHeight + 1);
+    BOOST_CHECK(mempool.size() == 1 && mempool.exists(txChild.GetHash()));
+    mempool.clear();
+
     // subsidy changing
     int nHeight = pindexBest->nHeight;
     pindexBest->nHeight = 209999;
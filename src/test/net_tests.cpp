@@ -0,0 +1,331 @@
+//
+// Unit tests for receive-side message framing
+//
+#include <boost/test/unit_test.hpp>
+
+#include "blockencodings.h"
+#include "main.h"
+#include "net.h"
+#include "netbase.h"
+
+extern bool CheckConnectNode(CNode* pnode, int64 nTimeMillis);
+
+// Serialized message with a correct header
+static std::vector<char> MakeMessage(const char* pszCommand, const std::vector<char>& vPayload)
+{
+    CMessageHeader hdr(pszCommand, vPayload.size());
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    std::vector<char> vMsg(ss.begin(), ss.end());
+    vMsg.insert(vMsg.end(), vPayload.begin(), vPayload.end());
+    return vMsg;
+}
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(net_framing)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+
+    std::vector<char> vPayload(100000);
+    for (unsigned int i = 0; i < vPayload.size(); i++)
+        vPayload[i] = (char)i;
+    std::vector<char> vBytes = MakeMessage("block", vPayload);
+    std::vector<char> vPing = MakeMessage("verack", std::vector<char>());
+    vBytes.insert(vBytes.end(), vPing.begin(), vPing.end());
+
+    // Trickle it in, splitting the header too
+    unsigned int nPos = 0;
+    for (unsigned int nChunk = 1; nPos < vBytes.size(); nChunk = nChunk * 3 + 1)
+    {
+        unsigned int nBytes = std::min((unsigned int)vBytes.size() - nPos, nChunk);
+        BOOST_CHECK(node.ReceiveMsgBytes(&vBytes[nPos], nBytes));
+        nPos += nBytes;
+        if (nPos < 24)
+            BOOST_CHECK(!node.vRecvMsg.front().complete());
+    }
+
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 2U);
+    CNetMessage& msg = node.vRecvMsg.front();
+    BOOST_CHECK(msg.complete());
+    BOOST_CHECK(msg.hdr.IsValid());
+    BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), "block");
+    BOOST_CHECK(std::equal(vPayload.begin(), vPayload.end(), msg.vRecv.begin()));
+    BOOST_CHECK(node.vRecvMsg.back().complete());
+    BOOST_CHECK_EQUAL(node.vRecvMsg.back().hdr.GetCommand(), "verack");
+    BOOST_CHECK(node.GetTotalRecvSize() == vBytes.size());
+}
+
+BOOST_AUTO_TEST_CASE(net_framing_oversize)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+
+    // A header announcing more than could ever be buffered is refused
+    // before anything is allocated
+    CMessageHeader hdr("block", MAX_SIZE + 1);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    std::vector<char> vBytes(ss.begin(), ss.end());
+    BOOST_CHECK(!node.ReceiveMsgBytes(&vBytes[0], vBytes.size()));
+}
+
+BOOST_AUTO_TEST_CASE(net_send_queue)
+{
+    CNode nodeFrom(INVALID_SOCKET, CAddress(), "", true);
+    CNode nodeTo(INVALID_SOCKET, CAddress(), "", true);
+
+    std::vector<char> vPayload(5000, 'x');
+    nodeFrom.PushMessage("verack");
+    nodeFrom.PushMessage("block", vPayload);
+
+    // One message shared between two peers' queues
+    CSendMsg pmsg = MakeSendMsg("block", vPayload);
+    nodeFrom.PushSendMsg(pmsg);
+    nodeTo.PushSendMsg(pmsg);
+    BOOST_CHECK_EQUAL(pmsg.use_count(), 3);
+
+    BOOST_CHECK_EQUAL(nodeFrom.vSendMsg.size(), 3U);
+    BOOST_CHECK(nodeFrom.ssSend.empty());
+    size_t nSize = 0;
+    BOOST_FOREACH(const CSendMsg& pmsgQueued, nodeFrom.vSendMsg)
+        nSize += pmsgQueued->size();
+    BOOST_CHECK_EQUAL(nodeFrom.nSendSize, nSize);
+
+    // Whatever was queued frames correctly at the other end
+    nodeTo.vSendMsg.clear();
+    BOOST_FOREACH(const CSendMsg& pmsgQueued, nodeFrom.vSendMsg)
+        BOOST_CHECK(nodeTo.ReceiveMsgBytes(&(*pmsgQueued)[0], pmsgQueued->size()));
+    BOOST_CHECK_EQUAL(nodeTo.vRecvMsg.size(), 3U);
+    BOOST_FOREACH(CNetMessage& msg, nodeTo.vRecvMsg)
+    {
+        BOOST_CHECK(msg.complete());
+        uint256 hash = Hash(msg.vRecv.begin(), msg.vRecv.end());
+        BOOST_CHECK(memcmp(&hash, &msg.hdr.nChecksum, sizeof(msg.hdr.nChecksum)) == 0);
+    }
+    std::vector<char> vReceived;
+    nodeTo.vRecvMsg.back().vRecv >> vReceived;
+    BOOST_CHECK(vReceived == vPayload);
+}
+
+BOOST_AUTO_TEST_CASE(net_stats)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+
+    node.PushMessage("verack");
+    node.PushMessage("inv", std::vector<CInv>(2));
+    node.RecordRecvMsg("version", 124, 50);
+    node.RecordRecvMsg("version", 124, 30);
+    node.RecordRecvMsg("madeup", 30, 10);
+    node.RecordRecvMsg("madeup2", 40, 10);
+
+    CNodeStats stats;
+    node.copyStats(stats);
+    BOOST_CHECK_EQUAL(stats.mapSendBytesPerMsgCmd["verack"], 24U);
+    BOOST_CHECK_EQUAL(stats.mapSendBytesPerMsgCmd["inv"], 24U + 1 + 2 * 36);
+    BOOST_CHECK_EQUAL(stats.nSendSizeMax, node.nSendSize);
+    BOOST_CHECK_EQUAL(stats.mapRecvBytesPerMsgCmd["version"], 248U);
+    BOOST_CHECK_EQUAL(stats.mapRecvUsecPerMsgCmd["version"], 80U);
+
+    // Unknown commands share one entry
+    BOOST_CHECK_EQUAL(stats.mapRecvBytesPerMsgCmd.size(), 2U);
+    BOOST_CHECK_EQUAL(stats.mapRecvBytesPerMsgCmd["*other*"], 70U);
+}
+
+BOOST_AUTO_TEST_CASE(net_getdata_block)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    node.nVersion = PROTOCOL_VERSION;
+
+    // Ask for the genesis block twice
+    std::vector<CInv> vInv;
+    vInv.push_back(CInv(MSG_BLOCK, pindexGenesisBlock->GetBlockHash()));
+    vInv.push_back(CInv(MSG_BLOCK, pindexGenesisBlock->GetBlockHash()));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << vInv;
+    std::vector<char> vBytes = MakeMessage("getdata", std::vector<char>(ss.begin(), ss.end()));
+    BOOST_CHECK(node.ReceiveMsgBytes(&vBytes[0], vBytes.size()));
+    BOOST_CHECK(ProcessMessages(&node));
+    BOOST_CHECK(node.vGetDataBlocks.empty());
+
+    // Both replies are the one buffer, straight from the block file
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 2U);
+    BOOST_CHECK(node.vSendMsg[0] == node.vSendMsg[1]);
+    BOOST_CHECK(pindexGenesisBlock->nMsgSize != 0);
+
+    CNode nodeTo(INVALID_SOCKET, CAddress(), "", true);
+    const CSerializeData& data = *node.vSendMsg[0];
+    BOOST_CHECK(nodeTo.ReceiveMsgBytes(&data[0], data.size()));
+    CNetMessage& msg = nodeTo.vRecvMsg.front();
+    BOOST_CHECK(msg.complete());
+    BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), "block");
+    uint256 hash = Hash(msg.vRecv.begin(), msg.vRecv.end());
+    BOOST_CHECK(memcmp(&hash, &msg.hdr.nChecksum, sizeof(msg.hdr.nChecksum)) == 0);
+
+    CBlock block;
+    msg.vRecv >> block;
+    BOOST_CHECK(block.GetHash() == pindexGenesisBlock->GetBlockHash());
+    BOOST_CHECK(block.hashMerkleRoot == block.BuildMerkleTree());
+}
+
+BOOST_AUTO_TEST_CASE(net_accept_header)
+{
+    // Headers we have blocks for resolve to their block index entries
+    CBlock header = pindexGenesisBlock->GetBlockHeader();
+    CBlockIndex* pindex = NULL;
+    BOOST_CHECK(header.AcceptHeader(pindex));
+    BOOST_CHECK(pindex == pindexGenesisBlock);
+
+    // A header without the work it claims is refused and scored
+    CBlockIndex* pindexBestHeaderBefore = pindexBestHeader;
+    header.hashPrevBlock = pindexGenesisBlock->GetBlockHash();
+    header.nTime++;
+    BOOST_CHECK(!header.AcceptHeader(pindex));
+    BOOST_CHECK_EQUAL(header.nDoS, 50);
+    BOOST_CHECK(pindexBestHeader == pindexBestHeaderBefore);
+}
+
+BOOST_AUTO_TEST_CASE(net_compact_block)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    node.nVersion = PROTOCOL_VERSION;
+
+    // The peer wants compact blocks, and announces our best block to us
+    // as one
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << true << (uint64)1;
+    std::vector<char> vBytes = MakeMessage("sendshort", std::vector<char>(ss.begin(), ss.end()));
+    CBlock block;
+    BOOST_CHECK(block.ReadFromDisk(pindexBest));
+    ss.clear();
+    ss << CBlockHeaderAndShortTxIDs(block);
+    std::vector<char> vCmpct = MakeMessage("shortblock", std::vector<char>(ss.begin(), ss.end()));
+    vBytes.insert(vBytes.end(), vCmpct.begin(), vCmpct.end());
+
+    // Then asks for its coinbase
+    CBlockTransactionsRequest req;
+    req.hashBlock = block.GetHash();
+    req.vIndexes.push_back(0);
+    ss.clear();
+    ss << req;
+    std::vector<char> vReq = MakeMessage("getshorttxn", std::vector<char>(ss.begin(), ss.end()));
+    vBytes.insert(vBytes.end(), vReq.begin(), vReq.end());
+
+    BOOST_CHECK(node.ReceiveMsgBytes(&vBytes[0], vBytes.size()));
+    for (int i = 0; i < 3; i++)
+        BOOST_CHECK(ProcessMessages(&node));
+    BOOST_CHECK(node.fSendCompact);
+
+    // Only the shorttxn reply goes back
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 1U);
+    CNode nodeTo(INVALID_SOCKET, CAddress(), "", true);
+    const CSerializeData& data = *node.vSendMsg[0];
+    BOOST_CHECK(nodeTo.ReceiveMsgBytes(&data[0], data.size()));
+    CNetMessage& msg = nodeTo.vRecvMsg.front();
+    BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), "shorttxn");
+    CBlockTransactions resp;
+    msg.vRecv >> resp;
+    BOOST_CHECK(resp.hashBlock == block.GetHash());
+    BOOST_CHECK_EQUAL(resp.vtx.size(), 1U);
+    BOOST_CHECK(resp.vtx[0].GetHash() == block.vtx[0].GetHash());
+
+    // Asking past the end of the block is punished
+    req.vIndexes[0] = 1;
+    ss.clear();
+    ss << req;
+    vReq = MakeMessage("getshorttxn", std::vector<char>(ss.begin(), ss.end()));
+    BOOST_CHECK(node.ReceiveMsgBytes(&vReq[0], vReq.size()));
+    ProcessMessages(&node);
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 1U);
+    BOOST_CHECK(node.fDisconnect);
+    CNode::ClearBanned();
+}
+
+BOOST_AUTO_TEST_CASE(net_compact_block_bip152)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    node.nVersion = PROTOCOL_VERSION;
+
+    // BIP 152 messages use another encoding under their own names; they
+    // are left alone rather than misread
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << true << (uint64)1;
+    std::vector<char> vBytes = MakeMessage("sendcmpct", std::vector<char>(ss.begin(), ss.end()));
+    CBlock block;
+    BOOST_CHECK(block.ReadFromDisk(pindexBest));
+    ss.clear();
+    ss << CBlockHeaderAndShortTxIDs(block);
+    std::vector<char> vCmpct = MakeMessage("cmpctblock", std::vector<char>(ss.begin(), ss.end()));
+    vBytes.insert(vBytes.end(), vCmpct.begin(), vCmpct.end());
+
+    BOOST_CHECK(node.ReceiveMsgBytes(&vBytes[0], vBytes.size()));
+    for (int i = 0; i < 2; i++)
+        BOOST_CHECK(ProcessMessages(&node));
+    BOOST_CHECK(!node.fSendCompact);
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK(!node.fDisconnect);
+}
+
+// Wait up to nMilliseconds for a started connection to become writable
+static bool WaitWritable(SOCKET hSocket, int nMilliseconds)
+{
+    struct timeval timeout;
+    timeout.tv_sec = nMilliseconds / 1000;
+    timeout.tv_usec = (nMilliseconds % 1000) * 1000;
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(hSocket, &fdset);
+    return select(hSocket + 1, NULL, &fdset, NULL, &timeout) == 1;
+}
+
+BOOST_AUTO_TEST_CASE(net_connect_timeout)
+{
+    // The socket thread's step for a started connection, driven by hand
+    // with the times it would see
+    CNode node(INVALID_SOCKET, CAddress(), "", false);
+    node.fConnecting = true;
+    node.fSocketReadable = false;
+    node.fSocketWritable = false;
+    node.nTimeConnected = 1000000;
+    int64 nStart = node.nTimeConnected * 1000;
+
+    BOOST_CHECK(CheckConnectNode(&node, nStart));
+    BOOST_CHECK(CheckConnectNode(&node, nStart + nConnectTimeout));
+    BOOST_CHECK(node.fConnecting);
+    BOOST_CHECK(!node.fDisconnect);
+    BOOST_CHECK(!CheckConnectNode(&node, nStart + nConnectTimeout + 1));
+    BOOST_CHECK(!node.fConnecting);
+    BOOST_CHECK(node.fDisconnect);
+
+    // A handshake the poll reported done is finished even when overdue
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(hListen != INVALID_SOCKET);
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sockaddr);
+    BOOST_REQUIRE(bind(hListen, (struct sockaddr*)&sockaddr, len) != SOCKET_ERROR);
+    BOOST_REQUIRE(listen(hListen, 1) != SOCKET_ERROR);
+    BOOST_REQUIRE(getsockname(hListen, (struct sockaddr*)&sockaddr, &len) != SOCKET_ERROR);
+    CService addr;
+    BOOST_REQUIRE(addr.SetSockAddr((struct sockaddr*)&sockaddr));
+
+    SOCKET hSocket;
+    BOOST_REQUIRE(StartConnectSocket(addr, hSocket));
+    BOOST_REQUIRE(WaitWritable(hSocket, 5000));
+    CNode nodeDone(hSocket, CAddress(addr), "", false);
+    nodeDone.fConnecting = true;
+    nodeDone.fSocketReadable = false;
+    nodeDone.fSocketWritable = true;
+    nodeDone.nTimeConnected = node.nTimeConnected;
+    BOOST_CHECK(!CheckConnectNode(&nodeDone, nStart + nConnectTimeout + 1));
+    BOOST_CHECK(!nodeDone.fConnecting);
+    BOOST_CHECK(!nodeDone.fDisconnect);
+    BOOST_CHECK(nodeDone.hSocket != INVALID_SOCKET);
+    closesocket(hListen);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -99,4 +99,46 @@ BOOST_AUTO_TEST_CASE(onioncat_test)
     BOOST_CHECK(addr1.IsRoutable());
 }
 
+// Wait up to a second for a started connection to become writable
+static bool WaitWritable(SOCKET hSocket)
+{
+    struct timeval timeout;
+    timeout.tv_sec = 1;
+    timeout.tv_usec = 0;
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(hSocket, &fdset);
+    return select(hSocket + 1, NULL, &fdset, NULL, &timeout) == 1;
+}
+
+BOOST_AUTO_TEST_CASE(netbase_connect_nonblocking)
+{
+    // Loopback listener on a port of the system's choosing
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(hListen != INVALID_SOCKET);
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sockaddr);
+    BOOST_REQUIRE(bind(hListen, (struct sockaddr*)&sockaddr, len) != SOCKET_ERROR);
+    BOOST_REQUIRE(listen(hListen, 1) != SOCKET_ERROR);
+    BOOST_REQUIRE(getsockname(hListen, (struct sockaddr*)&sockaddr, &len) != SOCKET_ERROR);
+    CService addr;
+    BOOST_REQUIRE(addr.SetSockAddr((struct sockaddr*)&sockaddr));
+
+    SOCKET hSocket;
+    BOOST_CHECK(StartConnectSocket(addr, hSocket));
+    BOOST_CHECK(WaitWritable(hSocket));
+    BOOST_CHECK(FinishConnectSocket(hSocket));
+    closesocket(hSocket);
+
+    // Nobody listening: starting works, finishing reports the refusal
+    closesocket(hListen);
+    BOOST_CHECK(StartConnectSocket(addr, hSocket));
+    BOOST_CHECK(WaitWritable(hSocket));
+    BOOST_CHECK(!FinishConnectSocket(hSocket));
+    closesocket(hSocket);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -22,6 +22,10 @@ using namespace boost::algorithm;
 extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 extern bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
                          bool fValidatePayToScriptHash, int nHashType);
+extern bool VerifyStandardScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                                 bool fValidatePayToScriptHash, int nHashType, bool& fResultRet);
+extern bool VerifyScriptEval(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                             bool fValidatePayToScriptHash, int nHashType);
 
 CScript
 ParseScript(string s)
@@ -328,6 +332,49 @@ BOOST_AUTO_TEST_CASE(script_CHECKMULTISIG23)
     BOOST_CHECK(!VerifyScript(badsig6, scriptPubKey23, txTo23, 0, true, 0));
 }    
 
+BOOST_AUTO_TEST_CASE(script_CHECKMULTISIG_ecverify)
+{
+    // Both engines agree, including when they get already parsed
+    // public keys from the cache
+    CKey key1, key2, key3;
+    key1.MakeNewKey(true);
+    key2.MakeNewKey(false);
+    key3.MakeNewKey(true);
+
+    CScript scriptPubKey12;
+    scriptPubKey12 << OP_1 << key1.GetPubKey() << key2.GetPubKey() << OP_2 << OP_CHECKMULTISIG;
+
+    for (int nEngine = 0; nEngine < 2; nEngine++)
+    {
+        SetECVerifyEngine(nEngine == 0 ? ECVERIFY_OPENSSL : ECVERIFY_SECP256K1);
+        for (int i = 0; i < 3; i++)
+        {
+            CTransaction txFrom12;
+            txFrom12.vout.resize(1);
+            txFrom12.vout[0].scriptPubKey = scriptPubKey12;
+
+            CTransaction txTo12;
+            txTo12.vin.resize(1);
+            txTo12.vout.resize(1);
+            txTo12.vin[0].prevout.n = 0;
+            txTo12.vin[0].prevout.hash = txFrom12.GetHash();
+            txTo12.vout[0].nValue = 1 + i + 10 * nEngine;
+
+            CScript goodsig1 = sign_multisig(scriptPubKey12, key1, txTo12);
+            BOOST_CHECK(VerifyScript(goodsig1, scriptPubKey12, txTo12, 0, true, 0));
+            CScript goodsig2 = sign_multisig(scriptPubKey12, key2, txTo12);
+            BOOST_CHECK(VerifyScript(goodsig2, scriptPubKey12, txTo12, 0, true, 0));
+            CScript badsig1 = sign_multisig(scriptPubKey12, key3, txTo12);
+            BOOST_CHECK(!VerifyScript(badsig1, scriptPubKey12, txTo12, 0, true, 0));
+
+            txTo12.vout[0].nValue++;
+            BOOST_CHECK(!VerifyScript(goodsig1, scriptPubKey12, txTo12, 0, true, 0));
+            BOOST_CHECK(!VerifyScript(goodsig2, scriptPubKey12, txTo12, 0, true, 0));
+        }
+    }
+    SetECVerifyEngine(ECVERIFY_OPENSSL);
+}
+
 BOOST_AUTO_TEST_CASE(script_combineSigs)
 {
     // Test the CombineSignatures function
@@ -442,4 +489,140 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+// Run both the template fast path and the interpreter; they must agree.
+// Returns true if the fast path handled the scripts.
+static bool
+CheckStandardMatchesEval(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                         bool fStrict, int nHashType, const string& strTest)
+{
+    bool fEval = VerifyScriptEval(scriptSig, scriptPubKey, txTo, nIn, fStrict, nHashType);
+    BOOST_CHECK_MESSAGE(VerifyScript(scriptSig, scriptPubKey, txTo, nIn, fStrict, nHashType) == fEval, strTest);
+
+    bool fFast = !fEval;
+    if (!VerifyStandardScript(scriptSig, scriptPubKey, txTo, nIn, fStrict, nHashType, fFast))
+        return false;
+    BOOST_CHECK_MESSAGE(fFast == fEval, strTest);
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(script_standard_differential)
+{
+    // Script test vectors; almost none are standard, but all must agree
+    const char* scriptFiles[] = { "script_valid.json", "script_invalid.json" };
+    for (int f = 0; f < 2; f++)
+    {
+        Array tests = read_json(scriptFiles[f]);
+        BOOST_FOREACH(Value& tv, tests)
+        {
+            Array test = tv.get_array();
+            if (test.size() < 2)
+                continue;
+            string strTest = write_string(tv, false);
+            CScript scriptSig = ParseScript(test[0].get_str());
+            CScript scriptPubKey = ParseScript(test[1].get_str());
+            CTransaction tx;
+            CheckStandardMatchesEval(scriptSig, scriptPubKey, tx, 0, true, SIGHASH_NONE, strTest);
+            CheckStandardMatchesEval(scriptSig, scriptPubKey, tx, 0, false, SIGHASH_NONE, strTest);
+        }
+    }
+
+    // Transaction test vectors: real-world pay-to-pubkey-hash spends
+    int nFast = 0;
+    const char* txFiles[] = { "tx_valid.json", "tx_invalid.json" };
+    for (int f = 0; f < 2; f++)
+    {
+        Array tests = read_json(txFiles[f]);
+        BOOST_FOREACH(Value& tv, tests)
+        {
+            Array test = tv.get_array();
+            if (test[0].type() != array_type || test.size() != 3)
+                continue;
+            string strTest = write_string(tv, false);
+
+            map<COutPoint, CScript> mapprevOutScriptPubKeys;
+            BOOST_FOREACH(Value& input, test[0].get_array())
+            {
+                Array vinput = input.get_array();
+                mapprevOutScriptPubKeys[COutPoint(uint256(vinput[0].get_str()), vinput[1].get_int())] = ParseScript(vinput[2].get_str());
+            }
+
+            CDataStream stream(ParseHex(test[1].get_str()), SER_NETWORK, PROTOCOL_VERSION);
+            CTransaction tx;
+            stream >> tx;
+            for (unsigned int i = 0; i < tx.vin.size(); i++)
+                if (CheckStandardMatchesEval(tx.vin[i].scriptSig, mapprevOutScriptPubKeys[tx.vin[i].prevout], tx, i,
+                                             test[2].get_bool(), 0, strTest))
+                    nFast++;
+        }
+    }
+    BOOST_CHECK(nFast > 0);
+
+    // Every standard template, bare and wrapped in pay-to-script-hash, with
+    // every scriptSig tried against every scriptPubKey
+    CBasicKeyStore keystore;
+    vector<CKey> keys;
+    for (int i = 0; i < 4; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i%2 == 0);
+        keys.push_back(key);
+        if (i < 3)
+            keystore.AddKey(key);
+    }
+    vector<CKey> keys12(keys.begin(), keys.begin() + 2);
+    vector<CKey> keys123(keys.begin(), keys.begin() + 3);
+
+    CScript standardScripts[6];
+    standardScripts[0] << keys[0].GetPubKey() << OP_CHECKSIG;
+    standardScripts[1].SetDestination(keys[1].GetPubKey().GetID());
+    standardScripts[2].SetMultisig(1, keys12);
+    standardScripts[3].SetMultisig(2, keys123);
+    standardScripts[4].SetMultisig(3, keys123);
+    standardScripts[5] << keys[3].GetPubKey() << OP_CHECKSIG; // not in keystore
+
+    CTransaction txFrom;
+    txFrom.vout.resize(12);
+    for (int i = 0; i < 6; i++)
+    {
+        keystore.AddCScript(standardScripts[i]);
+        txFrom.vout[i].scriptPubKey = standardScripts[i];
+        txFrom.vout[i+6].scriptPubKey.SetDestination(standardScripts[i].GetID());
+    }
+
+    CTransaction txTo[12];
+    for (int i = 0; i < 12; i++)
+    {
+        txTo[i].vin.resize(1);
+        txTo[i].vout.resize(1);
+        txTo[i].vin[0].prevout.n = i;
+        txTo[i].vin[0].prevout.hash = txFrom.GetHash();
+        txTo[i].vout[0].nValue = 1;
+        SignSignature(keystore, txFrom, txTo[i], 0);
+    }
+
+    nFast = 0;
+    for (int i = 0; i < 12; i++)
+        for (int j = 0; j < 12; j++)
+            for (int fStrict = 0; fStrict < 2; fStrict++)
+            {
+                string strTest = strprintf("standard %d %d %d", i, j, fStrict);
+                const CScript& scriptPubKey = txFrom.vout[i].scriptPubKey;
+                const CScript& scriptSig = txTo[j].vin[0].scriptSig;
+                if (CheckStandardMatchesEval(scriptSig, scriptPubKey, txTo[i], 0, fStrict, 0, strTest))
+                    nFast++;
+
+                // Extra leading item, and a different transaction (invalid signatures)
+                CScript scriptSigExtra = CScript() << OP_0;
+                scriptSigExtra.insert(scriptSigExtra.end(), scriptSig.begin(), scriptSig.end());
+                CheckStandardMatchesEval(scriptSigExtra, scriptPubKey, txTo[i], 0, fStrict, 0, strTest + " extra");
+                CheckStandardMatchesEval(scriptSig, scriptPubKey, txTo[(i+1)%12], 0, fStrict, 0, strTest + " othertx");
+            }
+    BOOST_CHECK(nFast > 0);
+
+    for (int i = 0; i < 12; i++)
+        if (i%6 != 5)
+            BOOST_CHECK_MESSAGE(VerifyScript(txTo[i].vin[0].scriptSig, txFrom.vout[i].scriptPubKey, txTo[i], 0, true, 0),
+                                strprintf("standard %d", i));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,228 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include <openssl/sha.h>
+
+#include "main.h"
+#include "sha256.h"
+#include "util.h"
+
+using namespace std;
+
+static const char* implementations[] = { "generic", "sse41", "avx2", "shani" };
+
+static string HashHex(const string& str, size_t nChunk)
+{
+    // Write in pieces of nChunk bytes to cover the partial block buffering
+    CSHA256 hasher;
+    for (size_t nPos = 0; nPos < str.size(); nPos += nChunk)
+        hasher.Write((const unsigned char*)str.data() + nPos, min(nChunk, str.size() - nPos));
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    hasher.Finalize(hash);
+    return HexStr(hash, hash + sizeof(hash));
+}
+
+BOOST_AUTO_TEST_SUITE(sha256_tests)
+
+BOOST_AUTO_TEST_CASE(sha256_known_answers)
+{
+    // FIPS 180-2 examples, plus messages around the padding boundaries
+    static const char* vectors[][2] =
+    {
+        { "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+        { "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+          "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+        { "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+          "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1" },
+    };
+    string strMillion(1000000, 'a');
+
+    const char* pszDefault = SHA256Implementation();
+    for (int i = 0; i < 4; i++)
+    {
+        if (!SHA256Select(implementations[i]))
+            continue;
+        BOOST_CHECK_EQUAL(SHA256Implementation(), implementations[i]);
+
+        for (int j = 0; j < 4; j++)
+            for (size_t nChunk = 1; nChunk <= 128; nChunk += 9)
+                BOOST_CHECK_EQUAL(HashHex(vectors[j][0], nChunk), vectors[j][1]);
+        BOOST_CHECK_EQUAL(HashHex(strMillion, 1000000), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+        BOOST_CHECK_EQUAL(HashHex(strMillion, 1000), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+
+        // Every length through a few blocks, against OpenSSL
+        for (size_t nLen = 0; nLen < 200; nLen++)
+        {
+            string str = strMillion.substr(0, nLen);
+            unsigned char hash[32];
+            SHA256((const unsigned char*)str.data(), nLen, hash);
+            BOOST_CHECK_EQUAL(HashHex(str, 64), HexStr(hash, hash + sizeof(hash)));
+        }
+
+        // Reset() and double hashing
+        CSHA256 hasher;
+        hasher.Write((const unsigned char*)"garbage", 7).Reset().Write((const unsigned char*)"abc", 3);
+        uint256 hash1, hash2;
+        hasher.Finalize((unsigned char*)&hash1);
+        CSHA256().Write((unsigned char*)&hash1, sizeof(hash1)).Finalize((unsigned char*)&hash2);
+        string strABC = "abc";
+        BOOST_CHECK(hash2 == Hash(strABC.begin(), strABC.end()));
+        BOOST_CHECK_EQUAL(hash2.GetHex(), "58636c3ec08c12d55aedda056d602d5bcca72d8df6a69b519b72d32dc2428b4f");
+    }
+    BOOST_CHECK(SHA256Select(pszDefault));
+    BOOST_CHECK(!SHA256Select("avx2"));
+}
+
+BOOST_AUTO_TEST_CASE(sha256_batch)
+{
+    // Messages of every length around the one and two block padding boundaries,
+    // in an order that leaves the lanes finishing at different times
+    vector<vector<unsigned char> > vMessages;
+    for (int n = 0; n < 300; n++)
+    {
+        vector<unsigned char> vch((n * 37) % 300);
+        for (unsigned int i = 0; i < vch.size(); i++)
+            vch[i] = GetRand(256);
+        vMessages.push_back(vch);
+    }
+    vector<const unsigned char*> vpin;
+    vector<size_t> vnLen;
+    vector<uint256> vExpected;
+    BOOST_FOREACH(const vector<unsigned char>& vch, vMessages)
+    {
+        vpin.push_back(vch.empty() ? NULL : &vch[0]);
+        vnLen.push_back(vch.size());
+        vExpected.push_back(Hash(vch.begin(), vch.end()));
+    }
+
+    const char* pszDefault = SHA256BatchImplementation();
+    for (int i = 0; i < 4; i++)
+    {
+        if (!SHA256BatchSelect(implementations[i]))
+            continue;
+        BOOST_CHECK_EQUAL(SHA256BatchImplementation(), implementations[i]);
+
+        // Every count from 1 up, so partly filled lane sets are covered
+        for (unsigned int nCount = 1; nCount <= 20; nCount++)
+        {
+            vector<uint256> vHash(nCount);
+            SHA256DBatch((unsigned char*)&vHash[0], &vpin[0], &vnLen[0], nCount);
+            for (unsigned int j = 0; j < nCount; j++)
+                BOOST_CHECK(vHash[j] == vExpected[j]);
+        }
+        vector<uint256> vHash(vMessages.size());
+        SHA256DBatch((unsigned char*)&vHash[0], &vpin[0], &vnLen[0], vMessages.size());
+        BOOST_CHECK(vHash == vExpected);
+
+        vector<unsigned char> vch64(64 * 9);
+        for (unsigned int j = 0; j < vch64.size(); j++)
+            vch64[j] = GetRand(256);
+        vHash.resize(9);
+        SHA256D64((unsigned char*)&vHash[0], &vch64[0], 9);
+        for (unsigned int j = 0; j < 9; j++)
+            BOOST_CHECK(vHash[j] == Hash(vch64.begin() + 64 * j, vch64.begin() + 64 * (j + 1)));
+    }
+    BOOST_CHECK(SHA256BatchSelect(pszDefault));
+    BOOST_CHECK(!SHA256BatchSelect("none"));
+}
+
+BOOST_AUTO_TEST_CASE(sha256_scan_nonces)
+{
+    CBlock block;
+    block.nVersion = 2;
+    block.hashPrevBlock = GetRandHash();
+    block.hashMerkleRoot = GetRandHash();
+    block.nTime = 1350000000;
+    block.nBits = 0x1d00ffff;
+
+    // Nonces whose hash has a top word of at most 0x00ffffff, about one in 256,
+    // including a range that wraps around
+    static const unsigned int starts[] = { 0, 0xfffff800 };
+    const unsigned int nTargetHigh = 0x00ffffff;
+    const char* pszDefault = SHA256BatchImplementation();
+    for (int s = 0; s < 2; s++)
+    {
+        vector<unsigned int> vExpected;
+        for (unsigned int n = 0; n < 4000; n++)
+        {
+            block.nNonce = starts[s] + n;
+            if ((block.GetHash().Get64(3) >> 32) <= nTargetHigh)
+                vExpected.push_back(block.nNonce);
+        }
+        BOOST_CHECK(vExpected.size() > 0);
+
+        unsigned char pheader[80];
+        memcpy(pheader, BEGIN(block.nVersion), sizeof(pheader));
+        for (int i = 0; i < 4; i++)
+        {
+            if (!SHA256BatchSelect(implementations[i]))
+                continue;
+
+            // Odd sized calls, so matches and range ends fall inside lane groups
+            vector<unsigned int> vFound;
+            unsigned int nNonce = starts[s], nTotal = 0;
+            while (nTotal < 4000)
+            {
+                unsigned int nHashesDone = 0;
+                unsigned int nBegin = nNonce;
+                unsigned int nCount = min(37U, 4000 - nTotal);
+                if (SHA256ScanNonces(pheader, nTargetHigh, nNonce, nCount, nHashesDone))
+                {
+                    BOOST_CHECK_EQUAL(nHashesDone, nNonce - nBegin + 1);
+                    vFound.push_back(nNonce++);
+                }
+                else
+                {
+                    BOOST_CHECK_EQUAL(nHashesDone, nCount);
+                    BOOST_CHECK_EQUAL(nNonce, nBegin + nCount);
+                }
+                nTotal += nHashesDone;
+            }
+            BOOST_CHECK(vFound == vExpected);
+        }
+        BOOST_CHECK(SHA256BatchSelect(pszDefault));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256_merkle)
+{
+    for (int nTx = 1; nTx <= 40; nTx += (nTx < 10 ? 1 : 7))
+    {
+        CBlock block;
+        for (int i = 0; i < nTx; i++)
+        {
+            CTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].scriptSig << i << vector<unsigned char>(i * 13 % 200, 0x55);
+            tx.vout.resize(1);
+            tx.vout[0].nValue = i;
+            block.vtx.push_back(tx);
+        }
+
+        // Merkle root one pair at a time
+        vector<uint256> vTree;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            vTree.push_back(tx.GetHash());
+        int j = 0;
+        for (int nSize = nTx; nSize > 1; nSize = (nSize + 1) / 2)
+        {
+            for (int i = 0; i < nSize; i += 2)
+            {
+                int i2 = std::min(i+1, nSize-1);
+                vTree.push_back(Hash(BEGIN(vTree[j+i]), END(vTree[j+i]), BEGIN(vTree[j+i2]), END(vTree[j+i2])));
+            }
+            j += nSize;
+        }
+
+        vector<uint256> vTxHash = block.GetTxHashes();
+        for (int i = 0; i < nTx; i++)
+            BOOST_CHECK(vTxHash[i] == block.vtx[i].GetHash());
+        BOOST_CHECK(block.BuildMerkleTree() == vTree.back());
+        for (int i = 0; i < nTx; i++)
+            BOOST_CHECK(CBlock::CheckMerkleBranch(vTxHash[i], block.GetMerkleBranch(i), i) == vTree.back());
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,77 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+#define SKIPLIST_LENGTH 300000
+
+BOOST_AUTO_TEST_SUITE(skiplist_tests)
+
+BOOST_AUTO_TEST_CASE(skiplist_test)
+{
+    std::vector<CBlockIndex> vIndex(SKIPLIST_LENGTH);
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndex[i].BuildSkip();
+    }
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        if (i > 0) {
+            BOOST_CHECK(vIndex[i].pskip == &vIndex[vIndex[i].pskip->nHeight]);
+            BOOST_CHECK(vIndex[i].pskip->nHeight < i);
+        } else {
+            BOOST_CHECK(vIndex[i].pskip == NULL);
+        }
+    }
+
+    for (int i=0; i < 1000; i++) {
+        int from = GetRand(SKIPLIST_LENGTH - 1);
+        int to = GetRand(from + 1);
+
+        BOOST_CHECK(vIndex[SKIPLIST_LENGTH - 1].GetAncestor(from) == &vIndex[from]);
+        BOOST_CHECK(vIndex[from].GetAncestor(to) == &vIndex[to]);
+        BOOST_CHECK(vIndex[from].GetAncestor(0) == &vIndex[0]);
+    }
+
+    BOOST_CHECK(vIndex[100].GetAncestor(101) == NULL);
+    BOOST_CHECK(vIndex[100].GetAncestor(-1) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(skiplist_fork)
+{
+    // Two branches off a common trunk find their ancestors on their own side
+    std::vector<CBlockIndex> vTrunk(5000), vBranchA(3000), vBranchB(4000);
+    for (int i=0; i<5000; i++) {
+        vTrunk[i].nHeight = i;
+        vTrunk[i].pprev = (i == 0) ? NULL : &vTrunk[i - 1];
+        vTrunk[i].BuildSkip();
+    }
+    for (int i=0; i<3000; i++) {
+        vBranchA[i].nHeight = 5000 + i;
+        vBranchA[i].pprev = (i == 0) ? &vTrunk[4999] : &vBranchA[i - 1];
+        vBranchA[i].BuildSkip();
+    }
+    for (int i=0; i<4000; i++) {
+        vBranchB[i].nHeight = 5000 + i;
+        vBranchB[i].pprev = (i == 0) ? &vTrunk[4999] : &vBranchB[i - 1];
+        vBranchB[i].BuildSkip();
+    }
+
+    for (int i=0; i < 1000; i++) {
+        int nHeight = GetRand(8000);
+        CBlockIndex* pindexA = vBranchA[2999].GetAncestor(nHeight);
+        CBlockIndex* pindexB = vBranchB[3999].GetAncestor(nHeight);
+        if (nHeight < 5000) {
+            BOOST_CHECK(pindexA == &vTrunk[nHeight]);
+            BOOST_CHECK(pindexB == &vTrunk[nHeight]);
+        } else {
+            BOOST_CHECK(pindexA == &vBranchA[nHeight - 5000]);
+            BOOST_CHECK(pindexB == &vBranchB[nHeight - 5000]);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
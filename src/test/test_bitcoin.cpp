@@ -15,6 +15,7 @@ struct TestingSetup {
     TestingSetup() {
         fPrintToDebugger = true; // don't want to write to debug.log file
         noui_connect();
+        SHA256AutoDetect();
         bitdb.MakeMock();
         LoadBlockIndex(true);
         bool fFirstRun;